@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -47,6 +48,7 @@ typedef struct core
 
 	sig_atomic_t int_disabled;
 	sig_atomic_t halted;
+	sig_atomic_t restarted;		/* A restart came while the core was not halted */
 	rlnode halted_node;
 	pthread_cond_t halt_cond;
 
@@ -675,6 +677,7 @@ void vm_boot(interrupt_handler bootfunc, uint cores, uint serialno)
 
 		pthread_cond_init(& CORE[c].halt_cond, NULL);
 		CORE[c].halted = 0;
+		CORE[c].restarted = 0;
 		rlnode_init(& CORE[c].halted_node, &CORE[c]);
 
 		/* Initialize Core statistics */
@@ -739,23 +742,34 @@ void cpu_core_halt()
 	assert(! core->int_disabled);
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 	pthread_mutex_lock(& core_halt_mutex);
-	core->halted = 1;
-	rlist_push_front(&halted_list, & core->halted_node);
-	while(core->halted)
-		pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	/* A restart that came on the way here is not lost */
+	if(! core->restarted) {
+		core->halted = 1;
+		rlist_push_front(&halted_list, & core->halted_node);
+		while(core->halted)
+			pthread_cond_wait(& core->halt_cond, & core_halt_mutex);
+	}
+	core->restarted = 0;
 	assert(! core->halted);
 	pthread_mutex_unlock(& core_halt_mutex);
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 	dispatch_interrupts(core);
 }
 
+void cpu_spin_yield()
+{
+	sched_yield();
+}
+
 static inline void core_restart(Core* core)
 {
 	if(core->halted) {
 		core->halted = 0;
 		rlist_remove(& core->halted_node);
 		pthread_cond_signal(& core->halt_cond);
-	}	
+	} else {
+		core->restarted = 1;
+	}
 }
 
 void cpu_core_restart(uint c)
@@ -782,6 +796,13 @@ void cpu_core_restart_all()
 	pthread_mutex_unlock(& core_halt_mutex);	
 }
 
+int cpu_irq_stats(uint c, Interrupt intno, int* delivered)
+{
+	assert(c < MAX_CORES && intno < maximum_interrupt_no);
+	if(delivered) *delivered = CORE[c].irq_delivered[intno];
+	return CORE[c].irq_raised[intno];
+}
+
 void cpu_core_barrier_sync()
 {
 	pthread_barrier_wait(& core_barrier);
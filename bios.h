@@ -238,10 +238,23 @@ void cpu_enable_interrupts();
 void cpu_core_halt();
 
 
+/**
+	@brief Let the host run other cores, from inside a long spin loop.
+
+	The simulated cores are threads of the host, and there may be more of
+	them than host cpus. A core that spins, waiting for another core which
+	the host does not run, wastes its whole host timeslice. Much like a
+	pause-loop exit on a virtual machine, this call gives the host cpu away.
+*/
+void cpu_spin_yield();
+
+
 /**
 	@brief Restart the given core.
 
-	This call will restart the given core, if it was halted.
+	This call will restart the given core, if it was halted. If it was not,
+	the next call to cpu_core_halt() on that core returns at once, so that
+	a restart sent just before the core halts is not lost.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -261,6 +274,17 @@ void cpu_core_restart_one();
 void cpu_core_restart_all();
 
 
+/**
+	@brief Return the interrupt statistics of a core.
+
+	Return the number of times interrupt @c intno was raised to core @c c,
+	and, if @c delivered is not NULL, store there the number of times it was
+	delivered to the core. The statistics are reset by @c vm_boot(), and
+	remain available after it returns.
+*/
+int cpu_irq_stats(uint c, Interrupt intno, int* delivered);
+
+
 /********************************************************************************
  ********************************************************************************/
 
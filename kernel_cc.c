@@ -1,5 +1,6 @@
 #include "kernel_sched.h"
 #include "kernel_cc.h"
+#include "kernel_timer.h"
 /**
   @file kernel_cc.c
 
@@ -33,65 +34,293 @@ int get_core_preemption() {
  * The kernel locks
  *
  */
-Mutex kernel_mutex = MUTEX_INIT;          /* lock for resource tables */
+/*
+  Spinlocks.
+
+  A ticket lock hands the lock over in FIFO order, so that no core starves
+  under contention, and a waiter backs off in proportion to its place in
+  the line, so that the lock word is read less often. A waiter that spins
+  for long lets the host run the other cores, since the core next in line
+  may not be running at all. With SPINLOCK_TAS, they are the test-and-set
+  locks of old, for comparison.
+*/
+#define SPIN_YIELD_PAUSES 256
+void Spin_Lock(Spinlock *lock) {
+#ifdef SPINLOCK_TAS
+    while (__atomic_exchange_n(&lock->next, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&lock->next, __ATOMIC_RELAXED)) { __builtin_ia32_pause(); }
+    }
+#else
+    unsigned short ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint pauses = 0;
+    for (;;) {
+        unsigned short serving = __atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE);
+        if (serving == ticket) { break; }
+        if (pauses >= SPIN_YIELD_PAUSES) { cpu_spin_yield(); }
+        for (unsigned short k = ticket - serving; k > 0; k--, pauses++) { __builtin_ia32_pause(); }
+    }
+#endif
+}
+void Spin_Unlock(Spinlock *lock) {
+#ifdef SPINLOCK_TAS
+    __atomic_store_n(&lock->next, 0, __ATOMIC_RELEASE);
+#else
+    __atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+#endif
+}
+/** \cond HELPER Helper structure for sleeping on a mutex. */
+typedef struct __mutex_waiter {
+    TCB *thread;
+    struct __mutex_waiter *next;
+    int woken;
+} __mutex_waiter;
+/** \endcond */
+/*
+  The wait queues of mutexes are guarded by a small table of spinlocks,
+  hashed by the address of the mutex, so that a mutex needs no lock of its
+  own. They are only taken with preemption off, so they never sleep.
+*/
+#define MUTEX_WAIT_LOCKS 64
+static Spinlock mutex_wait_locks[MUTEX_WAIT_LOCKS];
+static inline Spinlock *mutex_wait_lock(Mutex *lock) {
+    return &mutex_wait_locks[((uintptr_t) lock >> 4) % MUTEX_WAIT_LOCKS];
+}
+/*
+  The wait queue is a circular list, and lock->waiters points to its tail,
+  so that waiters are appended and woken in FIFO order. These helpers must
+  be called with the wait lock held.
+*/
+static void mutex_enqueue(Mutex *lock, __mutex_waiter *w) {
+    __mutex_waiter *tail = lock->waiters;
+    if (tail == NULL) { w->next = w; }
+    else {
+        w->next = tail->next;
+        tail->next = w;
+    }
+    __atomic_store_n(&lock->waiters, w, __ATOMIC_RELAXED);
+}
+static void mutex_dequeue(Mutex *lock, __mutex_waiter *w) {
+    __mutex_waiter *tail = lock->waiters;
+    __mutex_waiter *prev = tail;
+    while (prev->next != w) { prev = prev->next; }
+    prev->next = w->next;
+    if (w == tail) { __atomic_store_n(&lock->waiters, (w == prev) ? NULL : prev, __ATOMIC_RELAXED); }
+}
+/*
+  Spinning only pays while the holder is running on another core, since
+  it may let go of the mutex soon. The holder may exit and its TCB be
+  reused meanwhile; this is called inside tcb_read_lock, so the read is
+  safe, and a stale answer only costs a spin bounded by MUTEX_SPINS.
+*/
+static inline int mutex_owner_running(Mutex *lock) {
+    TCB *owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+    return owner == NULL || __atomic_load_n(&owner->state, __ATOMIC_RELAXED) == RUNNING;
+}
+/*
+  Sleep until the mutex is released, unless it is released meanwhile.
+  Returns 1 iff the mutex was acquired.
+ */
+static int mutex_sleep(Mutex *lock) {
+    Spinlock *wait_lock = mutex_wait_lock(lock);
+    __mutex_waiter w = { CURTHREAD, NULL, 0 };
+    int preempt = preempt_off;
+    Spin_Lock(wait_lock);
+    mutex_enqueue(lock, &w);
+    /* Pairs with the fence in Mutex_Unlock, so a wakeup is never lost */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+        mutex_dequeue(lock, &w);
+        Spin_Unlock(wait_lock);
+        if (preempt) { preempt_on; }
+        return 1;
+    }
+    /* An interrupted thread does not stop, it sleeps again until it is woken */
+    while (!w.woken) {
+        sleep_releasing_spinlock(STOPPED, wait_lock);
+        Spin_Lock(wait_lock);
+    }
+    Spin_Unlock(wait_lock);
+    if (preempt) { preempt_on; }
+    return 0;
+}
+/*
+  Wake up the first thread sleeping on the mutex. It competes for the
+  mutex again, so a running thread may take it first.
+ */
+static void mutex_wake(Mutex *lock) {
+    Spinlock *wait_lock = mutex_wait_lock(lock);
+    int preempt = preempt_off;
+    Spin_Lock(wait_lock);
+    __mutex_waiter *tail = lock->waiters;
+    if (tail != NULL) {
+        __mutex_waiter *w = tail->next;
+        mutex_dequeue(lock, w);
+        w->woken = 1;
+        wakeup_if_stopped(w->thread);
+    }
+    Spin_Unlock(wait_lock);
+    if (preempt) { preempt_on; }
+}
 /*Our edits*/
 void Mutex_Lock(Mutex *lock) {
 #define MUTEX_SPINS 1000
-#define MAX_SPIN_COUNTER (10)
-    int spin = MUTEX_SPINS;
-    int spin_counter = 0;//Used to detect need for priority inversion
-    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
-        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-            __builtin_ia32_pause();
-            if (spin > 0) { spin--; }
-            else {
-                spin = MUTEX_SPINS;
-                spin_counter++;
-                if (get_core_preemption()) {
-                    if (spin_counter >= MAX_SPIN_COUNTER) {
-                        ASSERT(CURTHREAD != NULL);
-                        CURTHREAD->yield_state = DEADLOCKED;
-                    }
-                    yield();
+    if (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) {
+        if (get_core_preemption()) {
+            /* Spin while the holder runs, then lend it our priority and sleep */
+            ASSERT(CURTHREAD != NULL);
+            for (;;) {
+                int spin = MUTEX_SPINS;
+                tcb_read_lock();
+                while (spin > 0 && __atomic_load_n(&lock->locked, __ATOMIC_RELAXED) &&
+                       mutex_owner_running(lock)) {
+                    __builtin_ia32_pause();
+                    spin--;
                 }
+                tcb_read_unlock();
+                if (!__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE)) { break; }
+                sched_inherit_priority(lock);
+                if (mutex_sleep(lock)) { break; }
             }
+            CURTHREAD->blocked_on = NULL;
+        } else {
+            /* In the non-preemptive domain, this is a spinlock */
+            do {
+                while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED)) { __builtin_ia32_pause(); }
+            } while (__atomic_test_and_set(&lock->locked, __ATOMIC_ACQUIRE));
         }
     }
+    TCB *cur = CURTHREAD;
+    __atomic_store_n(&lock->owner, cur, __ATOMIC_RELAXED);
+    if (cur != NULL) { cur->mutexes_held++; }
 #undef MUTEX_SPINS
 }
 /*
   Pre-emption aware mutex.
   -------------------------
 
-  This mutex will act as a mx if preemption is off, and a
-  yielding mutex if it is on.
+  This mutex will act as a spinlock if preemption is off, and a
+  sleeping mutex if it is on.
 
  */
+static void mutex_unlock(Mutex *lock, int state_locked) {
+    TCB *owner = lock->owner;
+    __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELAXED);
+    __atomic_clear(&lock->locked, __ATOMIC_RELEASE);
+    /* Wake up a sleeper, and drop the priority inherited through this mutex */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->waiters, __ATOMIC_RELAXED) != NULL) { mutex_wake(lock); }
+    if (owner == NULL) { return; }
+    owner->mutexes_held--;
+    if (__atomic_load_n(&owner->pi_lock, __ATOMIC_RELAXED) == lock) {
+        if (state_locked) { sched_restore_priority_locked(owner); }
+        else { sched_restore_priority(owner); }
+    }
+}
 void Mutex_Unlock(Mutex *lock) {
-    __atomic_clear(lock, __ATOMIC_RELEASE);
+    mutex_unlock(lock, 0);
+}
+void Mutex_Unlock_locked(Mutex *lock) {
+    mutex_unlock(lock, 1);
 }
 /** \cond HELPER Helper structure for condition variables. */
 typedef struct __cv_waitset_node {
     void *thread;
     struct __cv_waitset_node *next;
+    CondVar *cv;
+    enum { CV_INIT, CV_WAITING, CV_BROADCAST, CV_SIGNALLED, CV_TIMEDOUT } state;
 } __cv_waitset_node;
 /** \endcond */
 /*
   Condition variables.
+
+  The waitset_lock is always taken with preemption off, because timeouts
+  wake up waiters from inside the scheduler.
+
+  The waitset is a circular list, and cv->waitset points to its tail, so
+  that waiters are appended and signalled in FIFO order. These helpers
+  must be called with the waitset_lock held.
 */
+static void cv_enqueue(CondVar *cv, __cv_waitset_node *node) {
+    __cv_waitset_node *tail = cv->waitset;
+    if (tail == NULL) { node->next = node; }
+    else {
+        node->next = tail->next;
+        tail->next = node;
+    }
+    cv->waitset = node;
+}
+static void cv_dequeue(CondVar *cv, __cv_waitset_node *node) {
+    __cv_waitset_node *tail = cv->waitset;
+    __cv_waitset_node *prev = tail;
+    while (prev->next != node) { prev = prev->next; }
+    prev->next = node->next;
+    if (node == tail) { cv->waitset = (node == prev) ? NULL : prev; }
+}
+/*
+  Timer callback for Cond_Wait_with_timeout. Remove the waiter from the
+  waitset and wake it up, unless it has been signalled already.
+ */
+static void cv_timeout(TimeoutCB *t) {
+    __cv_waitset_node *node = t->data;
+    CondVar *cv = node->cv;
+    Spin_Lock(&(cv->waitset_lock));
+    if (node->state == CV_WAITING) {
+        cv_dequeue(cv, node);
+        node->state = CV_TIMEDOUT;
+        wakeup_if_stopped(node->thread);
+    } else if (node->state == CV_INIT) {
+        /* The waiter has not gone to sleep yet, it will not */
+        node->state = CV_TIMEDOUT;
+    }
+    Spin_Unlock(&(cv->waitset_lock));
+}
+/*
+  Wait on cv, with an optional timer already armed for this node, releasing
+  either a mutex or a spinlock. Returns 0 iff the wait timed out.
+ */
+static int cv_wait(Mutex *mutex, Spinlock *spinlock, CondVar *cv, __cv_waitset_node *node) {
+    int preempt = preempt_off;
+    Spin_Lock(&(cv->waitset_lock));
+    if (node->state == CV_TIMEDOUT) {
+        Spin_Unlock(&(cv->waitset_lock));
+        if (preempt) { preempt_on; }
+        return 0;
+    }
+    /* We just append the current thread to the list */
+    node->state = CV_WAITING;
+    cv_enqueue(cv, node);
+    /* Now atomically release mutex and sleep */
+    if (mutex != NULL) { Mutex_Unlock(mutex); }
+    else { Spin_Unlock(spinlock); }
+    sleep_releasing_spinlock(STOPPED, &(cv->waitset_lock));
+    /* An interrupted thread leaves the waitset itself */
+    Spin_Lock(&(cv->waitset_lock));
+    if (node->state == CV_WAITING) { cv_dequeue(cv, node); }
+    Spin_Unlock(&(cv->waitset_lock));
+    /* A broadcast may still be waking it up, and the node is on our stack */
+    for (uint pauses = 0; __atomic_load_n(&node->state, __ATOMIC_ACQUIRE) == CV_BROADCAST; pauses++) {
+        if (pauses >= SPIN_YIELD_PAUSES) { cpu_spin_yield(); }
+        else { __builtin_ia32_pause(); }
+    }
+    if (preempt) { preempt_on; }
+    /* Re-lock mutex before returning */
+    if (mutex != NULL) { Mutex_Lock(mutex); }
+    else { Spin_Lock(spinlock); }
+    return node->state != CV_TIMEDOUT;
+}
 int Cond_Wait(Mutex *mutex, CondVar *cv) {
     __cv_waitset_node newnode;
     newnode.thread = CURTHREAD;
-    Mutex_Lock(&(cv->waitset_lock));
-    /* We just push the current thread to the head of the list */
-    newnode.next = cv->waitset;
-    cv->waitset = &newnode;
-    /* Now atomically release mutex and sleep */
-    Mutex_Unlock(mutex);
-    sleep_releasing(STOPPED, &(cv->waitset_lock));
-    /* Re-lock mutex before returning */
-    Mutex_Lock(mutex);
-    return 1;
+    newnode.cv = cv;
+    newnode.state = CV_INIT;
+    return cv_wait(mutex, NULL, cv, &newnode);
+}
+int Cond_Wait_Spinlock(Spinlock *lock, CondVar *cv) {
+    __cv_waitset_node newnode;
+    newnode.thread = CURTHREAD;
+    newnode.cv = cv;
+    newnode.state = CV_INIT;
+    return cv_wait(NULL, lock, cv, &newnode);
 }
 /* Used to detect if a threads waits for IO for increasing its priority*/
 int Cond_Wait_from_IO(Mutex *mutex, CondVar *cv) {
@@ -99,39 +328,307 @@ int Cond_Wait_from_IO(Mutex *mutex, CondVar *cv) {
     CURTHREAD->yield_state = IO;
     return Cond_Wait(mutex, cv);
 }
+/*
+  The timer lives on the stack of the waiter, and is cancelled before the
+  waiter returns. A negative timeout means no timeout.
+ */
 int Cond_Wait_with_timeout(Mutex *mutex, CondVar *cv, timeout_t timeout) {
-    TimeoutCB *timeoutCB = (TimeoutCB *) xmalloc(sizeof(TimeoutCB));
-    timeoutCB->tid = (Tid_t) CURTHREAD;
-    timeoutCB->birthday = jiff;
-    timeoutCB->timeout = timeout * 1000;
-    timeoutCB->cv = cv;
-    rlnode timeoutNode;
-    rlnode_init(&timeoutNode, timeoutCB);
-    rlist_push_back(&timeoutList, &timeoutNode);
-    int retVal = Cond_Wait(mutex, cv);
-    rlist_remove(&timeoutNode);
+    if (timeout < 0) { return Cond_Wait(mutex, cv); }
+    __cv_waitset_node newnode;
+    newnode.thread = CURTHREAD;
+    newnode.cv = cv;
+    newnode.state = CV_INIT;
+    TimeoutCB timer;
+    timer_init(&timer, cv_timeout, &newnode);
+    timer_arm(&timer, timer_now() + (timeout + TIMER_TICK - 1) / TIMER_TICK);
+    int retVal = cv_wait(mutex, NULL, cv, &newnode);
+    timer_cancel(&timer);
     return retVal;
 }
 /**
   @internal
-  Helper for Cond_Signal and Cond_Broadcast
+  Helper for Cond_Signal
  */
 static __cv_waitset_node *cv_signal(CondVar *cv) {
     /* Wakeup first process in the waiters' queue, if it exists. */
-    if (cv->waitset != NULL) {
-        __cv_waitset_node *node = cv->waitset;
-        cv->waitset = node->next;
-        wakeup(node->thread);
+    __cv_waitset_node *tail = cv->waitset;
+    if (tail != NULL) {
+        __cv_waitset_node *node = tail->next;
+        cv_dequeue(cv, node);
+        node->state = CV_SIGNALLED;
+        wakeup_if_stopped(node->thread);
     }
     return cv->waitset;
 }
 void Cond_Signal(CondVar *cv) {
-    Mutex_Lock(&(cv->waitset_lock));
+    int preempt = preempt_off;
+    Spin_Lock(&(cv->waitset_lock));
     cv_signal(cv);
-    Mutex_Unlock(&(cv->waitset_lock));
+    Spin_Unlock(&(cv->waitset_lock));
+    if (preempt) { preempt_on; }
+}
+/*
+  Signal the first waiter and hand it the core. With sole, this is done
+  only if it is the only waiter; otherwise nothing is done and 0 is
+  returned.
+ */
+static int cv_signal_handoff(CondVar *cv, int sole) {
+    int preempt = preempt_off;
+    TCB *woken = NULL;
+    Spin_Lock(&(cv->waitset_lock));
+    __cv_waitset_node *tail = cv->waitset;
+    if (sole && tail != NULL && tail->next != tail) {
+        Spin_Unlock(&(cv->waitset_lock));
+        if (preempt) { preempt_on; }
+        return 0;
+    }
+    if (tail != NULL) {
+        /* Only a preemptive caller may give its core away */
+        __cv_waitset_node *node = tail->next;
+        cv_dequeue(cv, node);
+        node->state = CV_SIGNALLED;
+        if (!preempt) { wakeup_if_stopped(node->thread); }
+        else if (wakeup_for_handoff(node->thread)) { woken = node->thread; }
+    }
+    Spin_Unlock(&(cv->waitset_lock));
+    /* The woken thread cannot run elsewhere until we hand it the core */
+    if (woken != NULL) { yield_to(woken); }
+    if (preempt) { preempt_on; }
+    return 1;
 }
+void Cond_SignalHandoff(CondVar *cv) {
+    cv_signal_handoff(cv, 0);
+}
+void Cond_BroadcastHandoff(CondVar *cv) {
+    if (!cv_signal_handoff(cv, 1)) { Cond_Broadcast(cv); }
+}
+/* Waiters are woken in batches of this many, see wakeup_many */
+#define CV_BROADCAST_BATCH 32
+/*
+  The whole waitset is detached at once, and the waiters are woken after
+  the waitset_lock is released, so that new waiters and signallers do not
+  wait for the run queues. The detached waiters are marked, so that their
+  timers leave them alone, and each waiter returns only after it is marked
+  signalled, since its node is on its stack.
+ */
 void Cond_Broadcast(CondVar *cv) {
-    Mutex_Lock(&(cv->waitset_lock));
-    while (cv_signal(cv))  /*loop*/;
-    Mutex_Unlock(&(cv->waitset_lock));
-}
\ No newline at end of file
+    int preempt = preempt_off;
+    TCB *woken[CV_BROADCAST_BATCH];
+    __cv_waitset_node *done[CV_BROADCAST_BATCH];
+    Spin_Lock(&(cv->waitset_lock));
+    __cv_waitset_node *tail = cv->waitset;
+    __cv_waitset_node *node = NULL;
+    if (tail != NULL) {
+        cv->waitset = NULL;
+        node = tail->next;
+        tail->next = NULL;
+        for (__cv_waitset_node *n = node; n != NULL; n = n->next) { n->state = CV_BROADCAST; }
+    }
+    Spin_Unlock(&(cv->waitset_lock));
+    while (node != NULL) {
+        uint n = 0;
+        while (node != NULL && n < CV_BROADCAST_BATCH) {
+            done[n] = node;
+            woken[n++] = node->thread;
+            node = node->next;
+        }
+        wakeup_many(woken, n);
+        for (uint i = 0; i < n; i++) { __atomic_store_n(&done[i]->state, CV_SIGNALLED, __ATOMIC_RELEASE); }
+    }
+    if (preempt) { preempt_on; }
+}
+#undef CV_BROADCAST_BATCH
+/*
+  Reader-writer locks.
+
+  A writer holds rw->writer for as long as it holds the lock, and readers
+  hold it only to count themselves in, so a writer that waits for or holds
+  rw->writer keeps new readers out. The writer then waits for the readers
+  already in to leave.
+*/
+static void rwlock_drain(RwLock *rw) {
+    Mutex_Lock(&rw->drain_lock);
+    while (__atomic_load_n(&rw->readers, __ATOMIC_SEQ_CST) > 0) { Cond_Wait(&rw->drain_lock, &rw->drained); }
+    Mutex_Unlock(&rw->drain_lock);
+}
+void RwLock_ReadLock(RwLock *rw) {
+    Mutex_Lock(&rw->writer);
+    __atomic_add_fetch(&rw->readers, 1, __ATOMIC_SEQ_CST);
+    Mutex_Unlock(&rw->writer);
+}
+void RwLock_ReadUnlock(RwLock *rw) {
+    /* The last reader out wakes up a writer, which checks under drain_lock */
+    if (__atomic_sub_fetch(&rw->readers, 1, __ATOMIC_SEQ_CST) == 0) {
+        Mutex_Lock(&rw->drain_lock);
+        Cond_Signal(&rw->drained);
+        Mutex_Unlock(&rw->drain_lock);
+    }
+}
+void RwLock_WriteLock(RwLock *rw) {
+    Mutex_Lock(&rw->writer);
+    rwlock_drain(rw);
+}
+void RwLock_WriteUnlock(RwLock *rw) {
+    Mutex_Unlock(&rw->writer);
+}
+void rw_sleep_releasing_write(Thread_state newstate, RwLock *rw) {
+    sleep_releasing(newstate, &rw->writer);
+}
+int Cond_Wait_RwLock(RwLock *rw, CondVar *cv, timeout_t timeout) {
+    int retVal = Cond_Wait_with_timeout(&rw->writer, cv, timeout);
+    rwlock_drain(rw);
+    return retVal;
+}
+/** \cond HELPER Helper structure for sleeping on a semaphore or a barrier. */
+typedef struct __sync_waiter {
+    TCB *thread;
+    struct __sync_waiter *next;
+    Spinlock *lock;
+    void **waiters;
+    enum { SW_INIT, SW_WAITING, SW_RELEASING, SW_WOKEN, SW_TIMEDOUT } state;
+} __sync_waiter;
+/** \endcond */
+/*
+  Semaphores and barriers.
+
+  They sleep and wake up threads directly, under a spinlock of their own,
+  so that each operation locks once. Their wait queues are circular lists
+  pointed to by the tail, like those of mutexes. A waker sets the state
+  of a waiter after it has woken it up, and then leaves the node, which is
+  on the waiter's stack, alone; so a woken waiter need not take the lock
+  again. A barrier releases its waiters after it drops the lock, and marks
+  them releasing until then. The helpers must be called with the spinlock
+  held and preemption off.
+*/
+static void sync_enqueue(void **waiters, __sync_waiter *w) {
+    __sync_waiter *tail = *waiters;
+    if (tail == NULL) { w->next = w; }
+    else {
+        w->next = tail->next;
+        tail->next = w;
+    }
+    *waiters = w;
+}
+static void sync_dequeue(void **waiters, __sync_waiter *w) {
+    __sync_waiter *tail = *waiters;
+    __sync_waiter *prev = tail;
+    while (prev->next != w) { prev = prev->next; }
+    prev->next = w->next;
+    if (w == tail) { *waiters = (w == prev) ? NULL : prev; }
+}
+static inline void sync_set_state(__sync_waiter *w, int state) {
+    __atomic_store_n(&w->state, state, __ATOMIC_RELEASE);
+}
+/* The state of a waiter, once its waker is done with it */
+static int sync_state(__sync_waiter *w) {
+    int state;
+    for (uint pauses = 0; (state = __atomic_load_n(&w->state, __ATOMIC_ACQUIRE)) == SW_RELEASING; pauses++) {
+        if (pauses >= SPIN_YIELD_PAUSES) { cpu_spin_yield(); }
+        else { __builtin_ia32_pause(); }
+    }
+    return state;
+}
+/*
+  Sleep until woken, and release the lock. An interrupted thread finds
+  itself still queued, and sleeps again. Returns 0 iff the wait timed out.
+ */
+static int sync_sleep(Spinlock *lock, void **waiters, __sync_waiter *w) {
+    if (w->state != SW_TIMEDOUT) {
+        w->state = SW_WAITING;
+        sync_enqueue(waiters, w);
+        while (w->state == SW_WAITING) {
+            sleep_releasing_spinlock(STOPPED, lock);
+            int state = sync_state(w);
+            if (state != SW_WAITING) { return state == SW_WOKEN; }
+            Spin_Lock(lock);
+        }
+    }
+    Spin_Unlock(lock);
+    return sync_state(w) == SW_WOKEN;
+}
+/* Wake up a queued waiter, see sync_sleep */
+static void sync_wake(__sync_waiter *w, int state) {
+    sync_dequeue(w->waiters, w);
+    wakeup_if_stopped(w->thread);
+    sync_set_state(w, state);
+}
+static void sync_timeout(TimeoutCB *t) {
+    __sync_waiter *w = t->data;
+    Spin_Lock(w->lock);
+    if (w->state == SW_WAITING) { sync_wake(w, SW_TIMEDOUT); }
+    else if (w->state == SW_INIT) {
+        /* The waiter has not gone to sleep yet, it will not */
+        w->state = SW_TIMEDOUT;
+    }
+    Spin_Unlock(w->lock);
+}
+int Sem_P_with_timeout(Semaphore *sem, timeout_t timeout) {
+    __sync_waiter w = { CURTHREAD, NULL, &sem->lock, &sem->waiters, SW_INIT };
+    TimeoutCB timer;
+    if (timeout >= 0) {
+        timer_init(&timer, sync_timeout, &w);
+        timer_arm(&timer, timer_now() + (timeout + TIMER_TICK - 1) / TIMER_TICK);
+    }
+    int preempt = preempt_off;
+    Spin_Lock(&sem->lock);
+    int retVal = 1;
+    if (sem->count > 0) {
+        sem->count--;
+        Spin_Unlock(&sem->lock);
+    } else { retVal = sync_sleep(&sem->lock, &sem->waiters, &w); }
+    if (preempt) { preempt_on; }
+    if (timeout >= 0) { timer_cancel(&timer); }
+    return retVal;
+}
+void Sem_P(Semaphore *sem) {
+    Sem_P_with_timeout(sem, -1);
+}
+void Sem_V(Semaphore *sem) {
+    int preempt = preempt_off;
+    Spin_Lock(&sem->lock);
+    __sync_waiter *tail = sem->waiters;
+    /* The unit goes straight to the first waiter */
+    if (tail != NULL) { sync_wake(tail->next, SW_WOKEN); }
+    else { sem->count++; }
+    Spin_Unlock(&sem->lock);
+    if (preempt) { preempt_on; }
+}
+/* Waiters are woken in batches of this many, see wakeup_many */
+#define BARRIER_WAKE_BATCH 32
+int Barrier_Wait(Barrier *barrier) {
+    __sync_waiter w = { CURTHREAD, NULL, &barrier->lock, &barrier->waiters, SW_INIT };
+    int preempt = preempt_off;
+    Spin_Lock(&barrier->lock);
+    int last = (++barrier->arrived >= barrier->parties);
+    if (!last) {
+        sync_sleep(&barrier->lock, &barrier->waiters, &w);
+        if (preempt) { preempt_on; }
+        return 0;
+    }
+    /* Detach this round, the next one starts with an empty queue */
+    __sync_waiter *tail = barrier->waiters;
+    __sync_waiter *node = NULL;
+    barrier->arrived = 0;
+    if (tail != NULL) {
+        barrier->waiters = NULL;
+        node = tail->next;
+        tail->next = NULL;
+        for (__sync_waiter *n = node; n != NULL; n = n->next) { n->state = SW_RELEASING; }
+    }
+    Spin_Unlock(&barrier->lock);
+    TCB *woken[BARRIER_WAKE_BATCH];
+    __sync_waiter *done[BARRIER_WAKE_BATCH];
+    while (node != NULL) {
+        uint n = 0;
+        while (node != NULL && n < BARRIER_WAKE_BATCH) {
+            done[n] = node;
+            woken[n++] = node->thread;
+            node = node->next;
+        }
+        wakeup_many(woken, n);
+        for (uint i = 0; i < n; i++) { sync_set_state(done[i], SW_WOKEN); }
+    }
+    if (preempt) { preempt_on; }
+    return 1;
+}
+#undef BARRIER_WAKE_BATCH
@@ -41,13 +41,64 @@
 
 
 /**
- * @brief The kernel lock.
- *
- * This mutex is used to protect most of the resources in kernel-space (the preemptive domain
- * of the kernel). 
+	@brief The kernel locks and their order.
+
+	The resources of the preemptive domain of the kernel are protected by
+	separate mutexes, one per subsystem or object:
+
+	- the socket lock, in kernel_socket.c, for @c Portmap, the listeners'
+	  request queues and the socket control blocks (a @c RwLock),
+	- @c proc_table_lock, for the process table, the PCB free list and the
+	  process tree (parents, children and exited children) (a @c RwLock),
+	- the lock of each PCB, @c PCB::lock, for its FIDT, its PTCB list and
+	  its thread counter,
+	- the FCB lock, in kernel_streams.c, for the FCB free list,
+	- the lock of each pipe, @c PipeCB::lock, for its buffer and state.
+
+	A thread that holds more than one of them must take them in this order.
+	A thread must not call into a stream (@c Read, @c Write or @c Close of
+	a device or pipe) while it holds a PCB lock or the FCB lock, and the
+	reference counts of FCBs are atomic, so that a stream is closed with no
+	lock held. The spinlocks of the non-preemptive domain come after all of
+	them.
+ */
+
+
+/** @brief Lock a spinlock.
+
+	This must be called with preemption off. The default implementation is a
+	ticket lock, so the waiting cores get the lock in FIFO order, and they only
+	read the lock word while they wait. Building with @c SPINLOCK=tas selects a
+	plain test-and-set lock instead.
+
+	@see Spinlock
+	@see Spin_Unlock
+ */
+void Spin_Lock(Spinlock *lock);
+
+/** @brief Unlock a spinlock that you locked.
+	@see Spin_Lock
  */
+void Spin_Unlock(Spinlock *lock);
 
-extern Mutex kernel_mutex;          /* lock for resource tables */
+/** @brief Wait on a condition variable, releasing a spinlock.
+
+	This is @c Cond_Wait for the drivers, which guard their state with a
+	spinlock and wait with preemption off.
+
+	@see Cond_Wait
+ */
+int Cond_Wait_Spinlock(Spinlock *lock, CondVar *cv);
+
+/** @brief Unlock a mutex, with the @c state_spinlock of the current thread held.
+
+	This is @c Mutex_Unlock for @c sleep_releasing, which unlocks the mutex
+	after it marks the current thread as sleeping. The current thread must
+	be the holder of the mutex.
+
+	@see Mutex_Unlock
+ */
+void Mutex_Unlock_locked(Mutex *lock);
 
 
 /*
@@ -48,7 +48,7 @@ void serial_rx_handler();
 void serial_tx_handler();
 typedef struct serial_device_control_block {
 	uint devno;
-	Mutex spinlock;
+	Spinlock spinlock;
 	CondVar rx_ready;
 } serial_dcb_t;
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -63,9 +63,9 @@ void serial_rx_handler() {
 	 */
 	for (int i = 0; i < bios_serial_ports(); i++) {
 		serial_dcb_t *dcb = &serial_dcb[i];
-		Mutex_Lock(&dcb->spinlock);
+		Spin_Lock(&dcb->spinlock);
 		Cond_Broadcast(&dcb->rx_ready);
-		Mutex_Unlock(&dcb->spinlock);
+		Spin_Unlock(&dcb->spinlock);
 	}
 	if (pre) { preempt_on; }
 }
@@ -75,7 +75,7 @@ void serial_rx_handler() {
 int serial_read(void *dev, char *buf, unsigned int size) {
 	serial_dcb_t *dcb = (serial_dcb_t *) dev;
 	preempt_off;            /* Stop preemption */
-	Mutex_Lock(&dcb->spinlock);
+	Spin_Lock(&dcb->spinlock);
 	uint count = 0;
 	while (count < size) {
 		int valid = bios_read_serial(dcb->devno, &buf[count]);
@@ -84,10 +84,11 @@ int serial_read(void *dev, char *buf, unsigned int size) {
 		} else if (count == 0) {
 			/*Our edits*/
 			/*Inform the thread that it is waiting for IO so it increases its priotity*/
-			Cond_Wait_from_IO(&dcb->spinlock, &dcb->rx_ready);
+			CURTHREAD->yield_state = IO;
+			Cond_Wait_Spinlock(&dcb->spinlock, &dcb->rx_ready);
 		} else { break; }
 	}
-	Mutex_Unlock(&dcb->spinlock);
+	Spin_Unlock(&dcb->spinlock);
 	preempt_on;           /* Restart preemption */
 	return count;
 }
@@ -145,7 +146,7 @@ void initialize_devices() {
 	for (int i = 0; i < bios_serial_ports(); i++) {
 		serial_dcb[i].devno = i;
 		serial_dcb[i].rx_ready = COND_INIT;
-		serial_dcb[i].spinlock = MUTEX_INIT;
+		serial_dcb[i].spinlock = SPINLOCK_INIT;
 	}
 	cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
 	cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
@@ -6,6 +6,7 @@
 #include "bios.h"
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_timer.h"
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
@@ -39,6 +40,7 @@ void boot_tinyos_kernel()
     initialize_devices();
     initialize_files();
     initialize_scheduler();
+    initialize_timers();
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -26,86 +26,94 @@ PipeCB *PipeNoReserving(pipe_t *pipe, Fid_t *fid, FCB **fcb) {
     pipeCB->writerFCB = fcb[1];
     pipeCB->isReaderClosed = 0;
     pipeCB->isWriterClosed = 0;
+    pipeCB->closed = 0;
+    pipeCB->lock = MUTEX_INIT;
     return pipeCB;
 }
 int Pipe(pipe_t *pipe) {
     Fid_t fid[2];
     FCB *fcb[2];
-    Mutex_Lock(&kernel_mutex);
-    if (!FCB_reserve(2, fid, fcb)) {
-        Mutex_Unlock(&kernel_mutex);
-        return -1;
-    }
+    if (!FCB_reserve(2, fid, fcb)) { return -1; }
     PipeCB *pipeCB = PipeNoReserving(pipe, fid, fcb);
     fcb[0]->streamobj = pipeCB;
     fcb[1]->streamobj = pipeCB;
     fcb[0]->streamfunc = &readFuncs;
     fcb[1]->streamfunc = &writeFuncs;
-    Mutex_Unlock(&kernel_mutex);
+    FCB_publish(2, fid, fcb);
     return 0;
 }
 int pipe_read(void *pipeCB, char *buf, unsigned int size) {
-    Mutex_Lock(&kernel_mutex);
     PipeCB *pipecb = (PipeCB *) pipeCB;
+    Mutex_Lock(&pipecb->lock);
     if (pipecb->isReaderClosed) {
-        Mutex_Unlock(&kernel_mutex);
+        Mutex_Unlock(&pipecb->lock);
         return -1;
     }
     if (pipecb->isWriterClosed && pipecb->readPos == pipecb->writePos) {
-        Mutex_Unlock(&kernel_mutex);
+        Mutex_Unlock(&pipecb->lock);
         return 0;
     }
     uint count;
     for (count = 0; count < size; count++, pipecb->readPos = (pipecb->readPos + 1) % BUFFER_SIZE) {
         while (pipecb->writePos == pipecb->readPos && !pipecb->isWriterClosed) {
             Cond_Broadcast(&pipecb->cvWrite);
-            Cond_Wait(&kernel_mutex, &pipecb->cvRead);
+            Cond_Wait(&pipecb->lock, &pipecb->cvRead);
         }
         if (pipecb->writePos == pipecb->readPos && pipecb->isWriterClosed) {
-            Mutex_Unlock(&kernel_mutex);
+            Mutex_Unlock(&pipecb->lock);
             return count;
         }
         buf[count] = pipecb->buffer[pipecb->readPos];
     }
-    Mutex_Unlock(&kernel_mutex);
-    Cond_Broadcast(&pipecb->cvWrite);
+    Mutex_Unlock(&pipecb->lock);
+    /* Switch straight to a sole waiting writer, or wake up all of them */
+    Cond_BroadcastHandoff(&pipecb->cvWrite);
     return count;
 }
 int pipe_write(void *pipeCB, const char *buf, unsigned int size) {
-    Mutex_Lock(&kernel_mutex);
     PipeCB *pipecb = (PipeCB *) pipeCB;
+    Mutex_Lock(&pipecb->lock);
     if (pipecb->isWriterClosed || pipecb->isReaderClosed) {
-        Mutex_Unlock(&kernel_mutex);
+        Mutex_Unlock(&pipecb->lock);
         return -1;
     }
     uint count;
     for (count = 0; count < size; count++, pipecb->writePos = (pipecb->writePos + 1) % BUFFER_SIZE) {
         while ((pipecb->writePos + 1) % BUFFER_SIZE == pipecb->readPos && !pipecb->isReaderClosed) {
             Cond_Broadcast(&pipecb->cvRead);
-            Cond_Wait(&kernel_mutex, &pipecb->cvWrite);
+            Cond_Wait(&pipecb->lock, &pipecb->cvWrite);
         }
         if (pipecb->isWriterClosed || pipecb->isReaderClosed) {
-            Mutex_Unlock(&kernel_mutex);
+            Mutex_Unlock(&pipecb->lock);
             return -1;
         }
         pipecb->buffer[pipecb->writePos] = buf[count];
     }
-    Mutex_Unlock(&kernel_mutex);
-    Cond_Broadcast(&pipecb->cvRead);
+    Mutex_Unlock(&pipecb->lock);
+    /* Switch straight to a sole waiting reader, or wake up all of them */
+    Cond_BroadcastHandoff(&pipecb->cvRead);
     return count;
 }
+/*
+  The end closed last frees the pipe. The count of closed ends is taken
+  after the lock is released, so that the pipe is not freed under it.
+*/
+static void pipe_close_end(PipeCB *pipecb, int *isClosed, CondVar *peer) {
+    Mutex_Lock(&pipecb->lock);
+    int closing = !*isClosed;
+    *isClosed = 1;
+    Cond_Broadcast(peer);
+    Mutex_Unlock(&pipecb->lock);
+    if (closing && __atomic_add_fetch(&pipecb->closed, 1, __ATOMIC_ACQ_REL) == 2) { free(pipecb); }
+}
 int pipe_closeReader(void *pipeCB) {
     PipeCB *pipecb = (PipeCB *) pipeCB;
-    pipecb->isReaderClosed = 1;
-    Cond_Broadcast(&pipecb->cvWrite);
-    if (pipecb->isWriterClosed)free(pipecb);
+    pipe_close_end(pipecb, &pipecb->isReaderClosed, &pipecb->cvWrite);
     return 0;
 }
 int pipe_closeWriter(void *pipeCB) {
     PipeCB *pipecb = (PipeCB *) pipeCB;
-    pipecb->isWriterClosed = 1;
-    Cond_Broadcast(&pipecb->cvRead);
-    if (pipecb->isReaderClosed) free(pipecb);
+    pipe_close_end(pipecb, &pipecb->isWriterClosed, &pipecb->cvRead);
     return 0;
 }
 int dummyRead(void *pipeCB, char *buf, unsigned int size) {
@@ -0,0 +1,256 @@
+#include <string.h>
+#include "kernel_sched.h"
+/*
+  Scheduling policies.
+
+  Each policy orders the threads of a run queue, see sched_policy. All run
+  queue operations are called with the queue locked; tick and on_block are
+  called by the current core for its current thread, which is in no queue.
+ */
+/*
+ *  Multilevel Feedback Queue
+ *
+ *  The ready_mask and level_length fields are kept up to date on every push
+ *  and pop, so that no hot path needs to scan the priority lists.
+ */
+static inline void rq_push(RunQueue *rq, rlnode *node) {
+    int prio = node->tcb->priority;
+    assert(prio < MAX_PRIORITY && prio >= 0);
+    node->tcb->enqueue_epoch = rq->epoch;
+    rlist_push_back(&rq->priority_table[prio], node);
+    rq->level_length[prio]++;
+    rq->ready_mask |= 1u << prio;
+}
+static inline rlnode *rq_remove(RunQueue *rq, int prio, rlnode *node) {
+    rlist_remove(node);
+    if (--rq->level_length[prio] == 0) { rq->ready_mask &= ~(1u << prio); }
+    return node;
+}
+static inline rlnode *rq_pop_level(RunQueue *rq, int prio) {
+    return rq_remove(rq, prio, rq->priority_table[prio].next);
+}
+/*
+  Promote the threads that have waited MAX_QUANTUMS_PASSED epochs at their
+  level by one level, to avoid starvation. Every level is FIFO in enqueue
+  epoch, so only the heads need to be examined, and the cost is one check
+  per non-empty level plus one per promotion.
+
+  Levels are visited from the lowest up. A promoted thread is re-pushed
+  with the current epoch, so it is not promoted twice in one pass.
+*/
+static void rq_age(RunQueue *rq) {
+    uint mask = rq->ready_mask & ~(1u << (MAX_PRIORITY - 1));
+    while (mask) {
+        int prio = __builtin_ctz(mask);
+        mask &= mask - 1;
+        rlnode *list = &rq->priority_table[prio];
+        while (!is_rlist_empty(list) &&
+               rq->epoch - list->next->tcb->enqueue_epoch >= MAX_QUANTUMS_PASSED) {
+            TCB *tcb = rq_pop_level(rq, prio)->tcb;
+            tcb->priority = prio + 1;
+            rq_push(rq, &tcb->sched_node);
+        }
+    }
+}
+static void mlfq_init(RunQueue *rq) {
+    for (int i = 0; i < MAX_PRIORITY; i++) {
+        rlnode_init(&rq->priority_table[i], NULL);
+        rq->level_length[i] = 0;
+    }
+    rq->ready_mask = 0;
+    rq->epoch = 0;
+}
+/* A migrated thread carries its age, see mlfq_dequeue */
+static void mlfq_enqueue(RunQueue *rq, TCB *tcb, int migrated) {
+    unsigned long age = tcb->enqueue_epoch;
+    rq_push(rq, &tcb->sched_node);
+    if (migrated) { tcb->enqueue_epoch = rq->epoch - age; }
+}
+/*
+  Take from the lowest non-empty level, from its tail. The age of the thread
+  replaces its enqueue epoch, which means nothing in another queue.
+*/
+static TCB *mlfq_dequeue(RunQueue *rq, uint core) {
+    for (uint mask = rq->ready_mask; mask; mask &= mask - 1) {
+        int prio = __builtin_ctz(mask);
+        rlnode *list = &rq->priority_table[prio];
+        for (rlnode *node = list->prev; node != list; node = node->prev) {
+            if (thread_can_run_on(node->tcb, core)) {
+                TCB *tcb = rq_remove(rq, prio, node)->tcb;
+                tcb->enqueue_epoch = rq->epoch - tcb->enqueue_epoch;
+                return tcb;
+            }
+        }
+    }
+    return NULL;
+}
+/*
+  Remove the head of the highest non-empty priority list, after aging.
+*/
+static TCB *mlfq_pick_next(RunQueue *rq) {
+    rq->epoch++;
+    rq_age(rq);
+    if (rq->ready_mask == 0) { return NULL; }
+    int prio = 31 - __builtin_clz(rq->ready_mask);
+    return rq_pop_level(rq, prio)->tcb;
+}
+static void mlfq_remove(RunQueue *rq, TCB *tcb) {
+    rq_remove(rq, tcb->priority, &tcb->sched_node);
+}
+/*Our edits*/
+/*Calculate the current thread's next priority considering if it is CPU bounded*/
+static void mlfq_tick(TCB *tcb, int quantum_left) {
+    if (quantum_left <= 0 && tcb->yield_state != IO) {
+        tcb->priority = (tcb->priority - 1) <= 0 ? 0 : tcb->priority - 1;
+    }
+}
+/*A thread blocking for I/O gets a priority boost*/
+static void mlfq_on_block(TCB *tcb) {
+    if (tcb->yield_state == IO) {
+        tcb->priority = (tcb->priority + 1) >= MAX_PRIORITY - 1 ? MAX_PRIORITY - 1 : tcb->priority + 1;
+        tcb->yield_state = DEFAULT;
+    }
+}
+const sched_policy mlfq_policy = {
+        .name = "mlfq",
+        .init = mlfq_init,
+        .enqueue = mlfq_enqueue,
+        .dequeue = mlfq_dequeue,
+        .pick_next = mlfq_pick_next,
+        .remove = mlfq_remove,
+        .tick = mlfq_tick,
+        .on_block = mlfq_on_block,
+        .on_wakeup = NULL
+};
+/*
+ *  Fair share
+ *
+ *  Every thread accumulates the time it runs as virtual runtime, and the
+ *  thread with the least virtual runtime runs next. The queue is a treap
+ *  keyed by (vruntime, address), so that keys are unique, with heap
+ *  priorities drawn from a hash of the key.
+ *
+ *  Virtual runtimes are compared by their signed difference. A thread that
+ *  wakes up after a long sleep is placed a little before the queue's
+ *  min_vruntime, so it runs soon but cannot monopolize the core.
+ */
+#define FAIR_WAKEUP_BONUS (QUANTUM / 2)
+static inline int vr_before(TCB *a, TCB *b) {
+    int64_t d = (int64_t) (a->vruntime - b->vruntime);
+    return d < 0 || (d == 0 && a < b);
+}
+static inline uint vr_hash(TCB *tcb) {
+    uint64_t x = tcb->vruntime ^ (uintptr_t) tcb;
+    x = (x ^ (x >> 31)) * 0x7fb5d329728ea185ull;
+    x = (x ^ (x >> 27)) * 0x81dadef4bc2dd44dull;
+    return (uint) (x ^ (x >> 33));
+}
+static TCB *vr_insert(TCB *root, TCB *tcb) {
+    if (root == NULL) { return tcb; }
+    if (vr_before(tcb, root)) {
+        root->vr_left = vr_insert(root->vr_left, tcb);
+        if (root->vr_left->vr_prio > root->vr_prio) {
+            TCB *l = root->vr_left;
+            root->vr_left = l->vr_right;
+            l->vr_right = root;
+            return l;
+        }
+    } else {
+        root->vr_right = vr_insert(root->vr_right, tcb);
+        if (root->vr_right->vr_prio > root->vr_prio) {
+            TCB *r = root->vr_right;
+            root->vr_right = r->vr_left;
+            r->vr_left = root;
+            return r;
+        }
+    }
+    return root;
+}
+/* Merge two treaps, where every key of a precedes every key of b */
+static TCB *vr_merge(TCB *a, TCB *b) {
+    if (a == NULL) { return b; }
+    if (b == NULL) { return a; }
+    if (a->vr_prio > b->vr_prio) {
+        a->vr_right = vr_merge(a->vr_right, b);
+        return a;
+    }
+    b->vr_left = vr_merge(a, b->vr_left);
+    return b;
+}
+static TCB *vr_remove(TCB *root, TCB *tcb) {
+    if (root == tcb) { return vr_merge(tcb->vr_left, tcb->vr_right); }
+    if (vr_before(tcb, root)) { root->vr_left = vr_remove(root->vr_left, tcb); }
+    else { root->vr_right = vr_remove(root->vr_right, tcb); }
+    return root;
+}
+/* The last thread in key order that may run on core */
+static TCB *vr_last_on(TCB *root, uint core) {
+    if (root == NULL) { return NULL; }
+    TCB *tcb = vr_last_on(root->vr_right, core);
+    if (tcb != NULL) { return tcb; }
+    if (thread_can_run_on(root, core)) { return root; }
+    return vr_last_on(root->vr_left, core);
+}
+static void fair_init(RunQueue *rq) {
+    rq->vr_root = NULL;
+    rq->min_vruntime = 0;
+}
+/* A migrated thread carries its vruntime relative to min_vruntime, see fair_dequeue */
+static void fair_enqueue(RunQueue *rq, TCB *tcb, int migrated) {
+    if (migrated) { tcb->vruntime += rq->min_vruntime; }
+    tcb->vr_left = tcb->vr_right = NULL;
+    tcb->vr_prio = vr_hash(tcb);
+    rq->vr_root = vr_insert(rq->vr_root, tcb);
+}
+static TCB *fair_dequeue(RunQueue *rq, uint core) {
+    TCB *tcb = vr_last_on(rq->vr_root, core);
+    if (tcb != NULL) {
+        rq->vr_root = vr_remove(rq->vr_root, tcb);
+        tcb->vruntime -= rq->min_vruntime;
+    }
+    return tcb;
+}
+static TCB *fair_pick_next(RunQueue *rq) {
+    TCB **link = &rq->vr_root;
+    if (*link == NULL) { return NULL; }
+    while ((*link)->vr_left != NULL) { link = &(*link)->vr_left; }
+    TCB *tcb = *link;
+    *link = tcb->vr_right;
+    if ((int64_t) (tcb->vruntime - rq->min_vruntime) > 0) { rq->min_vruntime = tcb->vruntime; }
+    return tcb;
+}
+static void fair_remove(RunQueue *rq, TCB *tcb) {
+    rq->vr_root = vr_remove(rq->vr_root, tcb);
+}
+static void fair_tick(TCB *tcb, int quantum_left) {
+    if (quantum_left < QUANTUM) { tcb->vruntime += QUANTUM - quantum_left; }
+}
+static void fair_on_wakeup(RunQueue *rq, TCB *tcb) {
+    uint64_t floor = rq->min_vruntime - FAIR_WAKEUP_BONUS;
+    if ((int64_t) (tcb->vruntime - floor) < 0) { tcb->vruntime = floor; }
+}
+const sched_policy fair_policy = {
+        .name = "fair",
+        .init = fair_init,
+        .enqueue = fair_enqueue,
+        .dequeue = fair_dequeue,
+        .pick_next = fair_pick_next,
+        .remove = fair_remove,
+        .tick = fair_tick,
+        .on_block = NULL,
+        .on_wakeup = fair_on_wakeup
+};
+/*
+ *  Policy selection
+ */
+const sched_policy *sched_active_policy = &mlfq_policy;
+static const sched_policy *sched_policies[] = {&mlfq_policy, &fair_policy, NULL};
+int sched_set_policy(const char *name) {
+    for (const sched_policy **p = sched_policies; *p != NULL; p++) {
+        if (strcmp((*p)->name, name) == 0) {
+            sched_active_policy = *p;
+            return 0;
+        }
+    }
+    return -1;
+}
@@ -14,6 +14,7 @@
 /* The process table */
 PCB PT[MAX_PROC];
 unsigned int process_count;
+RwLock proc_table_lock = RWLOCK_INIT;
 PCB *get_pcb(Pid_t pid) {
 	return PT[pid].pstate == FREE ? NULL : &PT[pid];
 }
@@ -29,8 +30,11 @@ static inline void initialize_PCB(PCB *pcb) {
 	rlnode_init(&pcb->children_node, pcb);
 	rlnode_init(&pcb->exited_node, pcb);
 	pcb->child_exit = COND_INIT;
+	pcb->lock = MUTEX_INIT;
 	/*Our edits*/
 	rlnode_new(&pcb->PTCB_list);
+	rlnode_new(&pcb->gang_list);
+	pcb->gang_lock = SPINLOCK_INIT;
 }
 static PCB *pcb_freelist;
 void initialize_processes() {
@@ -51,7 +55,7 @@ void initialize_processes() {
 	if (Exec(NULL, 0, NULL) != 0) {FATAL("The scheduler process does not have pid==0"); }
 }
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held for writing
 */
 PCB *acquire_PCB() {
 	PCB *pcb = NULL;
@@ -64,7 +68,7 @@ PCB *acquire_PCB() {
 	return pcb;
 }
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held for writing
 */
 void release_PCB(PCB *pcb) {
 	pcb->pstate = FREE;
@@ -82,7 +86,9 @@ void release_PCB(PCB *pcb) {
   to execute the main thread of a process.
 */
 void start_main_thread() {
-	PTCB *ptcb = (PTCB *) ThreadSelf_withMutex();//Get the Current Thread's PTCB
+	Mutex_Lock(&CURPROC->lock);
+	PTCB *ptcb = FindPTCB(ThreadSelf());//Get the Current Thread's PTCB
+	Mutex_Unlock(&CURPROC->lock);
 	assert(ptcb != NULL);
 	int argl = ptcb->argl;
 	void *args = ptcb->args;
@@ -94,8 +100,15 @@ void start_main_thread() {
   System call to create a new process.
  */
 Pid_t Exec(Task call, int argl, void *args) {
+	return ExecEx(call, argl, args, 0);
+}
+/*
+  System call to create a new process, with the given stack size.
+ */
+Pid_t ExecEx(Task call, int argl, void *args, size_t stack_size) {
 	PCB *curproc, *newproc;
-	Mutex_Lock(&kernel_mutex);
+	if (stack_size > MAX_STACK_SIZE) { return NOPROC; }
+	RwLock_WriteLock(&proc_table_lock);
 	/* The new process PCB */
 	newproc = acquire_PCB();
 	if (newproc == NULL) { goto finish; } /* We have run out of PIDs! */
@@ -110,10 +123,12 @@ Pid_t Exec(Task call, int argl, void *args) {
 		newproc->parent = curproc;
 		rlist_push_front(&curproc->children_list, &newproc->children_node);
 		/* Inherit file streams from parent */
+		Mutex_Lock(&curproc->lock);
 		for (int i = 0; i < MAX_FILEID; i++) {
 			newproc->FIDT[i] = curproc->FIDT[i];
 			if (newproc->FIDT[i]) { FCB_incref(newproc->FIDT[i]); }
 		}
+		Mutex_Unlock(&curproc->lock);
 	}
 	/*Our edits*/
 	/*Initializing out new pcb properties*/
@@ -131,6 +146,7 @@ Pid_t Exec(Task call, int argl, void *args) {
 	ptcb->refcount = 0;
 	ptcb->isExited = 0;
 	ptcb->isDetached = 0;
+	ptcb->thread = NULL;
 	ptcb->task = call;
 	ptcb->argl = argl;
 	ptcb->condVar = COND_INIT;
@@ -146,11 +162,11 @@ Pid_t Exec(Task call, int argl, void *args) {
 	rlnode *ptcb_node = rlnode_init(&ptcb->node, ptcb);
 	rlist_push_back(&newproc->PTCB_list, ptcb_node);
 	if (call != NULL) {
-		ptcb->thread = spawn_thread(newproc, start_main_thread);
+		ptcb->thread = spawn_thread(newproc, start_main_thread, stack_size);
 		wakeup(ptcb->thread);
 	}
 	finish:
-	Mutex_Unlock(&kernel_mutex);
+	RwLock_WriteUnlock(&proc_table_lock);
 	return get_pid(newproc);
 }
 /* System call */
@@ -158,7 +174,11 @@ Pid_t GetPid() {
 	return get_pid(CURPROC);
 }
 Pid_t GetPPid() {
-	return get_pid(CURPROC->parent);
+	/* The parent changes when it exits */
+	RwLock_ReadLock(&proc_table_lock);
+	Pid_t ppid = get_pid(CURPROC->parent);
+	RwLock_ReadUnlock(&proc_table_lock);
+	return ppid;
 }
 static void cleanup_zombie(PCB *pcb, int *status) {
 	if (status != NULL) { *status = pcb->exitval; }
@@ -167,7 +187,7 @@ static void cleanup_zombie(PCB *pcb, int *status) {
 	release_PCB(pcb);
 }
 static Pid_t wait_for_specific_child(Pid_t cpid, int *status) {
-	Mutex_Lock(&kernel_mutex);
+	RwLock_WriteLock(&proc_table_lock);
 	/* Legality checks */
 	if ((cpid < 0) || (cpid >= MAX_PROC)) {
 		cpid = NOPROC;
@@ -180,15 +200,15 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int *status) {
 		goto finish;
 	}
 	/* Ok, child is a legal child of mine. Wait for it to exit. */
-	while (child->pstate == ALIVE) { Cond_Wait(&kernel_mutex, &parent->child_exit); }
+	while (child->pstate == ALIVE) { Cond_Wait_RwLock(&proc_table_lock, &parent->child_exit, -1); }
 	cleanup_zombie(child, status);
 	finish:
-	Mutex_Unlock(&kernel_mutex);
+	RwLock_WriteUnlock(&proc_table_lock);
 	return cpid;
 }
 static Pid_t wait_for_any_child(int *status) {
 	Pid_t cpid;
-	Mutex_Lock(&kernel_mutex);
+	RwLock_WriteLock(&proc_table_lock);
 	PCB *parent = CURPROC;
 	/* Make sure I have children! */
 	if (is_rlist_empty(&parent->children_list)) {
@@ -196,14 +216,14 @@ static Pid_t wait_for_any_child(int *status) {
 		goto finish;
 	}
 	while (is_rlist_empty(&parent->exited_list)) {
-		Cond_Wait(&kernel_mutex, &parent->child_exit);
+		Cond_Wait_RwLock(&proc_table_lock, &parent->child_exit, -1);
 	}
 	PCB *child = parent->exited_list.next->pcb;
 	assert(child->pstate == ZOMBIE);
 	cpid = get_pid(child);
 	cleanup_zombie(child, status);
 	finish:
-	Mutex_Unlock(&kernel_mutex);
+	RwLock_WriteUnlock(&proc_table_lock);
 	return cpid;
 }
 Pid_t WaitChild(Pid_t cpid, int *status) {
@@ -223,25 +243,29 @@ void Exit(int exitval) {
 		while (WaitChild(NOPROC, NULL) != NOPROC);
 	}
 	/* Now, we exit */
-	Mutex_Lock(&kernel_mutex);
 	/* Do all the other cleanup we want here, close files etc. */
 	/*Our edits*/
 	PCB *curproc = CURPROC;  /* cache for efficiency */
+	Mutex_Lock(&curproc->lock);
 	while (curproc->threads_counter != 0) {
-		Cond_Wait(&kernel_mutex, &CURPROC->condVar);
+		Cond_Wait(&curproc->lock, &curproc->condVar);
 	}
 	/*Free the Current PCB's PTCB list*/
 	while (!is_rlist_empty(&curproc->PTCB_list)) {
 		rlnode *tmp = rlist_pop_front(&curproc->PTCB_list);
 		free(tmp->ptcb);
 	}
-	/* Clean up FIDT */
+	/* Clean up FIDT, the streams are closed without the lock */
+	FCB *files[MAX_FILEID];
 	for (int i = 0; i < MAX_FILEID; i++) {
-		if (curproc->FIDT[i] != NULL) {
-			FCB_decref(curproc->FIDT[i]);
-			curproc->FIDT[i] = NULL;
-		}
+		files[i] = curproc->FIDT[i];
+		curproc->FIDT[i] = NULL;
 	}
+	Mutex_Unlock(&curproc->lock);
+	for (int i = 0; i < MAX_FILEID; i++) {
+		if (files[i] != NULL) { FCB_decref(files[i]); }
+	}
+	RwLock_WriteLock(&proc_table_lock);
 	/* Reparent any children of the exiting process to the
 	   initial task */
 	PCB *initpcb = get_pcb(1);
@@ -265,12 +289,12 @@ void Exit(int exitval) {
 	curproc->pstate = ZOMBIE;
 	curproc->exitval = exitval;
 	/* Bye-bye cruel world */
-	sleep_releasing(EXITED, &kernel_mutex);
+	rw_sleep_releasing_write(EXITED, &proc_table_lock);
 }
 typedef struct info_control_block {
-	char buffer[MAX_PROC * sizeof(procinfo)];
 	uint readPos;
 	uint writePos;
+	char buffer[];
 } InfoCB;
 int sysinfo_read(void *infoCB, char *buf, unsigned int size) {
 	InfoCB *infocb = (InfoCB *) infoCB;
@@ -293,33 +317,78 @@ file_ops sysinfo_funcs = {
 Fid_t OpenInfo() {
 	Fid_t fid;
 	FCB *fcb;
-	Mutex_Lock(&kernel_mutex);
-	if (!FCB_reserve(1, &fid, &fcb)) {
-		Mutex_Unlock(&kernel_mutex);
-		return NOFILE;
+	RwLock_ReadLock(&proc_table_lock);
+	/* Size the buffer for the used PCBs */
+	uint used = 0;
+	for (int i = 0; i < MAX_PROC; i++) {
+		if (PT[i].pstate == ALIVE || PT[i].pstate == ZOMBIE) { used++; }
 	}
-	InfoCB *infoCB = (InfoCB *) xmalloc(sizeof(InfoCB));
+	InfoCB *infoCB = (InfoCB *) xmalloc(sizeof(InfoCB) + used * sizeof(procinfo));
 	infoCB->readPos = 0;
 	infoCB->writePos = 0;
-	fcb->streamobj = infoCB;
-	fcb->streamfunc = &sysinfo_funcs;
 	procinfo *info = (procinfo *) xmalloc(sizeof(procinfo));
 	for (int i = 0; i < MAX_PROC; i++) {
 		PCB *pcb = &PT[i];
 		if (pcb->pstate == ALIVE || pcb->pstate == ZOMBIE) {
+			memset(info, 0, sizeof(procinfo));
 			info->pid = get_pid(&PT[i]);
 			info->ppid = get_pid(pcb->parent);
 			info->alive = pcb->pstate == ALIVE;
+			Mutex_Lock(&pcb->lock);
 			info->thread_count = (unsigned long) pcb->threads_counter + 1;
 			info->main_task = pcb->main_task;
 			info->argl = pcb->argl;
-			for (int j = 0; j < info->argl; j++) {
+			for (int j = 0; j < info->argl && j < PROCINFO_MAX_ARGS_SIZE; j++) {
 				info->args[j] = ((char *) pcb->args)[j];
 			}
+			/* The live threads of the process */
+			for (rlnode *n = pcb->PTCB_list.next;
+			     n != &pcb->PTCB_list && info->threads_listed < PROCINFO_MAX_THREADS; n = n->next) {
+				if (n->ptcb->isExited || n->ptcb->thread == NULL) { continue; }
+				thread_info *ti = &info->threads[info->threads_listed++];
+				ti->tid = (Tid_t) n->ptcb->thread;
+				ti->affinity = n->ptcb->thread->affinity;
+				ti->sclass = n->ptcb->thread->sclass;
+				ti->priority = (ti->sclass == SCHED_CLASS_NORMAL) ? n->ptcb->thread->priority
+				                                                  : n->ptcb->thread->rt_priority;
+				ti->stack_size = n->ptcb->thread->stack_size;
+				ti->stack_used = thread_stack_usage(n->ptcb->thread);
+			}
+			Mutex_Unlock(&pcb->lock);
 			memcpy(&infoCB->buffer[infoCB->writePos], info, sizeof(procinfo));
 			infoCB->writePos += sizeof(procinfo);
 		}
 	}
-	Mutex_Unlock(&kernel_mutex);
+	free(info);
+	RwLock_ReadUnlock(&proc_table_lock);
+	if (!FCB_reserve(1, &fid, &fcb)) {
+		free(infoCB);
+		return NOFILE;
+	}
+	fcb->streamobj = infoCB;
+	fcb->streamfunc = &sysinfo_funcs;
+	FCB_publish(1, &fid, &fcb);
+	return fid;
+}
+Fid_t OpenCoreInfo() {
+	Fid_t fid;
+	FCB *fcb;
+	uint ncores = cpu_cores();
+	InfoCB *infoCB = (InfoCB *) xmalloc(sizeof(InfoCB) + ncores * sizeof(coreinfo));
+	infoCB->readPos = 0;
+	infoCB->writePos = ncores * sizeof(coreinfo);
+	for (uint c = 0; c < ncores; c++) {
+		coreinfo info;
+		memset(&info, 0, sizeof(info));
+		sched_core_info(c, &info);
+		memcpy(&infoCB->buffer[c * sizeof(coreinfo)], &info, sizeof(coreinfo));
+	}
+	if (!FCB_reserve(1, &fid, &fcb)) {
+		free(infoCB);
+		return NOFILE;
+	}
+	fcb->streamobj = infoCB;
+	fcb->streamfunc = &sysinfo_funcs;
+	FCB_publish(1, &fid, &fcb);
 	return fid;
 }
\ No newline at end of file
@@ -45,8 +45,11 @@ typedef struct process_control_block {
 	rlnode exited_node;     /**< Intrusive node for @c exited_list */
 	CondVar child_exit;     /**< Condition variable for @c WaitChild */
 	FCB *FIDT[MAX_FILEID];  /**< The fileid table of the process */
+	Mutex lock;             /**< Protects @c FIDT, @c PTCB_list and @c threads_counter */
 	/*Our edits*/
 	rlnode PTCB_list;     /**< The threads list */
+	rlnode gang_list;     /**< The gang threads, see @c sched_set_gang */
+	Spinlock gang_lock;   /**< Protects @c gang_list, taken with preemption off */
 	int threads_counter;
 	CondVar condVar;
 } PCB;
@@ -62,6 +65,24 @@ typedef struct process_thread_control_block {
 	int isExited;
 	CondVar condVar;
 } PTCB;
+/**
+  @brief Find the PTCB of a thread of the current process.
+
+  Must be called with the lock of the current process held.
+  @returns the PTCB of the thread @c tid, or NULL if it does not belong to
+  the current process.
+*/
+PTCB *FindPTCB(Tid_t tid);
+/**
+  @brief The lock of the process table.
+
+  It protects the PCB free list, the pid states, and the process tree:
+  the @c parent, @c children_list and @c exited_list of every PCB.
+  Lookups take it for reading, and only Exec, Exit and WaitChild take it
+  for writing.
+  @see kernel_cc.h for the lock order.
+*/
+extern RwLock proc_table_lock;
 /**
   @brief Initialize the process table.
 
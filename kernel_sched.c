@@ -3,6 +3,7 @@
 #include "kernel_cc.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_timer.h"
 #ifndef NVALGRIND
 #include <valgrind/valgrind.h>
 #endif
@@ -10,74 +11,130 @@
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  Each thread is allocated a memory block with mmap, holding its stack and
+  its TCB. On the x86 the stack grows downward, therefore the TCB is placed
+  at the top of the block, and the lowest page is a PROT_NONE guard page.
 
   +-------------+
   |   TCB       |
   +-------------+
-  |             |
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |
   +-------------+
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  The host commits the pages as they are touched, so a thread only costs as
+  much memory as its stack actually reaches, and a stack overrun is detected
+  as a seg.fault, before it affects the TCB or other threads.
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  Each block is two mappings for the host, so the number of threads is
+  bounded by the host's limit on mappings (vm.max_map_count).
  */
 /*
   A counter for active threads. By "active", we mean 'existing',
   with the exception of idle threads (they don't count).
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
+Spinlock active_threads_spinlock = SPINLOCK_INIT;
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE  (1<<12)
 /* The memory allocated for the TCB must be a multiple of SYSTEM_PAGE_SIZE */
 #define THREAD_TCB_SIZE   (((sizeof(TCB)+SYSTEM_PAGE_SIZE-1)/SYSTEM_PAGE_SIZE)*SYSTEM_PAGE_SIZE)
-#define THREAD_SIZE  (THREAD_TCB_SIZE+THREAD_STACK_SIZE)
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+#define THREAD_BLOCK_SIZE(stack_size)  (SYSTEM_PAGE_SIZE+(stack_size)+THREAD_TCB_SIZE)
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Map a thread block with the given stack size and return its TCB.
  */
-void free_thread(void* ptr, size_t size)
-{
-  CHECK(munmap(ptr, size));
+static TCB *allocate_thread(size_t stack_size) {
+    void *ptr = mmap(NULL, THREAD_BLOCK_SIZE(stack_size), PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    CHECK((ptr == MAP_FAILED) ? -1 : 0);
+    CHECK(mprotect(ptr, SYSTEM_PAGE_SIZE, PROT_NONE));
+    TCB *tcb = ptr + SYSTEM_PAGE_SIZE + stack_size;
+    tcb->stack_size = stack_size;
+    /* Set once, since a stale Mutex.owner may lock it at any time, see tcb_read_lock */
+    tcb->state_spinlock = SPINLOCK_INIT;
+    return tcb;
 }
-
-void* allocate_thread(size_t size)
-{
-  void* ptr = mmap(NULL, size,
-                   PROT_READ | PROT_WRITE | PROT_EXEC,
-                   MAP_ANONYMOUS  | MAP_PRIVATE
-                   , -1, 0);
-  CHECK((ptr == MAP_FAILED) ? -1 : 0);
-  return ptr;
+static void free_thread(TCB *tcb) {
+    void *ptr = (void *) tcb - tcb->stack_size - SYSTEM_PAGE_SIZE;
+    CHECK(munmap(ptr, THREAD_BLOCK_SIZE(tcb->stack_size)));
 }
-#else
+size_t thread_stack_usage(TCB *tcb) {
+    void *base = (void *) tcb - tcb->stack_size;
+    size_t pages = tcb->stack_size / SYSTEM_PAGE_SIZE;
+    unsigned char vec[64];
+    /* The stack is contiguous from its top, find its lowest committed page */
+    for (size_t p = 0; p < pages; p += 64) {
+        size_t n = (pages - p < 64) ? pages - p : 64;
+        CHECK(mincore(base + p * SYSTEM_PAGE_SIZE, n * SYSTEM_PAGE_SIZE, vec));
+        for (size_t i = 0; i < n; i++) {
+            if (vec[i] & 1) { return (pages - p - i) * SYSTEM_PAGE_SIZE; }
+        }
+    }
+    return 0;
+}
+#ifdef TINYOS_FAST_CONTEXT
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but cannot
-  be made easily to 'detect' stack overflow.
- */
-void free_thread(void *ptr, size_t size) {
-    free(ptr);
+  Switch from the current thread to another, on x86-64.
+
+  cpu_switch_context(&from->sp, to->sp) pushes the callee-saved registers,
+  and the x87 and SSE control words, on the current stack, saves the stack
+  pointer in from->sp, and pops the same from the stack of 'to'. The other
+  registers are saved by the caller, as for any function call.
+*/
+void cpu_switch_context(void **from_sp, void *to_sp);
+__asm__(
+        ".text\n"
+        ".globl cpu_switch_context\n"
+        ".hidden cpu_switch_context\n"
+        ".type cpu_switch_context, @function\n"
+        "cpu_switch_context:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size cpu_switch_context, .-cpu_switch_context\n"
+);
+/*
+  Initialize the thread context, so that the first switch to it "returns"
+  into ctx_func, with the stack aligned as on a function call. The function
+  must never return.
+*/
+void initialize_context(cpu_context *ctx, stack_t stack, void (*ctx_func)()) {
+    uintptr_t top = ((uintptr_t) stack.ss_sp + stack.ss_size) & ~(uintptr_t) 15;
+    uint64_t *sp = (uint64_t *) top;
+    *--sp = 0;                          /* Return address of ctx_func */
+    *--sp = (uintptr_t) ctx_func;
+    for (int r = 0; r < 6; r++) { *--sp = 0; }  /* rbp, rbx, r12-r15 */
+    *--sp = 0x1F80 | ((uint64_t) 0x037F << 32);  /* Default MXCSR and x87 control word */
+    ctx->sp = sp;
 }
-void *allocate_thread(size_t size) {
-    void *ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-    CHECK((ptr == NULL) ? -1 : 0);
-    return ptr;
+static inline void switch_context(cpu_context *from, cpu_context *to) {
+    cpu_switch_context(&from->sp, to->sp);
 }
-#endif
+#else
 /*
   Initialize the thread context. This is done in a platform-specific
   way, using the ucontext library.
@@ -91,6 +148,209 @@ void initialize_context(ucontext_t *ctx, stack_t stack, void (*ctx_func)()) {
     pthread_sigmask(0, NULL, &ctx->uc_sigmask);  /* We don't want any signals changed */
     makecontext(ctx, (void *) ctx_func, 0);
 }
+static inline void switch_context(cpu_context *from, cpu_context *to) {
+    swapcontext(from, to);
+}
+#endif
+/*
+  The thread block cache, see TCB_CACHE_HIGH.
+
+  A free block is linked through the first word of its TCB. Only blocks
+  with the default stack size are cached, and their stack is cut back to
+  one committed page when they are put in the cache. The per-core caches need
+  no lock, since a core only touches its own with preemption off. The
+  global pool is protected by tcb_pool_lock.
+
+  The blocks that the pool has no room for, and those with other stack
+  sizes, are retired instead: their stacks are given back to the host,
+  and they are reused for threads with the same stack size. A waiter for
+  a mutex may still read the TCB of a holder that has exited (see
+  sched_inherit_priority), so the blocks beyond TCB_RETIRED_MAX are only
+  unmapped while tcb_readers is 0. A holder clears Mutex.owner before it
+  exits, so a reader that comes later cannot find its block.
+*/
+typedef struct free_block {
+    struct free_block *next;
+} free_block;
+static free_block *tcb_pool = NULL;
+static uint tcb_pool_length = 0;
+static free_block *tcb_retired = NULL;
+static uint tcb_retired_length = 0;
+static Spinlock tcb_pool_lock = SPINLOCK_INIT;
+static uint tcb_readers = 0;
+uint tcb_prefault = 0;
+void tcb_read_lock() {
+    __atomic_add_fetch(&tcb_readers, 1, __ATOMIC_SEQ_CST);
+}
+void tcb_read_unlock() {
+    __atomic_sub_fetch(&tcb_readers, 1, __ATOMIC_RELEASE);
+}
+/* Take a retired block with the given stack size, if there is one */
+static TCB *unretire_thread(size_t stack_size) {
+    TCB *tcb = NULL;
+    int preempt = preempt_off;
+    Spin_Lock(&tcb_pool_lock);
+    for (free_block **p = &tcb_retired; *p != NULL; p = &(*p)->next) {
+        if (((TCB *) *p)->stack_size == stack_size) {
+            tcb = (TCB *) *p;
+            *p = (*p)->next;
+            tcb_retired_length--;
+            break;
+        }
+    }
+    Spin_Unlock(&tcb_pool_lock);
+    if (preempt) { preempt_on; }
+    return tcb;
+}
+/* This is called with tcb_pool_lock held */
+static void retire_thread(TCB *tcb) {
+    CHECK(madvise((void *) tcb - tcb->stack_size, tcb->stack_size, MADV_DONTNEED));
+    free_block *b = (free_block *) tcb;
+    b->next = tcb_retired;
+    tcb_retired = b;
+    tcb_retired_length++;
+}
+/*
+  Take the retired blocks beyond TCB_RETIRED_MAX, if no TCB is being read.
+  This is called with tcb_pool_lock held, and the blocks are unmapped by
+  free_retired after it is released.
+*/
+static free_block *trim_retired() {
+    if (tcb_retired_length <= TCB_RETIRED_MAX || __atomic_load_n(&tcb_readers, __ATOMIC_SEQ_CST) != 0) {
+        return NULL;
+    }
+    free_block *excess = tcb_retired;
+    free_block *b;
+    do {
+        b = tcb_retired;
+        tcb_retired = b->next;
+        tcb_retired_length--;
+    } while (tcb_retired_length > TCB_RETIRED_MAX);
+    b->next = NULL;
+    return excess;
+}
+static void free_retired(free_block *b) {
+    while (b != NULL) {
+        free_block *next = b->next;
+        free_thread((TCB *) b);
+        b = next;
+    }
+}
+static TCB *get_thread_block(size_t stack_size) {
+    if (stack_size != THREAD_STACK_SIZE) {
+        TCB *tcb = unretire_thread(stack_size);
+        return (tcb != NULL) ? tcb : allocate_thread(stack_size);
+    }
+    int preempt = preempt_off;
+    CCB *cc = &CURCORE;
+    if (cc->tcb_cache == NULL && tcb_pool != NULL) {
+        Spin_Lock(&tcb_pool_lock);
+        while (tcb_pool != NULL && cc->tcb_cache_length < TCB_CACHE_LOW) {
+            free_block *b = tcb_pool;
+            tcb_pool = b->next;
+            tcb_pool_length--;
+            b->next = cc->tcb_cache;
+            cc->tcb_cache = b;
+            cc->tcb_cache_length++;
+        }
+        Spin_Unlock(&tcb_pool_lock);
+    }
+    free_block *b = cc->tcb_cache;
+    if (b != NULL) {
+        cc->tcb_cache = b->next;
+        cc->tcb_cache_length--;
+        cc->tcb_reuses++;
+    } else {
+        cc->tcb_allocs++;
+    }
+    if (preempt) { preempt_on; }
+    if (b != NULL) { return (TCB *) b; }
+    TCB *tcb = unretire_thread(stack_size);
+    return (tcb != NULL) ? tcb : allocate_thread(stack_size);
+}
+static void put_thread_block(TCB *tcb) {
+    /* A mutex still names the thread as its owner, keep the block for good */
+    if (tcb->mutexes_held != 0) { return; }
+    if (tcb->stack_size != THREAD_STACK_SIZE) {
+        int preempt = preempt_off;
+        Spin_Lock(&tcb_pool_lock);
+        retire_thread(tcb);
+        free_block *excess = trim_retired();
+        Spin_Unlock(&tcb_pool_lock);
+        if (preempt) { preempt_on; }
+        free_retired(excess);
+        return;
+    }
+    /* Give back the pages of a deep stack, keeping the top one */
+    if (thread_stack_usage(tcb) > SYSTEM_PAGE_SIZE) {
+        CHECK(madvise((void *) tcb - tcb->stack_size, tcb->stack_size - SYSTEM_PAGE_SIZE, MADV_DONTNEED));
+    }
+    int preempt = preempt_off;
+    CCB *cc = &CURCORE;
+    free_block *b = (free_block *) tcb;
+    b->next = cc->tcb_cache;
+    cc->tcb_cache = b;
+    cc->tcb_cache_length++;
+    free_block *excess = NULL;
+    if (cc->tcb_cache_length > TCB_CACHE_HIGH) {
+        Spin_Lock(&tcb_pool_lock);
+        while (cc->tcb_cache_length > TCB_CACHE_LOW) {
+            b = cc->tcb_cache;
+            cc->tcb_cache = b->next;
+            cc->tcb_cache_length--;
+            if (tcb_pool_length < TCB_POOL_MAX) {
+                b->next = tcb_pool;
+                tcb_pool = b;
+                tcb_pool_length++;
+            } else { retire_thread((TCB *) b); }
+        }
+        excess = trim_retired();
+        Spin_Unlock(&tcb_pool_lock);
+    }
+    if (preempt) { preempt_on; }
+    free_retired(excess);
+}
+/*
+  Move the core caches to the pool, since the next boot may use fewer
+  cores, and pre-fault the pool up to tcb_prefault blocks. No thread runs
+  between boots, so the retired blocks can be unmapped now.
+*/
+static void initialize_thread_pool() {
+    while (tcb_retired != NULL) {
+        free_block *b = tcb_retired;
+        tcb_retired = b->next;
+        free_thread((TCB *) b);
+    }
+    tcb_retired_length = 0;
+    for (int c = 0; c < MAX_CORES; c++) {
+        while (cctx[c].tcb_cache != NULL) {
+            free_block *b = cctx[c].tcb_cache;
+            cctx[c].tcb_cache = b->next;
+            if (tcb_pool_length < TCB_POOL_MAX) {
+                b->next = tcb_pool;
+                tcb_pool = b;
+                tcb_pool_length++;
+            } else {
+                free_thread((TCB *) b);
+            }
+        }
+        cctx[c].tcb_cache_length = 0;
+        cctx[c].tcb_allocs = 0;
+        cctx[c].tcb_reuses = 0;
+    }
+    while (tcb_pool_length < tcb_prefault && tcb_pool_length < TCB_POOL_MAX) {
+        TCB *tcb = allocate_thread(THREAD_STACK_SIZE);
+        memset((void *) tcb - SYSTEM_PAGE_SIZE, 0, SYSTEM_PAGE_SIZE);
+        /* Touch the TCB pages without losing what allocate_thread set */
+        volatile char *t = (volatile char *) tcb;
+        for (size_t off = 0; off < sizeof(TCB); off += SYSTEM_PAGE_SIZE) { t[off] = t[off]; }
+        t[sizeof(TCB) - 1] = t[sizeof(TCB) - 1];
+        free_block *b = (free_block *) tcb;
+        b->next = tcb_pool;
+        tcb_pool = b;
+        tcb_pool_length++;
+    }
+}
 /*
   This is the function that is used to start normal threads.
 */
@@ -104,41 +364,56 @@ static void thread_start() {
 /*
   Initialize and return a new TCB
 */
-void sched_queue_add(TCB *tcb);
-TCB *spawn_thread(PCB *pcb, void (*func)()) {
-    /* The allocated thread size must be a multiple of page size */
-    TCB *tcb = (TCB *) allocate_thread(THREAD_SIZE);
+static void sched_queue_add(TCB *tcb, int woken);
+TCB *spawn_thread(PCB *pcb, void (*func)(), size_t stack_size) {
+    /* The stack size must be a multiple of page size */
+    if (stack_size == 0) { stack_size = THREAD_STACK_SIZE; }
+    if (stack_size < MIN_STACK_SIZE) { stack_size = MIN_STACK_SIZE; }
+    stack_size = (stack_size + SYSTEM_PAGE_SIZE - 1) & ~((size_t) SYSTEM_PAGE_SIZE - 1);
+    TCB *tcb = get_thread_block(stack_size);
     /* Set the owner */
     tcb->owner_pcb = pcb;
     /* Initialize the other attributes */
     tcb->type = NORMAL_THREAD;
     tcb->state = INIT;
     tcb->phase = CTX_CLEAN;
-    tcb->state_spinlock = MUTEX_INIT;
     tcb->thread_func = func;
     /*Our edits*/
     /*Initialize our new tcb properties*/
     tcb->priority = MAX_PRIORITY / 2;
-    tcb->quantums_passed = 0;
+    tcb->enqueue_epoch = 0;
     tcb->yield_state = DEFAULT;
     tcb->interruptFlag = 0;
+    tcb->affinity = CPU_MASK_ALL;
+    tcb->last_core = cpu_core_id;
+    tcb->vruntime = 0;
+    tcb->sclass = SCHED_CLASS_NORMAL;
+    tcb->rt_priority = 0;
+    tcb->rq_core = -1;
+    tcb->gang = 0;
+    /* A stale mutex waiter may be lending its priority to the old thread */
+    Spin_Lock(&tcb->state_spinlock);
+    tcb->blocked_on = NULL;
+    tcb->pi_lock = NULL;
+    Spin_Unlock(&tcb->state_spinlock);
+    rlnode_init(&tcb->gang_node, tcb);
     rlnode_init(&tcb->sched_node, tcb);  /* Intrusive list node */
     /* Prepare the stack */
     stack_t stack = {
-            .ss_sp = ((void *) tcb) + THREAD_TCB_SIZE,
-            .ss_size = THREAD_STACK_SIZE,
+            .ss_sp = ((void *) tcb) - tcb->stack_size,
+            .ss_size = tcb->stack_size,
             .ss_flags = 0
     };
     /* Init the context */
     initialize_context(&tcb->context, stack, thread_start);
 #ifndef NVALGRIND
     tcb->valgrind_stack_id =
-            VALGRIND_STACK_REGISTER(stack.ss_sp, stack.ss_sp + THREAD_STACK_SIZE);
+            VALGRIND_STACK_REGISTER(stack.ss_sp, stack.ss_sp + stack.ss_size);
 #endif
     /* increase the count of active threads */
-    Mutex_Lock(&active_threads_spinlock);
+    Spin_Lock(&active_threads_spinlock);
     active_threads++;
-    Mutex_Unlock(&active_threads_spinlock);
+    Spin_Unlock(&active_threads_spinlock);
     return tcb;
 }
 /*
@@ -148,10 +423,10 @@ void release_TCB(TCB *tcb) {
 #ifndef NVALGRIND
     VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
-    free_thread(tcb, THREAD_SIZE);
-    Mutex_Lock(&active_threads_spinlock);
+    put_thread_block(tcb);
+    Spin_Lock(&active_threads_spinlock);
     active_threads--;
-    Mutex_Unlock(&active_threads_spinlock);
+    Spin_Unlock(&active_threads_spinlock);
 }
 /*
  *
@@ -164,46 +439,675 @@ void release_TCB(TCB *tcb) {
 /* Core control blocks */
 CCB cctx[MAX_CORES];
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core has its own scheduler queue (see RunQueue), protected by
+  its own spinlock. There is no global scheduler lock.
 */
-Mutex sched_spinlock = MUTEX_INIT;    /* mx for scheduler queue */
+/*
+  The cores whose idle thread is about to halt, or has halted. A core sets
+  its bit before it checks its run queue for the last time, and the bit is
+  cleared by whoever wakes the core up, so that each idle core is sent at
+  most one ICI.
+*/
+static cpu_mask_t idle_cores = 0;
+/* Atomically claim an idle core of the mask, returning -1 if there is none */
+static int claim_idle_core(cpu_mask_t mask, uint preferred) {
+    cpu_mask_t idle;
+    while ((idle = __atomic_load_n(&idle_cores, __ATOMIC_ACQUIRE) & mask) != 0) {
+        uint core = ((idle >> preferred) & 1) ? preferred : (uint) __builtin_ctz(idle);
+        cpu_mask_t bit = 1u << core;
+        if (__atomic_fetch_and(&idle_cores, ~bit, __ATOMIC_ACQ_REL) & bit) { return core; }
+    }
+    return -1;
+}
+int sched_tickless = 1;
+/* Usec until the next timer of this core is due, at least 1, or 0 if there is none */
+static TimerDuration timer_usec_left(uint64_t now) {
+    uint64_t next = timer_next_expiry();
+    if (next == 0) { return 0; }
+    return (next > now) ? (next - now) * TIMER_TICK * 1000 : 1;
+}
+/*
+  Arm the alarm for a timeslice, or earlier if a timer of this core is due
+  first, since timers only expire when the core yields. An alarm cut short
+  this way leaves the rest of the slice as quantum left, see sched_yield.
+*/
+static void sched_arm_slice(int slice) {
+    TimerDuration usec = timer_usec_left(timer_now());
+    if (usec != 0 && usec < (TimerDuration) slice) { slice = (int) usec; }
+    CURCORE.slice_quantum = slice;
+    bios_set_timer(slice);
+}
+/*
+  Arm the quantum alarm of a tickless core, when a thread has been queued on
+  it. Called by the core itself. A FIFO thread is never sliced. The alarm of
+  a tickless core is armed for its next timer, so it is kept if it is due
+  first; the timers are not looked at, since a timer callback may queue
+  the thread.
+*/
+static void sched_tick_restart() {
+    CCB *cc = &CURCORE;
+    if (cc->tickless && CURTHREAD->sclass != SCHED_CLASS_FIFO &&
+        __atomic_load_n(&cc->rq.length, __ATOMIC_SEQ_CST) > 0) {
+        cc->tickless = 0;
+        TimerDuration left = bios_set_timer(QUANTUM);
+        cc->slice_quantum = QUANTUM;
+        if (left != 0 && left < QUANTUM) {
+            bios_set_timer(left);
+            cc->slice_quantum = (int) left;
+        }
+    }
+}
+/*
+  Arm the alarm of the current core for a new timeslice, or for the next
+  timer if it is due earlier. In tickless mode, with nobody to preempt for,
+  or when running a FIFO thread, the alarm is only armed for the next timer.
+
+  The tickless flag is raised before the run queue is checked, and
+  sched_queue_add checks the flag after it queues a thread, so a thread
+  queued concurrently is always noticed by at least one of the two.
+*/
+static void sched_set_timer() {
+    CCB *cc = &CURCORE;
+    /* A directed yield hands over what is left of the donor's quantum */
+    int slice = cc->donated_quantum > 0 ? cc->donated_quantum : QUANTUM;
+    cc->donated_quantum = 0;
+    cc->slice_quantum = QUANTUM;
+    if (sched_tickless) {
+        __atomic_store_n(&cc->tickless, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cc->rq.length, __ATOMIC_SEQ_CST) == 0 ||
+            CURTHREAD->sclass == SCHED_CLASS_FIFO) {
+            /* However near the next timer is, the slice is timed by the clock */
+            uint64_t now = timer_now();
+            cc->slice_start = now;
+            cc->tickless_slices++;
+            bios_set_timer(timer_usec_left(now));
+            return;
+        }
+        cc->tickless = 0;
+    }
+    sched_arm_slice(slice);
+}
 /* Interrupt handler for ALARM */
 void yield_handler() {
     yield();
 }
 /* Interrupt handle for inter-core interrupts */
 void ici_handler() {
-    /* noop for now... */
+    /* An idle core was sent work, or a more urgent thread was queued here */
+    if (CURTHREAD->type == IDLE_THREAD || CURCORE.need_resched) { yield(); }
+    else { sched_tick_restart(); }
+}
+/*
+  Real-time queue helpers. They must be called with rq->lock held.
+*/
+static inline void rt_push(RunQueue *rq, TCB *tcb, int head) {
+    int prio = tcb->rt_priority;
+    if (head) { rlist_push_front(&rq->rt_table[prio], &tcb->sched_node); }
+    else { rlist_push_back(&rq->rt_table[prio], &tcb->sched_node); }
+    rq->rt_mask |= 1u << prio;
+}
+static inline rlnode *rt_remove(RunQueue *rq, int prio, rlnode *node) {
+    rlist_remove(node);
+    if (is_rlist_empty(&rq->rt_table[prio])) { rq->rt_mask &= ~(1u << prio); }
+    return node;
+}
+static inline int rt_top(uint rt_mask) {
+    return rt_mask ? 31 - __builtin_clz(rt_mask) : -1;
+}
+/*
+  Remove the next thread to run from a run queue, if any.
+*/
+static TCB *rq_pick(RunQueue *rq) {
+    Spin_Lock(&rq->lock);
+    TCB *tcb;
+    if (rq->rt_mask) {
+        int prio = rt_top(rq->rt_mask);
+        tcb = rt_remove(rq, prio, rq->rt_table[prio].next)->tcb;
+    } else if (rq->gang_next != NULL) {
+        tcb = rq->gang_next;
+        rq->gang_next = NULL;
+    } else {
+        tcb = sched_active_policy->pick_next(rq);
+    }
+    if (tcb != NULL) {
+        rq->length--;
+        tcb->rq_core = -1;
+    }
+    Spin_Unlock(&rq->lock);
+    return tcb;
+}
+/*
+  Return the least loaded core that the thread may run on.
+*/
+static uint sched_pick_core(TCB *tcb) {
+    uint ncores = cpu_cores();
+    uint best = ncores;
+    uint best_len = 0;
+    for (uint c = 0; c < ncores; c++) {
+        if (!thread_can_run_on(tcb, c)) { continue; }
+        uint len = __atomic_load_n(&cctx[c].rq.length, __ATOMIC_RELAXED);
+        if (best == ncores || len < best_len) {
+            best = c;
+            best_len = len;
+        }
+    }
+    assert(best < ncores);
+    return best;
+}
+/*
+  Return a core that the thread may run on, whose current thread has a lower
+  rank, or -1. The core with the lowest rank is preferred, then the current
+  core, then the thread's last core.
+*/
+static int sched_preempt_core(TCB *tcb, int rank) {
+    uint ncores = cpu_cores();
+    int best = -1;
+    int best_rank = rank;
+    for (uint c = 0; c < ncores; c++) {
+        if (!thread_can_run_on(tcb, c)) { continue; }
+        int r = __atomic_load_n(&cctx[c].current_rank, __ATOMIC_RELAXED);
+        if (r < best_rank ||
+            (r == best_rank && best >= 0 && best != (int) cpu_core_id &&
+             (c == cpu_core_id || c == tcb->last_core))) {
+            best = c;
+            best_rank = r;
+        }
+    }
+    return best;
+}
+/* How a core is told of the threads queued on it, the strongest first */
+typedef enum {
+    KICK_BUSY,      /* It finds them at its next yield */
+    KICK_IDLE,      /* It was claimed idle, and is sent an ICI */
+    KICK_PREEMPT    /* Its current thread is less urgent, it is sent an ICI to reschedule */
+} sched_kick;
+/*
+  Choose the core to queue a thread on, see sched_queue_add.
+*/
+static uint sched_place(TCB *tcb, int woken, sched_kick *kick) {
+    uint self = cpu_core_id;
+    int rank = thread_rank(tcb);
+    int core = claim_idle_core(tcb->affinity & ~(1u << self), tcb->last_core);
+    if (core >= 0) {
+        *kick = KICK_IDLE;
+        return core;
+    }
+    if (rank > 0 && woken && (core = sched_preempt_core(tcb, rank)) >= 0) {
+        *kick = KICK_PREEMPT;
+        return core;
+    }
+    *kick = KICK_BUSY;
+    return thread_can_run_on(tcb, self) ? self : sched_pick_core(tcb);
+}
+/*
+  Put a thread in the run queue of a core. This must be called with the
+  queue's lock held.
+*/
+static void rq_insert(uint core, TCB *tcb, int woken) {
+    RunQueue *rq = &cctx[core].rq;
+    tcb->rq_core = core;
+    tcb->rq_rt = (thread_rank(tcb) > 0);
+    if (tcb->rq_rt) {
+        rt_push(rq, tcb, !woken && tcb->sclass == SCHED_CLASS_FIFO);
+    } else {
+        if (woken && sched_active_policy->on_wakeup) { sched_active_policy->on_wakeup(rq, tcb); }
+        sched_active_policy->enqueue(rq, tcb, 0);
+    }
+    rq->length++;
 }
 /*
-  Add PCB to the end of the scheduler list.
+  Take a thread out of the run queue that holds it. This must be called
+  with the queue's lock held.
 */
-void sched_queue_add(TCB *tcb) {
-    /* Insert at the end of the specific priority's scheduling list */
-    Mutex_Lock(&sched_spinlock);
-    assert(tcb->priority < MAX_PRIORITY && tcb->priority >= 0);
-    rlist_push_back(&priority_table[tcb->priority], &tcb->sched_node);
-    Mutex_Unlock(&sched_spinlock);
-    /* Restart possibly halted cores */
-    cpu_core_restart_one();
+static void rq_unlink(RunQueue *rq, TCB *tcb) {
+    if (tcb->rq_rt) { rt_remove(rq, tcb->rt_priority, &tcb->sched_node); }
+    else if (rq->gang_next == tcb) { rq->gang_next = NULL; }
+    else { sched_active_policy->remove(rq, tcb); }
+    rq->length--;
 }
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Tell a core of the threads just queued on it. A busy core finds them at
+  its next yield, but a tickless core must arm its quantum alarm.
+*/
+static void sched_kick_core(uint core, sched_kick kick) {
+    if (kick == KICK_IDLE) { cpu_ici(core); }
+    else if (kick == KICK_PREEMPT) {
+        __atomic_store_n(&cctx[core].need_resched, 1, __ATOMIC_SEQ_CST);
+        cpu_ici(core);
+    }
+    else if (core == cpu_core_id) { sched_tick_restart(); }
+    else {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&cctx[core].tickless, __ATOMIC_SEQ_CST)) { cpu_ici(core); }
+    }
+}
+/*
+  Gang scheduling.
+
+  When a gang thread starts a timeslice, sched_gang_dispatch() sends its
+  queued siblings to other cores, so that the gang runs at the same time.
+  A sibling goes to an idle core or else to a core running a normal thread
+  of another process, which it preempts, and runs there next, see
+  rq_pick(). Siblings that are running or are real-time are left alone.
+*/
+void sched_set_gang(TCB *tcb, int gang) {
+    int preempt = preempt_off;
+    PCB *pcb = tcb->owner_pcb;
+    gang = (gang != 0);
+    Spin_Lock(&pcb->gang_lock);
+    if (gang && !tcb->gang) { rlist_push_back(&pcb->gang_list, &tcb->gang_node); }
+    else if (!gang && tcb->gang) { rlist_remove(&tcb->gang_node); }
+    tcb->gang = gang;
+    Spin_Unlock(&pcb->gang_lock);
+    if (preempt) { preempt_on; }
+}
+/*
+  Find a core for a sibling of the gang of pcb, not in mask, or -1.
+*/
+static int sched_gang_core(TCB *tcb, PCB *pcb, cpu_mask_t mask, sched_kick *kick) {
+    int core = claim_idle_core(tcb->affinity & ~mask, tcb->last_core);
+    if (core >= 0) {
+        *kick = KICK_IDLE;
+        return core;
+    }
+    uint ncores = cpu_cores();
+    for (uint c = 0; c < ncores; c++) {
+        if (((mask >> c) & 1) || !thread_can_run_on(tcb, c)) { continue; }
+        if (__atomic_load_n(&cctx[c].current_rank, __ATOMIC_RELAXED) == 0 &&
+            __atomic_load_n(&cctx[c].current_gang, __ATOMIC_RELAXED) != pcb &&
+            __atomic_load_n(&cctx[c].rq.gang_next, __ATOMIC_RELAXED) == NULL) {
+            *kick = KICK_PREEMPT;
+            return c;
+        }
+    }
+    return -1;
+}
+static void sched_gang_dispatch(TCB *current) {
+    PCB *pcb = current->owner_pcb;
+    cpu_mask_t used = 1u << cpu_core_id;
+    Spin_Lock(&pcb->gang_lock);
+    for (rlnode *n = pcb->gang_list.next; n != &pcb->gang_list; n = n->next) {
+        TCB *tcb = n->tcb;
+        int from = __atomic_load_n(&tcb->rq_core, __ATOMIC_RELAXED);
+        if (tcb == current || from < 0 || tcb->sclass != SCHED_CLASS_NORMAL) { continue; }
+        sched_kick kick;
+        int core = sched_gang_core(tcb, pcb, used, &kick);
+        if (core < 0) { break; }
+        used |= 1u << core;
+        /* Take the sibling out of its queue, unless it left it meanwhile */
+        RunQueue *rq = &cctx[from].rq;
+        Spin_Lock(&rq->lock);
+        int taken = (tcb->rq_core == from && !tcb->rq_rt);
+        if (taken) {
+            rq_unlink(rq, tcb);
+            tcb->rq_core = RQ_MOVING;
+        }
+        Spin_Unlock(&rq->lock);
+        if (!taken) {
+            /* A claimed idle core goes back to sleep */
+            if (kick == KICK_IDLE) { cpu_ici(core); }
+            continue;
+        }
+        rq = &cctx[core].rq;
+        Spin_Lock(&rq->lock);
+        if (rq->gang_next == NULL) {
+            rq->gang_next = tcb;
+            tcb->rq_core = core;
+            tcb->rq_rt = 0;
+            rq->length++;
+        } else {
+            rq_insert(core, tcb, 0);
+        }
+        rq->gang_pulls++;
+        Spin_Unlock(&rq->lock);
+        sched_kick_core(core, kick);
+    }
+    Spin_Unlock(&pcb->gang_lock);
+}
+/*
+  Add TCB to the run queue of some core. A woken thread (as opposed to a
+  preempted or migrated one) is first shown to the policy's on_wakeup.
+
+  If an idle core may run the thread, the thread is handed to it and the
+  core is sent an ICI, preferring the core that ran the thread last, whose
+  cache may still be warm. A woken real-time thread else goes to a core
+  running a less urgent thread, which is sent an ICI to reschedule. Else the
+  thread goes to the current core or, if it may not run here, to the least
+  loaded core of its affinity mask, and the quantum alarm of a tickless
+  core is armed.
+
+  Real-time threads go to the real-time lists. A preempted FIFO thread
+  keeps its place at the head of its list.
+*/
+static void sched_queue_add(TCB *tcb, int woken) {
+    sched_kick kick;
+    uint core = sched_place(tcb, woken, &kick);
+    RunQueue *rq = &cctx[core].rq;
+    Spin_Lock(&rq->lock);
+    rq_insert(core, tcb, woken);
+    Spin_Unlock(&rq->lock);
+    sched_kick_core(core, kick);
+}
+/*
+  Priority inheritance.
+
+  The scheduling parameters of a thread change only while it is in no run
+  queue, or while it is taken out of its queue, with the queue locked. A
+  thread in no queue is only queued with its state_spinlock held, which
+  the changes hold too; a thread in flight between two queues is marked
+  RQ_MOVING.
+
+  A thread that inherits a priority saves its own parameters, and records
+  the mutex it inherited through in pi_lock. The holder of a mutex unlocks
+  it, then checks pi_lock, whereas the inheritance sets pi_lock, then checks
+  that the holder still holds the mutex; so one of the two is sure to see
+  the other.
+*/
+/* Whether thread a is more urgent than thread b */
+static int pi_outranks(TCB *a, TCB *b) {
+    int ra = thread_rank(a), rb = thread_rank(b);
+    if (ra != rb) { return ra > rb; }
+    return ra == 0 && a->priority > b->priority;
+}
+/*
+  Set the parameters of a thread, with its state_spinlock held. A queued
+  thread is queued again by its new parameters, and its core is sent an ICI
+  if the thread now outranks the one running there.
+*/
+static void sched_set_params(TCB *tcb, sched_class sclass, int rt_priority, int priority) {
+    for (;;) {
+        int core = __atomic_load_n(&tcb->rq_core, __ATOMIC_ACQUIRE);
+        if (core == RQ_MOVING) {
+            __builtin_ia32_pause();
+            continue;
+        }
+        if (core < 0) {
+            tcb->sclass = sclass;
+            tcb->rt_priority = rt_priority;
+            tcb->priority = priority;
+            return;
+        }
+        RunQueue *rq = &cctx[core].rq;
+        Spin_Lock(&rq->lock);
+        if (tcb->rq_core != core) {
+            Spin_Unlock(&rq->lock);
+            continue;
+        }
+        rq_unlink(rq, tcb);
+        tcb->sclass = sclass;
+        tcb->rt_priority = rt_priority;
+        tcb->priority = priority;
+        rq_insert(core, tcb, 0);
+        Spin_Unlock(&rq->lock);
+        int rank = __atomic_load_n(&cctx[core].current_rank, __ATOMIC_RELAXED);
+        sched_kick_core(core, thread_rank(tcb) > rank ? KICK_PREEMPT : KICK_BUSY);
+        return;
+    }
+}
+void sched_set_priority(TCB *tcb, sched_class sclass, int rt_priority) {
+    int preempt = preempt_off;
+    Spin_Lock(&tcb->state_spinlock);
+    if (tcb->pi_lock != NULL) {
+        tcb->base_sclass = sclass;
+        tcb->base_rt_priority = rt_priority;
+    } else {
+        sched_set_params(tcb, sclass, rt_priority, tcb->priority);
+    }
+    Spin_Unlock(&tcb->state_spinlock);
+    if (preempt) { preempt_on; }
+}
+void sched_inherit_priority(Mutex *lock) {
+    int preempt = preempt_off;
+    TCB *waiter = CURTHREAD;
+    waiter->blocked_on = lock;
+    tcb_read_lock();
+    for (int i = 0; i < PI_MAX_CHAIN && lock != NULL; i++) {
+        /* The owner may have exited, but its block is not unmapped meanwhile */
+        TCB *owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+        if (owner == NULL || owner == waiter || owner->type == IDLE_THREAD ||
+            !pi_outranks(waiter, owner)) { break; }
+        Spin_Lock(&owner->state_spinlock);
+        Mutex *prev = owner->pi_lock;
+        if (prev == NULL) {
+            owner->base_sclass = owner->sclass;
+            owner->base_rt_priority = owner->rt_priority;
+            owner->base_priority = owner->priority;
+        }
+        __atomic_store_n(&owner->pi_lock, lock, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) != owner) {
+            /* It let go of the mutex meanwhile */
+            owner->pi_lock = prev;
+            Spin_Unlock(&owner->state_spinlock);
+            break;
+        }
+        if (thread_rank(waiter) > 0) {
+            sched_set_params(owner, waiter->sclass, waiter->rt_priority, owner->priority);
+        } else {
+            sched_set_params(owner, owner->sclass, owner->rt_priority, waiter->priority);
+        }
+        /* Follow the chain */
+        lock = owner->blocked_on;
+        Spin_Unlock(&owner->state_spinlock);
+    }
+    tcb_read_unlock();
+    if (preempt) { preempt_on; }
+}
+int sched_restore_priority_locked(TCB *tcb) {
+    if (tcb->pi_lock == NULL) { return 0; }
+    tcb->pi_lock = NULL;
+    sched_set_params(tcb, tcb->base_sclass, tcb->base_rt_priority, tcb->base_priority);
+    return 1;
+}
+void sched_restore_priority(TCB *tcb) {
+    int preempt = preempt_off;
+    Spin_Lock(&tcb->state_spinlock);
+    int restored = sched_restore_priority_locked(tcb);
+    Spin_Unlock(&tcb->state_spinlock);
+    /* Let a more urgent thread run now, if the current thread was demoted */
+    if (restored && preempt && tcb == CURTHREAD &&
+        rt_top(__atomic_load_n(&CURCORE.rq.rt_mask, __ATOMIC_RELAXED)) + 1 > thread_rank(tcb)) {
+        yield();
+    }
+    if (preempt) { preempt_on; }
+}
+/*
+  Move up to max threads, and at most half, from a run queue to the queue of
+  a core, the real-time ones first, then the least urgent first as the
+  policy sees it. Threads that may not run on the core are skipped. Returns
+  the number of moved threads.
+
+  The two queue locks are never held together. The policy carries the
+  standing of each thread from one queue to the other.
+*/
+static uint rq_migrate(RunQueue *from, uint core, uint max) {
+    RunQueue *rq = &cctx[core].rq;
+    rlnode moved, moved_rt;
+    rlnode_new(&moved);
+    rlnode_new(&moved_rt);
+    uint count = 0;
+    Spin_Lock(&from->lock);
+    uint quota = (from->length + 1) / 2;
+    if (quota > max) { quota = max; }
+    /* Real-time threads wait for a more urgent thread, take them first */
+    for (uint mask = from->rt_mask; mask && count < quota; mask &= ~(1u << rt_top(mask))) {
+        int prio = rt_top(mask);
+        rlnode *list = &from->rt_table[prio];
+        for (rlnode *node = list->next; node != list && count < quota;) {
+            rlnode *next = node->next;
+            if (thread_can_run_on(node->tcb, core)) {
+                rt_remove(from, prio, node);
+                node->tcb->rq_core = RQ_MOVING;
+                from->length--;
+                rlist_push_back(&moved_rt, node);
+                count++;
+            }
+            node = next;
+        }
+    }
+    TCB *tcb;
+    while (count < quota && (tcb = sched_active_policy->dequeue(from, core)) != NULL) {
+        from->length--;
+        tcb->rq_core = RQ_MOVING;
+        rlist_push_back(&moved, &tcb->sched_node);
+        count++;
+    }
+    Spin_Unlock(&from->lock);
+    if (count == 0) { return 0; }
+    Spin_Lock(&rq->lock);
+    while (!is_rlist_empty(&moved_rt)) {
+        tcb = rlist_pop_front(&moved_rt)->tcb;
+        rt_push(rq, tcb, 0);
+        tcb->rq_core = core;
+        tcb->rq_rt = 1;
+        rq->length++;
+    }
+    while (!is_rlist_empty(&moved)) {
+        tcb = rlist_pop_front(&moved)->tcb;
+        sched_active_policy->enqueue(rq, tcb, 1);
+        tcb->rq_core = core;
+        tcb->rq_rt = 0;
+        rq->length++;
+    }
+    Spin_Unlock(&rq->lock);
+    return count;
+}
+/*
+  Steal work for the current core, from the core with the longest run queue.
+  Half of the victim's threads are taken, see rq_migrate. Returns the number
+  of stolen threads.
+*/
+static uint sched_steal() {
+    RunQueue *rq = &CURCORE.rq;
+    RunQueue *victim = NULL;
+    uint victim_len = 0;
+    uint ncores = cpu_cores();
+    for (uint c = 1; c < ncores; c++) {
+        RunQueue *other = &cctx[(cpu_core_id + c) % ncores].rq;
+        uint len = __atomic_load_n(&other->length, __ATOMIC_RELAXED);
+        if (len > victim_len) {
+            victim = other;
+            victim_len = len;
+        }
+    }
+    if (victim == NULL) { return 0; }
+    uint count = rq_migrate(victim, cpu_core_id, victim_len);
+    if (count == 0) { return 0; }
+    /* Only the owner core updates its counters */
+    rq->steals++;
+    rq->stolen_threads += count;
+    return count;
+}
+/*
+  Load tracking.
+
+  The owner core folds the number of threads on it into its load at each
+  yield. Other cores read the load decayed up to the present, assuming the
+  number has not changed since, so the load of a halted core still decays.
+*/
+static uint load_decay(uint load, uint nr, uint64_t periods) {
+    int diff = (int) load - (int) (nr * LOAD_SCALE);
+    /* (7/8)^64 of any load is below one unit */
+    for (uint64_t i = 0; i < periods && i < 64 && diff != 0; i++) {
+        diff -= (diff >= 0) ? (diff + 7) / 8 : -((-diff + 7) / 8);
+    }
+    return nr * LOAD_SCALE + diff;
+}
+/* The number of threads running or queued on a core */
+static uint core_nr_threads(uint core) {
+    return __atomic_load_n(&cctx[core].rq.length, __ATOMIC_RELAXED) +
+           (__atomic_load_n(&cctx[core].current_rank, __ATOMIC_RELAXED) >= 0);
+}
+static uint core_load(uint core, uint64_t now) {
+    RunQueue *rq = &cctx[core].rq;
+    uint64_t stamp = __atomic_load_n(&rq->load_stamp, __ATOMIC_RELAXED);
+    uint load = __atomic_load_n(&rq->load, __ATOMIC_RELAXED);
+    return load_decay(load, core_nr_threads(core), now > stamp ? (now - stamp) / LOAD_PERIOD : 0);
+}
+static void sched_update_load(uint64_t now) {
+    RunQueue *rq = &CURCORE.rq;
+    if (now < rq->load_stamp + LOAD_PERIOD) { return; }
+    uint64_t periods = (now - rq->load_stamp) / LOAD_PERIOD;
+    __atomic_store_n(&rq->load, load_decay(rq->load, core_nr_threads(cpu_core_id), periods), __ATOMIC_RELAXED);
+    __atomic_store_n(&rq->load_stamp, rq->load_stamp + periods * LOAD_PERIOD, __ATOMIC_RELAXED);
+}
+void sched_core_info(uint core, coreinfo *info) {
+    RunQueue *rq = &cctx[core].rq;
+    info->core = core;
+    info->load = (uint) (((uint64_t) core_load(core, timer_now()) * 1000 + LOAD_SCALE / 2) / LOAD_SCALE);
+    info->rq_length = __atomic_load_n(&rq->length, __ATOMIC_RELAXED);
+    info->stolen_threads = rq->stolen_threads;
+    info->migrations = __atomic_load_n(&rq->migrations, __ATOMIC_RELAXED);
+}
+/*
+  Periodic load balancing, by a busy core every BALANCE_PERIOD ticks.
+
+  The core compares its load with the busiest and the idlest other core. If
+  the busiest is ahead by more than one thread, the core pulls half the
+  difference from it; else, if the core itself is ahead of the idlest by
+  more than one thread, it pushes half the difference there. The averages
+  lag behind, so the queue lengths must agree that a thread can be spared.
+*/
+static void sched_balance(uint64_t now) {
+    RunQueue *rq = &CURCORE.rq;
+    rq->balance_stamp = now;
+    uint ncores = cpu_cores();
+    if (ncores == 1) { return; }
+    uint self = cpu_core_id;
+    uint load = core_load(self, now);
+    uint nr = core_nr_threads(self);
+    int busiest = -1, idlest = -1;
+    uint busiest_load = 0, idlest_load = 0;
+    for (uint c = 0; c < ncores; c++) {
+        if (c == self) { continue; }
+        uint l = core_load(c, now);
+        if (busiest < 0 || l > busiest_load) {
+            busiest = c;
+            busiest_load = l;
+        }
+        if (idlest < 0 || l < idlest_load) {
+            idlest = c;
+            idlest_load = l;
+        }
+    }
+    if (busiest_load > load + LOAD_SCALE && core_nr_threads(busiest) > nr + 1) {
+        uint count = rq_migrate(&cctx[busiest].rq, self, ((busiest_load - load) / LOAD_SCALE + 1) / 2);
+        if (count > 0) {
+            __atomic_fetch_add(&rq->migrations, count, __ATOMIC_RELAXED);
+            sched_tick_restart();
+        }
+    } else if (load > idlest_load + LOAD_SCALE && nr > core_nr_threads(idlest) + 1) {
+        uint count = rq_migrate(rq, idlest, ((load - idlest_load) / LOAD_SCALE + 1) / 2);
+        if (count > 0) {
+            __atomic_fetch_add(&cctx[idlest].rq.migrations, count, __ATOMIC_RELAXED);
+            sched_kick_core(idlest, claim_idle_core(1u << idlest, idlest) >= 0 ? KICK_IDLE : KICK_BUSY);
+        }
+    }
+}
+/*
+  Remove the head of the current core's scheduler queue, if any, and
+  return it. If the queue is empty, try to steal work from another core.
+  Return NULL if there is no ready thread.
+
+  A thread whose affinity changed while it was queued is moved to a core
+  that may run it.
 */
 TCB *sched_queue_select() {
-    /*Select the fist thread from the greatest priority's scheduling list*/
-    Mutex_Lock(&sched_spinlock);
-    rlnode *sel = NULL;
-    for (int i = MAX_PRIORITY - 1; i >= 0; i--) {
-        if (!is_rlist_empty(&priority_table[i])) {
-            sel = rlist_pop_front(&priority_table[i]);
+    RunQueue *rq = &CURCORE.rq;
+    TCB *sel = rq_pick(rq);
+    for (;;) {
+        if (sel == NULL) {
+            if (sched_steal() == 0) { break; }
+        } else if (thread_can_run_on(sel, cpu_core_id)) {
             break;
+        } else {
+            Spin_Lock(&sel->state_spinlock);
+            sched_queue_add(sel, 0);
+            Spin_Unlock(&sel->state_spinlock);
         }
+        sel = rq_pick(rq);
     }
-    Mutex_Unlock(&sched_spinlock);
-    return sel == NULL ? NULL : sel->tcb; /* When the list is empty, this is NULL */
+    return sel;
 }
 /*
   Make the process ready.
@@ -212,19 +1116,105 @@ void wakeup(TCB *tcb) {
     /* Preemption off */
     int oldpre = preempt_off;
     /* To touch tcb->state, we must get the mx. */
-    Mutex_Lock(&tcb->state_spinlock);
+    Spin_Lock(&tcb->state_spinlock);
     assert(tcb->state == STOPPED || tcb->state == INIT);
     tcb->state = READY;
     /* Possibly add to the scheduler queue */
-    if (tcb->phase == CTX_CLEAN) { sched_queue_add(tcb); }
-    Mutex_Unlock(&tcb->state_spinlock);
+    if (tcb->phase == CTX_CLEAN) { sched_queue_add(tcb, 1); }
+    Spin_Unlock(&tcb->state_spinlock);
     /* Restore preemption state */
     if (oldpre) { preempt_on; }
 }
 /*
-  Atomically put the current process to sleep, after unlocking mx.
+  Make a number of threads ready. Each thread is placed as by wakeup(),
+  but the threads are first grouped by their core, so that each run queue
+  is locked once and each core is told once. Every idle core claimed takes
+  one thread, so only as many idle cores are woken as there are threads.
+  A thread that is awake already (it was interrupted) is skipped.
+
+  A READY thread whose context is clean is queued by nobody else, so the
+  state locks need not be held while it is queued. A single thread is
+  simply woken with wakeup(), which measured a little faster.
+*/
+void wakeup_many(TCB **tcbs, uint n) {
+    if (n == 1) {
+        wakeup_if_stopped(tcbs[0]);
+        return;
+    }
+    int oldpre = preempt_off;
+    uint ncores = cpu_cores();
+    rlnode batch[MAX_CORES];
+    int kick[MAX_CORES];
+    for (uint c = 0; c < ncores; c++) {
+        rlnode_init(&batch[c], NULL);
+        kick[c] = -1;
+    }
+    for (uint i = 0; i < n; i++) {
+        TCB *tcb = tcbs[i];
+        Spin_Lock(&tcb->state_spinlock);
+        int stopped = (tcb->state == STOPPED);
+        if (stopped) { tcb->state = READY; }
+        int clean = (tcb->phase == CTX_CLEAN);
+        Spin_Unlock(&tcb->state_spinlock);
+        if (!stopped || !clean) { continue; }  /* Awake, or queued when it switches out */
+        sched_kick k;
+        uint core = sched_place(tcb, 1, &k);
+        rlist_push_back(&batch[core], &tcb->sched_node);
+        if ((int) k > kick[core]) { kick[core] = k; }
+    }
+    for (uint c = 0; c < ncores; c++) {
+        if (kick[c] < 0) { continue; }
+        RunQueue *rq = &cctx[c].rq;
+        Spin_Lock(&rq->lock);
+        while (!is_rlist_empty(&batch[c])) { rq_insert(c, rlist_pop_front(&batch[c])->tcb, 1); }
+        Spin_Unlock(&rq->lock);
+        sched_kick_core(c, kick[c]);
+    }
+    if (oldpre) { preempt_on; }
+}
+/*
+  A thread woken for a handoff is READY but in no run queue, so no other
+  core can run it, and it cannot exit and be freed, until the caller
+  passes it to yield_to.
+*/
+int wakeup_for_handoff(TCB *tcb) {
+    int oldpre = preempt_off;
+    Spin_Lock(&tcb->state_spinlock);
+    int stopped = (tcb->state == STOPPED);
+    int handoff = stopped && tcb->phase == CTX_CLEAN && thread_can_run_on(tcb, cpu_core_id);
+    if (stopped) {
+        tcb->state = READY;
+        if (handoff) {
+            RunQueue *rq = &CURCORE.rq;
+            if (thread_rank(tcb) == 0 && sched_active_policy->on_wakeup) {
+                Spin_Lock(&rq->lock);
+                sched_active_policy->on_wakeup(rq, tcb);
+                Spin_Unlock(&rq->lock);
+            }
+        } else if (tcb->phase == CTX_CLEAN) { sched_queue_add(tcb, 1); }
+    }
+    Spin_Unlock(&tcb->state_spinlock);
+    if (oldpre) { preempt_on; }
+    return handoff;
+}
+int wakeup_if_stopped(TCB *tcb) {
+    int oldpre = preempt_off;
+    int stopped;
+    Spin_Lock(&tcb->state_spinlock);
+    stopped = (tcb->state == STOPPED);
+    if (stopped) {
+        tcb->state = READY;
+        if (tcb->phase == CTX_CLEAN) { sched_queue_add(tcb, 1); }
+    }
+    Spin_Unlock(&tcb->state_spinlock);
+    if (oldpre) { preempt_on; }
+    return stopped;
+}
+/*
+  Atomically put the current process to sleep, after unlocking mx or the
+  spinlock.
  */
-void sleep_releasing(Thread_state state, Mutex *mx) {
+static void sched_sleep(Thread_state state, Mutex *mx, Spinlock *spinlock) {
     assert(state == STOPPED || state == EXITED);
     TCB *tcb = CURTHREAD;
     /*
@@ -233,31 +1223,65 @@ void sleep_releasing(Thread_state state, Mutex *mx) {
       domain.
      */
     int preempt = preempt_off;
-    Mutex_Lock(&tcb->state_spinlock);
-    /*If the thread was interrupted do not change its state else mark it as stopped*/
-    if (!tcb->interruptFlag) {
+    if (state == EXITED && tcb->gang) { sched_set_gang(tcb, 0); }
+    Spin_Lock(&tcb->state_spinlock);
+    /*If the thread was interrupted do not stop it, but let it exit*/
+    if (state == EXITED || !tcb->interruptFlag) {
         /* mark the process as stopped */
         tcb->state = state;
     }
-    /* Release mx */
-    if (mx != NULL) { Mutex_Unlock(mx); }
-    Mutex_Unlock(&tcb->state_spinlock);
+    /* Release mx, or the spinlock */
+    if (mx != NULL) { Mutex_Unlock_locked(mx); }
+    if (spinlock != NULL) { Spin_Unlock(spinlock); }
+    Spin_Unlock(&tcb->state_spinlock);
     /* call this to schedule someone else */
     yield();
     /* Restore preemption state */
     if (preempt) { preempt_on; }
 }
+void sleep_releasing(Thread_state state, Mutex *mx) {
+    sched_sleep(state, mx, NULL);
+}
+void sleep_releasing_spinlock(Thread_state state, Spinlock *lock) {
+    sched_sleep(state, NULL, lock);
+}
 /* This function is the entry point to the scheduler's context switching */
-void yield() {
+/*
+  A ready real-time thread keeps the core, unless a more urgent thread is
+  queued here, or one of equal priority when a RR thread has used up its
+  quantum.
+*/
+static int rt_keeps_core(TCB *tcb, int quantum_left) {
+    if (tcb->sclass == SCHED_CLASS_NORMAL) { return 0; }
+    int top = rt_top(__atomic_load_n(&CURCORE.rq.rt_mask, __ATOMIC_RELAXED));
+    if (top != tcb->rt_priority) { return top < tcb->rt_priority; }
+    return tcb->sclass == SCHED_CLASS_FIFO || quantum_left > 0;
+}
+/*
+  Give up the CPU. With a target, reserved by wakeup_for_handoff, the
+  target runs next on this core, for the rest of our quantum, unless a
+  more urgent real-time thread is queued here. Otherwise it is queued, as
+  a woken thread.
+*/
+static void sched_yield(TCB *target) {
     /* Reset the timer, so that we are not interrupted by ALARM */
-    int quantum_left = bios_cancel_timer();/*Assign the remaining quantum value to check if the thread was CPU Bounded*/
-    int timePassed = QUANTUM - quantum_left;
-    jiff += timePassed;
+    int slice_left = bios_cancel_timer();
+    /* Without a quantum alarm, tell from the clock whether the quantum was used up */
+    if (CURCORE.tickless) {
+        /* Clamp before narrowing, a thread may have run for a long time */
+        uint64_t elapsed = (timer_now() - CURCORE.slice_start) * TIMER_TICK * 1000;
+        slice_left = (elapsed >= QUANTUM) ? 0 : QUANTUM - (int) elapsed;
+    }
+    /*Assign the remaining quantum value to check if the thread was CPU Bounded*/
+    /* A donated slice counts as the tail of a full quantum */
+    int quantum_left = CURCORE.tickless ? slice_left : slice_left + QUANTUM - CURCORE.slice_quantum;
     /* We must stop preemption but save it! */
     int preempt = preempt_off;
     TCB *current = CURTHREAD;  /* Make a local copy of current process, for speed */
+    CURCORE.need_resched = 0;
     int current_ready = 0;
-    Mutex_Lock(&current->state_spinlock);
+    int current_blocked = 0;
+    Spin_Lock(&current->state_spinlock);
     switch (current->state) {
         case RUNNING:
             current->state = READY;
@@ -265,22 +1289,43 @@ void yield() {
             current_ready = 1;
             break;
         case STOPPED:
+            current_blocked = 1;
+            break;
         case EXITED:
             break;
         default:
             fprintf(stderr, "BAD STATE for current thread %p in yield: %d\n", current, current->state);
             assert(0);  /* It should not be READY or EXITED ! */
     }
-    Mutex_Unlock(&current->state_spinlock);
-    /*Our edits*/
-    checkTimeout();
-    thread_list_priority_calculation();/*Used to avoid starvation*/
-    current_priority_calculation(quantum_left);/*Used to calculate the current threads next priority*/
-    /* Get next */
-    TCB *next = sched_queue_select();
+    Spin_Unlock(&current->state_spinlock);
+    /* Run the expired timers of this core */
+    timer_expire();
+    /* Track the load, and balance it now and then */
+    uint64_t now = timer_now();
+    sched_update_load(now);
+    if (current->type != IDLE_THREAD && now >= CURCORE.rq.balance_stamp + BALANCE_PERIOD) { sched_balance(now); }
+    /* Let the policy account the timeslice of a normal thread */
+    if (current->type != IDLE_THREAD && current->sclass == SCHED_CLASS_NORMAL) {
+        sched_active_policy->tick(current, quantum_left);
+        if (current_blocked && sched_active_policy->on_block) {
+            sched_active_policy->on_block(current);
+        }
+    }
+    /* Get next, unless a real-time thread keeps the core */
+    TCB *next = NULL;
+    if (current_ready && thread_can_run_on(current, cpu_core_id) && rt_keeps_core(current, quantum_left)) {
+        next = current;
+    } else if (target != NULL && current_ready && slice_left > 0 && thread_can_run_on(target, cpu_core_id) &&
+               rt_top(__atomic_load_n(&CURCORE.rq.rt_mask, __ATOMIC_RELAXED)) < thread_rank(target)) {
+        next = target;
+        CURCORE.donated_quantum = slice_left;
+        CURCORE.handoffs++;
+    }
+    if (target != NULL && next != target) { sched_queue_add(target, 1); }
+    if (next == NULL) { next = sched_queue_select(); }
     /* Maybe there was nothing ready in the scheduler queue ? */
     if (next == NULL) {
-        if (current_ready) { next = current; }
+        if (current_ready && thread_can_run_on(current, cpu_core_id)) { next = current; }
         else { next = &CURCORE.idle_thread; }
     }
     /* ok, link the current and next TCB, for the gain phase */
@@ -289,64 +1334,20 @@ void yield() {
     /* Switch contexts */
     if (current != next) {
         CURTHREAD = next;
-        swapcontext(&current->context, &next->context);
+        switch_context(&current->context, &next->context);
     }
     /* This is where we get after we are switched back on! A long time
        may have passed. Start a new timeslice...
      */
     gain(preempt);
 }
-/*Our edits*/
-void checkTimeout() {
-    Mutex_Lock(&sched_spinlock);
-    int length = (int) rlist_len(&timeoutList);
-    for (int j = 0; j < length; j++) {
-        rlnode *tmp = rlist_pop_front(&timeoutList);
-        if (tmp->timeoutCB->timeout <= jiff - tmp->timeoutCB->birthday) {
-            Mutex_Unlock(&sched_spinlock);
-            Cond_Broadcast(tmp->timeoutCB->cv);
-            Mutex_Lock(&sched_spinlock);
-        } else {
-            rlist_push_back(&timeoutList, tmp);
-        }
-    }
-    Mutex_Unlock(&sched_spinlock);
-};
-/*Calculate each thread's next priority to avoid starvation.
- * See more in the declaration*/
-void thread_list_priority_calculation() {
-    Mutex_Lock(&sched_spinlock);
-    for (int i = MAX_PRIORITY - 2; i >= 0; i--) {
-        int length = rlist_len(&priority_table[i]);
-        rlnode *tmp = NULL;
-        for (int j = 0; j < length; j++) {
-            tmp = rlist_pop_front(&priority_table[i]);
-            if (tmp->tcb->quantums_passed + 1 >= MAX_QUANTUMS_PASSED) {
-                tmp->tcb->priority =
-                        (tmp->tcb->priority + 1) >= MAX_PRIORITY - 1 ? MAX_PRIORITY - 1 : tmp->tcb->priority + 1;
-                tmp->tcb->quantums_passed = 0;
-            } else {
-                tmp->tcb->quantums_passed++;
-            }
-            rlist_push_back(&priority_table[tmp->tcb->priority], tmp);
-        }
-    }
-    Mutex_Unlock(&sched_spinlock);
+void yield() {
+    sched_yield(NULL);
 }
-/*Calculate the current thread's next priority considering if it is CPU or IO bounded.
- *See more int the declaration*/
-void current_priority_calculation(int quantum_left) {
-    Mutex_Lock(&sched_spinlock);
-    if (CURTHREAD->yield_state == IO) {
-        CURTHREAD->priority =
-                (CURTHREAD->priority + 1) >= MAX_PRIORITY - 1 ? MAX_PRIORITY - 1 : CURTHREAD->priority + 1;
-    } else if (CURTHREAD->yield_state == DEADLOCKED) {
-        CURTHREAD->priority = 0;
-        CURTHREAD->yield_state = DEFAULT;
-    } else if (quantum_left <= 0) {
-        CURTHREAD->priority = (CURTHREAD->priority - 1) <= 0 ? 0 : CURTHREAD->priority - 1;
-    }
-    Mutex_Unlock(&sched_spinlock);
+int yield_to(TCB *tcb) {
+    unsigned long handoffs = CURCORE.handoffs;
+    sched_yield(tcb);
+    return CURCORE.handoffs != handoffs;
 }
 /*
   This function must be called at the beginning of each new timeslice.
@@ -363,23 +1364,21 @@ void gain(int preempt) {
     TCB *current = CURTHREAD;
     TCB *prev = current->prev;
     /* Mark current state */
-    Mutex_Lock(&current->state_spinlock);
+    Spin_Lock(&current->state_spinlock);
     current->state = RUNNING;
     current->phase = CTX_DIRTY;
-    Mutex_Unlock(&current->state_spinlock);
-    /*Our edits*/
-
-    Mutex_Lock(&sched_spinlock);
-    current->quantums_passed = 0; /* Set the current thread's quantums_passed to 0 because it is going to execute again*/
-    Mutex_Unlock(&sched_spinlock);
+    current->last_core = cpu_core_id;
+    Spin_Unlock(&current->state_spinlock);
+    __atomic_store_n(&CURCORE.current_rank, thread_rank(current), __ATOMIC_RELAXED);
+    __atomic_store_n(&CURCORE.current_gang, current->gang ? current->owner_pcb : NULL, __ATOMIC_RELAXED);
     /* Take care of the previous thread */
     if (current != prev) {
         int prev_exit = 0;
-        Mutex_Lock(&prev->state_spinlock);
+        Spin_Lock(&prev->state_spinlock);
         prev->phase = CTX_CLEAN;
         switch (prev->state) {
             case READY:
-                if (prev->type != IDLE_THREAD) { sched_queue_add(prev); }
+                if (prev->type != IDLE_THREAD) { sched_queue_add(prev, 0); }
                 break;
             case EXITED:
                 prev_exit = 1; /* We cannot release here, because of the mutex */
@@ -390,20 +1389,31 @@ void gain(int preempt) {
                 fprintf(stderr, "BAD STATE for current thread %p in gain: %d\n", current, current->state);
                 assert(0);  /* It should not be READY or EXITED ! */
         }
-        Mutex_Unlock(&prev->state_spinlock);
+        Spin_Unlock(&prev->state_spinlock);
         if (prev_exit) { release_TCB(prev); }
     }
+    /* Bring the gang along */
+    if (current->gang && current != prev) { sched_gang_dispatch(current); }
+    /* Set a 1-quantum alarm, before an ALARM can be taken */
+    sched_set_timer();
     /* Reset preemption as needed */
     if (preempt) { preempt_on; }
-    /* Set a 1-quantum alarm */
-    bios_set_timer(QUANTUM);
 }
 static void idle_thread() {
     /* When we first start the idle thread */
     yield();
     /* We come here whenever we cannot find a ready thread for our core */
+    cpu_mask_t bit = 1u << cpu_core_id;
     while (active_threads > 0) {
-        cpu_core_halt();
+        /*
+          Advertise the core as idle before looking at the run queue for the
+          last time. A thread queued after the check comes with an ICI, which
+          either finds the core halted and restarts it, or finds it not yet
+          halted and makes it yield.
+        */
+        __atomic_fetch_or(&idle_cores, bit, __ATOMIC_ACQ_REL);
+        if (__atomic_load_n(&CURCORE.rq.length, __ATOMIC_ACQUIRE) == 0) { cpu_core_halt(); }
+        __atomic_fetch_and(&idle_cores, ~bit, __ATOMIC_ACQ_REL);
         yield();
     }
     /* If the idle thread exits here, we are leaving the scheduler! */
@@ -412,14 +1422,34 @@ static void idle_thread() {
 }
 /*Our edits*/
 /*
-  Initialize the scheduler priority table queues
+  Initialize the run queues for the active policy
  */
 void initialize_scheduler() {
-    for (int i = 0; i < MAX_PRIORITY; i++) {
-        rlnode_init(&priority_table[i], NULL);
+    for (int c = 0; c < MAX_CORES; c++) {
+        RunQueue *rq = &cctx[c].rq;
+        rq->lock = SPINLOCK_INIT;
+        sched_active_policy->init(rq);
+        for (int i = 0; i < MAX_RT_PRIORITY; i++) { rlnode_init(&rq->rt_table[i], NULL); }
+        rq->rt_mask = 0;
+        rq->gang_next = NULL;
+        rq->length = 0;
+        rq->steals = 0;
+        rq->stolen_threads = 0;
+        rq->gang_pulls = 0;
+        rq->migrations = 0;
+        rq->load = 0;
+        rq->load_stamp = timer_now();
+        rq->balance_stamp = rq->load_stamp;
+        cctx[c].tickless = 0;
+        cctx[c].tickless_slices = 0;
+        cctx[c].slice_quantum = QUANTUM;
+        cctx[c].donated_quantum = 0;
+        cctx[c].handoffs = 0;
+        cctx[c].current_rank = -1;
+        cctx[c].need_resched = 0;
+        cctx[c].current_gang = NULL;
     }
-    jiff = 0;
-    rlnode_init(&timeoutList, NULL);
+    initialize_thread_pool();
 }
 void run_scheduler() {
     CCB *curcore = &CURCORE;
@@ -428,9 +1458,11 @@ void run_scheduler() {
     curcore->current_thread = &curcore->idle_thread;
     curcore->idle_thread.owner_pcb = get_pcb(0);
     curcore->idle_thread.type = IDLE_THREAD;
+    curcore->idle_thread.affinity = 1u << cpu_core_id;
     curcore->idle_thread.state = RUNNING;
     curcore->idle_thread.phase = CTX_DIRTY;
-    curcore->idle_thread.state_spinlock = MUTEX_INIT;
+    curcore->idle_thread.state_spinlock = SPINLOCK_INIT;
+    curcore->idle_thread.rq_core = -1;
     rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
     /* Initialize interrupt handler */
     cpu_interrupt_handler(ALARM, yield_handler);
@@ -18,10 +18,31 @@
   @{
 */
 #include <ucontext.h>
+#include <signal.h>
 #include "util.h"
 #include "bios.h"
 #include "tinyos.h"
 #include "unit_testing.h"
+/**
+  @brief The saved machine context of a thread.
+
+  On x86-64, switching threads only needs to save the callee-saved registers,
+  which are pushed on the thread's own stack, so the context is the saved
+  stack pointer. Elsewhere, or when compiled with @c TINYOS_UCONTEXT, the
+  ucontext library is used.
+
+  Threads are only switched inside @c yield(), with interrupts disabled, so
+  every thread is switched out and in with the same signal mask, which the
+  fast switch does not save.
+*/
+#if defined(__x86_64__) && !defined(TINYOS_UCONTEXT)
+#define TINYOS_FAST_CONTEXT
+typedef struct {
+	void *sp;     /**< The stack pointer, at the saved registers */
+} cpu_context;
+#else
+typedef ucontext_t cpu_context;
+#endif
 /*****************************
  *
  *  The Thread Control Block
@@ -56,17 +77,8 @@ typedef enum {
 } Thread_type;
 typedef enum {
 	DEFAULT,
-	IO,
-	DEADLOCKED
+	IO
 } Yield_state;
-uint jiff;
-rlnode timeoutList;
-typedef struct timeout_control_block {
-    Tid_t tid;
-    uint birthday;
-    timeout_t timeout;
-    CondVar *cv;
-} TimeoutCB;
 /**
   @brief The thread control block
 
@@ -76,7 +88,7 @@ typedef struct timeout_control_block {
 typedef struct thread_control_block {
 	PCB *owner_pcb;       /**< This is null for a free TCB */
 
-	ucontext_t context;     /**< The thread context */
+	cpu_context context;     /**< The thread context */
 
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< This is useful in order to register the thread stack to valgrind */
@@ -85,24 +97,143 @@ typedef struct thread_control_block {
 	Thread_state state;    /**< The state of the thread */
 	Thread_phase phase;    /**< The phase of the thread */
 	void (*thread_func)();   /**< The function executed by this thread */
-	Mutex state_spinlock;       /**< A spinlock for setting state and phase */
+	Spinlock state_spinlock; /**< A spinlock for setting state and phase */
 	/* scheduler data */
 	rlnode sched_node;      /**< node to use when queueing in the scheduler list */
 	struct thread_control_block *prev;  /**< previous context */
 	struct thread_control_block *next;  /**< next context */
 	/*Our edits*/
 	int priority;   /**<the TCB's current priority value*/
-	int quantums_passed; /**<The number of quantums passed after the last execution of the current trhead*/
+	unsigned long enqueue_epoch; /**<The run queue epoch at which the thread was enqueued, used for aging*/
 	Yield_state yield_state;
 	int interruptFlag;
+	cpu_mask_t affinity;    /**< The cores allowed to execute this thread */
+	uint last_core;         /**< The core that last executed this thread */
+	uint64_t vruntime;      /**< Virtual runtime in usec, used by the fair policy */
+	struct thread_control_block *vr_left;  /**< Left child in the fair policy's tree */
+	struct thread_control_block *vr_right; /**< Right child in the fair policy's tree */
+	uint vr_prio;           /**< Heap priority in the fair policy's tree */
+	sched_class sclass;     /**< The scheduling class */
+	int rt_priority;        /**< The real-time priority, for real-time classes */
+	size_t stack_size;      /**< The size of the thread's stack, which lies right below the TCB */
+	int rq_core;            /**< The core whose run queue holds the thread, or -1, or @c RQ_MOVING */
+	int rq_rt;              /**< Set if the thread is queued in a real-time list */
+	int gang;               /**< Set for a gang thread, see @c sched_set_gang */
+	rlnode gang_node;       /**< Intrusive node for the gang list of the owner PCB */
+	Mutex *blocked_on;      /**< The mutex the thread waits for, followed by priority inheritance */
+	Mutex *pi_lock;         /**< The mutex through which the thread inherited its priority, or NULL */
+	sched_class base_sclass; /**< The thread's own class, while it runs with an inherited one */
+	int base_rt_priority;   /**< The thread's own real-time priority, while it inherits one */
+	int base_priority;      /**< The thread's own policy priority, while it inherits one */
+	uint mutexes_held;      /**< The number of mutexes the thread holds */
 } TCB;
-/** Thread stack size */
+/** @brief The @c rq_core of a thread being moved from one run queue to another. */
+#define RQ_MOVING (-2)
+/** Default thread stack size */
 #define THREAD_STACK_SIZE  (128*1024)
 /************************
  *
  *      Scheduler
  *
  ************************/
+/*Our edits*/
+/** @brief The max priority value*/
+#define MAX_PRIORITY (15)
+/** @brief The max run queue epochs to pass before increasing priority to too much waiting thread*/
+#define MAX_QUANTUMS_PASSED (10)
+/** @brief Per-core run queue.
+
+  Every core owns a queue of @c READY threads, protected by its own spinlock, so
+  that cores do not contend for a single scheduler lock. A core whose queue is
+  empty steals work from the most loaded core. The order of the queue is up to
+  the scheduling policy (see @c sched_policy), and each policy has its own
+  fields below.
+
+  The MLFQ policy keeps a FIFO list per priority level. Aging is lazy. The
+  @c epoch advances by one on every selection, and every queued thread
+  remembers the epoch it was enqueued at. A thread that has waited
+  @c MAX_QUANTUMS_PASSED epochs at a level is promoted by one level. Because
+  each level is FIFO, only the head of every level needs to be examined.
+
+  The fair policy keeps a treap of threads ordered by virtual runtime.
+
+  Real-time threads are not handled by the policy. They are kept in FIFO
+  lists, one per real-time priority, which are served before the policy.
+ */
+typedef struct run_queue {
+	Spinlock lock;                        /**< Spinlock protecting this run queue */
+	uint length;                          /**< Number of threads in the queue */
+	unsigned long steals;                 /**< Number of successful steals by the owner core */
+	unsigned long stolen_threads;         /**< Number of threads the owner core has stolen */
+	unsigned long gang_pulls;             /**< Number of gang threads sent to run next on the owner core */
+	unsigned long migrations;             /**< Number of threads the balancer moved to this queue */
+
+	/* Load */
+	uint load;                            /**< Decayed average of the threads on the core, times @c LOAD_SCALE */
+	uint64_t load_stamp;                  /**< The timer tick up to which @c load is decayed */
+	uint64_t balance_stamp;               /**< The timer tick of the last balancing by the owner core */
+
+	/* Real-time */
+	rlnode rt_table[MAX_RT_PRIORITY];     /**< One FIFO list of threads per real-time priority */
+	uint rt_mask;                         /**< Bit i is set iff @c rt_table[i] is not empty */
+
+	/* Gang */
+	TCB *gang_next;                       /**< A gang thread sent to run next, after real-time threads */
+
+	/* MLFQ */
+	rlnode priority_table[MAX_PRIORITY];  /**< One FIFO list of threads per priority level */
+	uint level_length[MAX_PRIORITY];      /**< Cached length of each list in @c priority_table */
+	uint ready_mask;                      /**< Bit i is set iff @c priority_table[i] is not empty */
+	unsigned long epoch;                  /**< Number of selections made from this queue */
+
+	/* Fair */
+	TCB *vr_root;                         /**< The root of the treap */
+	uint64_t min_vruntime;                /**< Never decreasing lower bound of the queued vruntimes */
+} RunQueue;
+/** @brief A scheduling policy.
+
+  A policy decides the order of the threads in a run queue, and how a thread's
+  standing changes as it runs and blocks. The run queue operations are called
+  with the queue locked. The rest of the scheduler (per-core queues, stealing,
+  affinity, idle cores and alarms) is the same for every policy.
+
+  The policy is selected before boot, by @c sched_set_policy(). The
+  @c validate_api and @c schedbench programs take it as the @c -s option.
+ */
+typedef struct sched_policy {
+	const char *name;                     /**< The policy name */
+	void (*init)(RunQueue *rq);           /**< Initialize the policy's fields of a run queue */
+	/** Add a thread to a queue. If @c migrated, the thread was taken
+	    from another queue by @c dequeue. */
+	void (*enqueue)(RunQueue *rq, TCB *tcb, int migrated);
+	/** Remove and return the queued thread that is least urgent to run and may
+	    run on @c core, or NULL. Used to migrate threads between queues. */
+	TCB *(*dequeue)(RunQueue *rq, uint core);
+	/** Remove and return the next thread to run, or NULL if the queue is empty. */
+	TCB *(*pick_next)(RunQueue *rq);
+	/** Remove the given thread, which is in the queue. */
+	void (*remove)(RunQueue *rq, TCB *tcb);
+	/** Account the end of a timeslice of the current thread, which had
+	    @c quantum_left usec of its quantum left (0 or less if it used it up). */
+	void (*tick)(TCB *tcb, int quantum_left);
+	/** The current thread blocks. May be NULL. */
+	void (*on_block)(TCB *tcb);
+	/** A blocked or new thread is about to be queued on @c rq. May be NULL. */
+	void (*on_wakeup)(RunQueue *rq, TCB *tcb);
+} sched_policy;
+/** @brief The Multilevel Feedback Queue policy, the default. */
+extern const sched_policy mlfq_policy;
+/** @brief A fair-share policy, running the thread with the least virtual runtime. */
+extern const sched_policy fair_policy;
+/** @brief The policy in use. */
+extern const sched_policy *sched_active_policy;
+/**
+  @brief Select the scheduling policy by name.
+
+  Must be called before @c boot().
+  @returns 0 on success, or -1 if there is no such policy.
+ */
+int sched_set_policy(const char *name);
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related)
@@ -114,14 +245,23 @@ typedef struct core_control_block {
 	TCB idle_thread;            /**< Used by the scheduler to handle the core's idle thread */
 	sig_atomic_t preemption;    /**< Marks preemption, used by the locking code */
 
+	RunQueue rq;                /**< The core's run queue */
+
+	int current_rank;           /**< The urgency of the current thread, see @c thread_rank */
+	int need_resched;           /**< Set when a more urgent thread was queued, the core yields on ICI */
+	PCB *current_gang;          /**< The process of the current thread, if it is a gang thread */
+	int tickless;               /**< Set while no quantum alarm is armed, see @c sched_tickless */
+	uint64_t slice_start;       /**< The timer tick at which the tickless timeslice started */
+	unsigned long tickless_slices; /**< Number of timeslices started without a quantum alarm */
+	int slice_quantum;          /**< The length of the quantum alarm of the current timeslice */
+	int donated_quantum;        /**< The quantum left by a directed yield, for the next timeslice */
+	unsigned long handoffs;     /**< Number of directed yields that switched to their target */
+
+	void *tcb_cache;            /**< Free thread blocks, see @c TCB_CACHE_HIGH */
+	uint tcb_cache_length;      /**< Number of blocks in @c tcb_cache */
+	unsigned long tcb_allocs;   /**< Number of thread blocks allocated by this core */
+	unsigned long tcb_reuses;   /**< Number of thread blocks reused by this core */
 } CCB;
-/*Our edits*/
-/** @brief The max priority value*/
-#define MAX_PRIORITY (15)
-/** @brief The max quantums number to pass before increasing priority to too much waiting thread*/
-#define MAX_QUANTUMS_PASSED (10)
-/** @brief The priority table*/
-rlnode priority_table[MAX_PRIORITY];
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
 extern CCB cctx[MAX_CORES];
 /** @brief The current core's CCB */
@@ -146,8 +286,18 @@ extern CCB cctx[MAX_CORES];
   The thread will belong to process @c pcb and execute @c func.
   Note that, the new thread is returned in the @c INIT state.
   The caller must use @c wakeup() to start it.
+
+  The thread gets a stack of @c stack_size bytes, rounded up to whole pages
+  and to @c MIN_STACK_SIZE, or of @c THREAD_STACK_SIZE if it is 0.
+*/
+TCB *spawn_thread(PCB *pcb, void (*func)(), size_t stack_size);
+/**
+  @brief Return how deep the stack of a thread has been used.
+
+  This is measured in whole pages, from the pages of the stack that the
+  host has committed.
 */
-TCB *spawn_thread(PCB *pcb, void (*func)());
+size_t thread_stack_usage(TCB *tcb);
 /**
   @brief Wakeup a blocked thread.
 
@@ -157,6 +307,113 @@ TCB *spawn_thread(PCB *pcb, void (*func)());
   @param tcb the thread to be made @c READY.
 */
 void wakeup(TCB *tcb);
+/**
+  @brief Wakeup a number of blocked threads.
+
+  This is like calling @c wakeup_if_stopped on each of the @c n threads
+  of array @c tcbs, but cheaper: each core's run queue is locked once, and
+  each core is sent at most one interrupt.
+
+  @param tcbs the threads to be made @c READY.
+  @param n the number of threads.
+*/
+void wakeup_many(TCB **tcbs, uint n);
+/**
+  @brief Make a thread a gang thread, or a normal one.
+
+  The gang threads of a process are co-scheduled: whenever one of them
+  starts a timeslice on a core, its queued siblings are sent to run at
+  the same time on other cores, which are idle or run normal threads of
+  other processes. A gang thread stops being one when it exits.
+*/
+void sched_set_gang(TCB *tcb, int gang);
+/**
+  @brief Return non-zero if the thread may run on the given core.
+*/
+static inline int thread_can_run_on(TCB *tcb, uint core) { return (tcb->affinity >> core) & 1; }
+/**
+  @brief Return the urgency of a thread.
+
+  This is -1 for idle threads, 0 for normal threads and 1 plus the priority
+  for real-time threads. A thread preempts the threads of lower rank.
+*/
+static inline int thread_rank(TCB *tcb) {
+	if (tcb->type == IDLE_THREAD) { return -1; }
+	return (tcb->sclass == SCHED_CLASS_NORMAL) ? 0 : 1 + tcb->rt_priority;
+}
+/**
+  @brief Wakeup a stopped thread.
+
+  This is like @c wakeup, but it does nothing if the thread is not
+  @c STOPPED, because someone else has already woken it up.
+  @returns 1 if the thread was woken up, else 0.
+ */
+int wakeup_if_stopped(TCB *tcb);
+/**
+  @brief Wake up a stopped thread, for a directed yield to it.
+
+  This is like @c wakeup_if_stopped, but if the thread may run on the
+  current core, it is kept out of the run queues, and the caller must pass
+  it to @c yield_to before it turns preemption on. Until then no other core
+  can run the thread, so it cannot exit.
+
+  @param tcb the thread to wake up
+  @returns 1 if the caller must call @c yield_to(tcb), 0 otherwise
+*/
+int wakeup_for_handoff(TCB *tcb);
+/**
+  @brief Change the scheduling class and priority of a thread.
+
+  If the thread runs with an inherited priority, its own class and priority
+  are changed, and take effect when it stops inheriting.
+ */
+void sched_set_priority(TCB *tcb, sched_class sclass, int rt_priority);
+/**
+  @brief Priority inheritance, for a thread waiting for a held mutex.
+
+  Called by the current thread before it sleeps until @c lock is released.
+  If the holder of the mutex is less urgent, it inherits the class and
+  priority of the current thread. This goes on along the chain of mutexes
+  that the holder waits for, up to @c PI_MAX_CHAIN holders.
+
+  The holder may exit meanwhile. The chain is walked inside
+  @c tcb_read_lock, so its TCB stays mapped, and the holder is re-checked
+  under its @c state_spinlock before it is changed.
+ */
+void sched_inherit_priority(Mutex *lock);
+/**
+  @brief Begin reading the TCB of a mutex holder that may exit.
+
+  A TCB pointer read from @c Mutex.owner may belong to a thread that has
+  exited since. Between this call and @c tcb_read_unlock, no thread block
+  is unmapped, so such a TCB can be read, and its @c state_spinlock
+  locked. The pointer must be read from the mutex after this call.
+
+  This does not sleep, and the pair can be nested. A thread must not
+  sleep in between, since no block is unmapped meanwhile.
+ */
+void tcb_read_lock();
+/** @brief End reading a TCB, see @c tcb_read_lock. */
+void tcb_read_unlock();
+/**
+  @brief End the priority inheritance of a thread.
+
+  Called when the thread unlocks the mutex through which it inherited.
+  If it holds other mutexes that are waited for, the waiters lend it their
+  priority again when they next wait for it.
+ */
+void sched_restore_priority(TCB *tcb);
+/**
+  @brief End the priority inheritance of a thread, with its @c state_spinlock held.
+
+  This is @c sched_restore_priority for a thread that unlocks a mutex
+  while it goes to sleep. Unlike it, this never yields the core.
+
+  @returns 1 if the thread ran with an inherited priority, else 0
+ */
+int sched_restore_priority_locked(TCB *tcb);
+/** @brief The longest chain of mutex holders that inherit a priority. */
+#define PI_MAX_CHAIN (8)
 /**
   @brief Block the current thread.
 
@@ -178,6 +435,29 @@ void wakeup(TCB *tcb);
     @param mx the mutex to unlock.
    */
 void sleep_releasing(Thread_state newstate, Mutex *mx);
+/**
+  @brief Block the current thread, releasing a spinlock.
+
+  This is like @c sleep_releasing, but the spinlock @c lock is unlocked
+  atomically with the blocking of the thread.
+
+  @param newstate the new state for the thread
+  @param lock the spinlock to unlock.
+  @see sleep_releasing
+ */
+void sleep_releasing_spinlock(Thread_state newstate, Spinlock *lock);
+/**
+  @brief Block the current thread, releasing a reader-writer lock held for writing.
+
+  This is like @c sleep_releasing, for a thread that holds @c rw by
+  @c RwLock_WriteLock. It is implemented in kernel_cc.c, next to the
+  reader-writer locks.
+
+  @param newstate the new state for the thread
+  @param rw the reader-writer lock to unlock.
+  @see sleep_releasing
+ */
+void rw_sleep_releasing_write(Thread_state newstate, RwLock *rw);
 /**
   @brief Give up the CPU.
 
@@ -186,25 +466,20 @@ void sleep_releasing(Thread_state newstate, Mutex *mx);
   it will renew the quantum for the current thread.
  */
 void yield();
-/*Our edits*/
 /**
-  @brief Calculate all threads priorities
+  @brief Give up the CPU to a given thread.
 
-  This function is called just before the choosing for the next thread to be executed
-  in the yield function. It increases by 1 the @c quantums_passed property of each thread
-  in the Multilevel Feedback Queue and then it increases by 1 the priority of the first
-  node of each list in the @c priority_table if its quantums_passed value exceeds the
-  @c MAX_QUANTUMS_PASSED constant.
-*/
-void checkTimeout(void);
-void thread_list_priority_calculation(void);
-/**
-  @brief It calculates the priority of the current thread after its execution.
+  This is a directed yield: @c tcb, which must have been reserved by
+  @c wakeup_for_handoff, runs next on this core, for the rest of the
+  caller's quantum. The caller is queued again, as in @c yield. Real-time
+  threads that are more urgent than @c tcb still take precedence, and then
+  @c tcb is queued as a woken thread.
 
-  This function calculates the priority of the current thread after its execution
-  by checking its quantum consumption and if it is I/O  or CPU Bounded.
-*/
-void current_priority_calculation(int quantum_left);
+  @param tcb the thread to switch to
+  @returns 1 if the core was handed to @c tcb, 0 otherwise
+  @see Cond_SignalHandoff
+ */
+int yield_to(TCB *tcb);
 /**
   @brief Enter the scheduler.
 
@@ -225,5 +500,84 @@ void initialize_scheduler(void);
   This is the default quantum for each thread, in microseconds.
   */
 #define QUANTUM (50000L)
+/**
+  @brief Tickless mode, on by default.
+
+  When a core starts a timeslice with an empty run queue, there is nobody to
+  preempt the thread for, and the @c QUANTUM alarm is not armed. The alarm is
+  armed only as far as the next timer of the core, if any. When a thread is
+  later queued on the core, the quantum alarm is armed, by an ICI if the core
+  is remote. Set to 0 before boot to arm the alarm on every timeslice.
+ */
+extern int sched_tickless;
+/**
+  @brief Load tracking.
+
+  The load of a core is the number of threads running or queued on it,
+  averaged with an exponential decay: every @c LOAD_PERIOD timer ticks,
+  the average moves by 1/8 of the way towards the present number.
+  It is kept as a fixed-point number, times @c LOAD_SCALE.
+ */
+#define LOAD_SCALE (1024)
+/** @brief The timer ticks between two load samples, see @c LOAD_SCALE. */
+#ifndef LOAD_PERIOD
+#define LOAD_PERIOD (10)
+#endif
+/**
+  @brief The timer ticks between two balancing rounds of a busy core.
+
+  A core whose load differs from the busiest or the idlest core by more than
+  one thread moves ready threads to even it out. Idle cores do not wait for
+  the balancer, they steal work.
+ */
+#ifndef BALANCE_PERIOD
+#define BALANCE_PERIOD (100)
+#endif
+/**
+  @brief Report the load and the queue of a core.
+
+  The load is decayed up to the present.
+ */
+void sched_core_info(uint core, coreinfo *info);
+/**
+  @brief Thread block cache watermarks.
+
+  The memory of exited threads (TCB and stack) is cached for reuse by
+  @c spawn_thread. Each core keeps up to @c TCB_CACHE_HIGH free blocks;
+  beyond that, it moves blocks to a global pool until it keeps
+  @c TCB_CACHE_LOW. An empty core cache is refilled from the pool up to
+  @c TCB_CACHE_LOW. The pool holds at most @c TCB_POOL_MAX blocks. Only
+  blocks with the default stack size are cached.
+
+  The other blocks are retired: their stack pages are returned to the
+  host, and the block is reused for a thread with the same stack size.
+  Up to @c TCB_RETIRED_MAX blocks are retired; the excess is unmapped
+  when no thread is inside @c tcb_read_lock. A stale TCB pointer read
+  from @c Mutex.owner thus points to a TCB whose @c state_spinlock can be
+  locked, as long as it is read inside @c tcb_read_lock. The block of a
+  thread that exits holding a mutex is never reused or unmapped, since
+  the mutex still names it as its owner.
+  */
+#ifndef TCB_CACHE_HIGH
+#define TCB_CACHE_HIGH 32
+#endif
+#ifndef TCB_CACHE_LOW
+#define TCB_CACHE_LOW 16
+#endif
+#ifndef TCB_POOL_MAX
+#define TCB_POOL_MAX 256
+#endif
+#ifndef TCB_RETIRED_MAX
+#define TCB_RETIRED_MAX 64
+#endif
+/**
+  @brief Number of thread blocks to pre-fault at boot, 0 by default.
+
+  The global thread pool is filled up to this many blocks (but at most
+  @c TCB_POOL_MAX) by @c initialize_scheduler, with their TCB and the top
+  page of their stack touched, so that the first threads created need not
+  allocate or page fault.
+ */
+extern uint tcb_prefault;
 /** @} */
 #endif
\ No newline at end of file
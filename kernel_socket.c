@@ -2,6 +2,7 @@
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
+#include "kernel_proc.h"
 typedef struct socket_control_block SCB;
 typedef struct listener_requests {
     Fid_t fid;
@@ -29,15 +30,27 @@ typedef struct socket_control_block {
         PeerProps *peerProps;
     } extraProps;
 } SCB;
+/* Protects Portmap, the request queues of the listeners, and the SCBs.
+   Reads and writes on peer sockets only take it for reading. */
+static RwLock socket_lock = RWLOCK_INIT;
+/* Translate a fid of the current process, see get_fcb */
+static FCB *socket_fcb(Fid_t sock) {
+    Mutex_Lock(&CURPROC->lock);
+    FCB *fcb = get_fcb(sock);
+    Mutex_Unlock(&CURPROC->lock);
+    return fcb;
+}
 SCB *get_scb(Fid_t sock) {
     if (sock < 0 || sock > MAX_FILEID)return NULL;
-    FCB *fcb = get_fcb(sock);
+    FCB *fcb = socket_fcb(sock);
     if (fcb == NULL)return NULL;
     return (SCB *) fcb->streamobj;
 }
 SCB *Portmap[MAX_PORT + 1] = {NULL};
-int socket_close(void *tmpSCB) {
-    SCB *scb = (SCB *) tmpSCB;
+/*
+  Must be called with socket_lock held for writing
+*/
+static int scb_close(SCB *scb) {
     if (scb == NULL) return -1;
     assert(scb != NULL);
     switch (scb->socketType) {
@@ -64,21 +77,27 @@ int socket_close(void *tmpSCB) {
     free(scb);
     return 0;
 }
+int socket_close(void *tmpSCB) {
+    RwLock_WriteLock(&socket_lock);
+    int retVal = scb_close((SCB *) tmpSCB);
+    RwLock_WriteUnlock(&socket_lock);
+    return retVal;
+}
 int socket_read(void *tmpScb, char *buf, unsigned int size) {
-    Mutex_Lock(&kernel_mutex);
+    RwLock_ReadLock(&socket_lock);
     SCB *scb = (SCB *) tmpScb;
     int isPeer = scb->socketType == PEER;
     PipeCB *pipeCB = scb->extraProps.peerProps->receiver;
-    Mutex_Unlock(&kernel_mutex);
+    RwLock_ReadUnlock(&socket_lock);
     if (isPeer)return pipe_read(pipeCB, buf, size);
     return -1;
 }
 int socket_write(void *tmpScb, const char *buf, unsigned int size) {
-    Mutex_Lock(&kernel_mutex);
+    RwLock_ReadLock(&socket_lock);
     SCB *scb = (SCB *) tmpScb;
     int isPeer = scb->socketType == PEER;
     PipeCB *pipeCB = scb->extraProps.peerProps->transmitter;
-    Mutex_Unlock(&kernel_mutex);
+    RwLock_ReadUnlock(&socket_lock);
     if (isPeer)return pipe_write(pipeCB, buf, size);
     return -1;
 }
@@ -92,9 +111,9 @@ Fid_t Socket(port_t port) {
     if (port < 0 || port > MAX_PORT)return NOFILE;
     Fid_t fid;
     FCB *fcb;
-    Mutex_Lock(&kernel_mutex);
+    RwLock_WriteLock(&socket_lock);
     if (!FCB_reserve(1, &fid, &fcb)) {
-        Mutex_Unlock(&kernel_mutex);
+        RwLock_WriteUnlock(&socket_lock);
         return NOFILE;
     }
     SCB *scb = (SCB *) xmalloc(sizeof(SCB));
@@ -105,14 +124,15 @@ Fid_t Socket(port_t port) {
     scb->refcount = 0;
     fcb->streamobj = scb;
     fcb->streamfunc = &socketFuncs;
-    Mutex_Unlock(&kernel_mutex);
+    FCB_publish(1, &fid, &fcb);
+    RwLock_WriteUnlock(&socket_lock);
     return fid;
 }
 int Listen(Fid_t sock) {
-    Mutex_Lock(&kernel_mutex);
+    RwLock_WriteLock(&socket_lock);
     SCB *scb = get_scb(sock);
     if (scb == NULL || scb->socketType != UNBOUND || scb->boundPort <= 0 || Portmap[scb->boundPort] != NULL) {
-        Mutex_Unlock(&kernel_mutex);
+        RwLock_WriteUnlock(&socket_lock);
         return -1;
     }
     scb->socketType = LISTENER;
@@ -120,33 +140,33 @@ int Listen(Fid_t sock) {
     scb->extraProps.listenerProps->cv = COND_INIT;
     rlnode_new(&scb->extraProps.listenerProps->requests);
     Portmap[scb->boundPort] = scb;
-    Mutex_Unlock(&kernel_mutex);
+    RwLock_WriteUnlock(&socket_lock);
     return 0;
 }
 Fid_t Accept(Fid_t lsock) {
-    Mutex_Lock(&kernel_mutex);
+    RwLock_WriteLock(&socket_lock);
     SCB *listenerSCB = get_scb(lsock);
     if (listenerSCB == NULL || listenerSCB->socketType != LISTENER) {
-        Mutex_Unlock(&kernel_mutex);
+        RwLock_WriteUnlock(&socket_lock);
         return NOFILE;
     }
     while (is_rlist_empty(&listenerSCB->extraProps.listenerProps->requests) && get_scb(lsock)) {
-        Cond_Wait(&kernel_mutex, &listenerSCB->extraProps.listenerProps->cv);
+        Cond_Wait_RwLock(&socket_lock, &listenerSCB->extraProps.listenerProps->cv, -1);
     }
     rlnode *requestNode = rlist_pop_front(&listenerSCB->extraProps.listenerProps->requests);
     Request *request = requestNode->request;
     if (!get_scb(lsock)) {
-        Mutex_Unlock(&kernel_mutex);
+        RwLock_WriteUnlock(&socket_lock);
         Cond_Signal(&request->cv);
         return NOFILE;
     }
-    Mutex_Unlock(&kernel_mutex);
+    RwLock_WriteUnlock(&socket_lock);
     Fid_t peer1fid = Socket(NOPORT);
     if (peer1fid == NOFILE) {
         Cond_Signal(&request->cv);
         return NOFILE;
     }
-    Mutex_Lock(&kernel_mutex);
+    RwLock_WriteLock(&socket_lock);
     SCB *peer1 = get_scb(peer1fid);
     SCB *peer2 = request->scb;
     peer1->extraProps.peerProps = (PeerProps *) xmalloc(sizeof(PeerProps));
@@ -157,11 +177,11 @@ Fid_t Accept(Fid_t lsock) {
     fid[0] = request->fid;
     fid[1] = peer1fid;
     fcb[0] = request->fcb;
-    fcb[1] = get_fcb(peer1fid);
+    fcb[1] = socket_fcb(peer1fid);
     PipeCB *pipeCB1 = PipeNoReserving(&pipe1, fid, fcb);
     fid[0] = peer1fid;
     fid[1] = request->fid;
-    fcb[0] = get_fcb(peer1fid);
+    fcb[0] = socket_fcb(peer1fid);
     fcb[1] = request->fcb;
     PipeCB *pipeCB2 = PipeNoReserving(&pipe2, fid, fcb);
     peer1->extraProps.peerProps->transmitter = pipeCB1;
@@ -173,35 +193,35 @@ Fid_t Accept(Fid_t lsock) {
     peer2->extraProps.peerProps->otherPeer = peer1;
     peer2->socketType = PEER;
     request->isServed = 1;
-    Mutex_Unlock(&kernel_mutex);
+    RwLock_WriteUnlock(&socket_lock);
     Cond_Signal(&request->cv);
     return peer1fid;
 }
 int Connect(Fid_t sock, port_t port, timeout_t timeout) {
-    Mutex_Lock(&kernel_mutex);
+    RwLock_WriteLock(&socket_lock);
     SCB *scb = get_scb(sock);
     if (port < 0 || port >= MAX_PORT || Portmap[port] == NULL || Portmap[port]->socketType != LISTENER ||
             scb->socketType != UNBOUND) {
-        Mutex_Unlock(&kernel_mutex);
+        RwLock_WriteUnlock(&socket_lock);
         return -1;
     }
     Request *request = (Request *) xmalloc(sizeof(Request));
     request->cv = COND_INIT;
     request->isServed = 0;
     request->fid = sock;
-    request->fcb = get_fcb(sock);
+    request->fcb = socket_fcb(sock);
     request->scb = get_scb(sock);
     rlnode node;
     rlnode_init(&node, request);
     rlist_push_back(&Portmap[port]->extraProps.listenerProps->requests, &node);
     Cond_Signal(&Portmap[port]->extraProps.listenerProps->cv);
-    Cond_Wait_with_timeout(&kernel_mutex, &request->cv, timeout);
+    Cond_Wait_RwLock(&socket_lock, &request->cv, timeout);
     rlist_remove(&node);
-    Mutex_Unlock(&kernel_mutex);
+    RwLock_WriteUnlock(&socket_lock);
     return request->isServed - 1;
 }
 int ShutDown(Fid_t sock, shutdown_mode how) {
-    Mutex_Lock(&kernel_mutex);
+    RwLock_WriteLock(&socket_lock);
     SCB *scb = get_scb(sock);
     int retVal = -1;
     switch (how) {
@@ -212,9 +232,9 @@ int ShutDown(Fid_t sock, shutdown_mode how) {
             retVal = pipe_closeWriter(scb->extraProps.peerProps->transmitter);
             break;
         case SHUTDOWN_BOTH:
-            retVal = socket_close(scb);
+            retVal = scb_close(scb);
             break;
     }
-    Mutex_Unlock(&kernel_mutex);
+    RwLock_WriteUnlock(&socket_lock);
     return retVal;
 }
\ No newline at end of file
@@ -6,6 +6,8 @@
 #define MAX_FILES MAX_PROC
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+/* Protects FCB_freelist. The reference counts of FCBs are atomic. */
+static Mutex fcb_lock = MUTEX_INIT;
 void initialize_files() {
     rlnode_init(&FCB_freelist, NULL);
     for (int i = 0; i < MAX_FILES; i++) {
@@ -15,24 +17,27 @@ void initialize_files() {
     }
 }
 FCB *acquire_FCB() {
+    FCB *fcb = NULL;
+    Mutex_Lock(&fcb_lock);
     if (!is_rlist_empty(&FCB_freelist)) {
-        FCB *fcb = rlist_pop_front(&FCB_freelist)->fcb;
+        fcb = rlist_pop_front(&FCB_freelist)->fcb;
         fcb->refcount = 0;
-        return fcb;
-    } else
-        return NULL;
+    }
+    Mutex_Unlock(&fcb_lock);
+    return fcb;
 }
 void release_FCB(FCB *fcb) {
+    Mutex_Lock(&fcb_lock);
     rlist_push_back(&FCB_freelist, &fcb->freelist_node);
+    Mutex_Unlock(&fcb_lock);
 }
 void FCB_incref(FCB *fcb) {
     assert(fcb);
-    fcb->refcount++;
+    __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 int FCB_decref(FCB *fcb) {
     assert(fcb);
-    fcb->refcount--;
-    if (fcb->refcount == 0) {
+    if (__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
         int retval = fcb->streamfunc->Close(fcb->streamobj);
         release_FCB(fcb);
         return retval;
@@ -44,6 +49,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB **fcb) {
     size_t f = 0;
     uint i;
 
+    Mutex_Lock(&cur->lock);
     /* Find distinct fids */
     for (i = 0; i < num; i++) {
         while (f < MAX_FILEID && cur->FIDT[f] != NULL)
@@ -52,7 +58,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB **fcb) {
         fid[i] = f;
         f++;
     }
-    if (i < num) return 0;
+    if (i < num) goto fail;
     /* Allocate FCBs */
     for (i = 0; i < num; i++)
         if ((fcb[i] = acquire_FCB()) == NULL)
@@ -63,22 +69,27 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB **fcb) {
             release_FCB(fcb[i - 1]);
             i--;
         }
-        return 0;
+        goto fail;
     }
-    /* Found all */
-    for (i = 0; i < num; i++) {
+    /* Found all, the process stays locked until they are published */
+    return 1;
+    fail:
+    Mutex_Unlock(&cur->lock);
+    return 0;
+}
+void FCB_publish(size_t num, Fid_t *fid, FCB **fcb) {
+    PCB *cur = CURPROC;
+    for (size_t i = 0; i < num; i++) {
+        assert(cur->FIDT[fid[i]] == NULL);
         cur->FIDT[fid[i]] = fcb[i];
         FCB_incref(fcb[i]);
     }
-    return 1;
+    Mutex_Unlock(&cur->lock);
 }
 void FCB_unreserve(size_t num, Fid_t *fid, FCB **fcb) {
-    PCB *cur = CURPROC;
-    for (size_t i = 0; i < num; i++) {
-        assert(cur->FIDT[fid[i]] == fcb[i]);
-        cur->FIDT[fid[i]] = NULL;
+    for (size_t i = 0; i < num; i++)
         release_FCB(fcb[i]);
-    }
+    Mutex_Unlock(&CURPROC->lock);
 }
 /*
  *
@@ -93,7 +104,7 @@ int Read(Fid_t fd, char *buf, unsigned int size) {
     int retcode = -1;
     int (*devread)(void *, char *, uint);
     void *sobj;
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     /* Get the fields from the stream */
     FCB *fcb = get_fcb(fd);
     if (fcb) {
@@ -102,23 +113,22 @@ int Read(Fid_t fd, char *buf, unsigned int size) {
         /* make sure that the stream will not be closed (by another thread)
            while we are using it! */
         FCB_incref(fcb);
-        /* We must not go into non-preemptive domain with kernel_mutex locked */
-        Mutex_Unlock(&kernel_mutex);
+    }
+    /* We must not call into the stream with the process locked */
+    Mutex_Unlock(&CURPROC->lock);
+    if (fcb) {
         if (devread)
             retcode = devread(sobj, buf, size);
         /* Need to decrease the reference to FCB */
-        Mutex_Lock(&kernel_mutex);
         FCB_decref(fcb);
     }
-    Mutex_Unlock(&kernel_mutex);
-    /* We must not go into non-preemptive domain with kernel_mutex locked */
     return retcode;
 }
 int Write(Fid_t fd, const char *buf, unsigned int size) {
     int retcode = -1;
     int (*devwrite)(void *, const char *, uint) = NULL;
     void *sobj = NULL;
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
 
     /* Get the fields from the stream */
     FCB *fcb = get_fcb(fd);
@@ -129,28 +139,25 @@ int Write(Fid_t fd, const char *buf, unsigned int size) {
         /* make sure that the stream will not be closed (by another thread)
            while we are using it! */
         FCB_incref(fcb);
-
-        /* We must not go into non-preemptive domain with kernel_mutex locked */
-        Mutex_Unlock(&kernel_mutex);
+    }
+    /* We must not call into the stream with the process locked */
+    Mutex_Unlock(&CURPROC->lock);
+    if (fcb) {
         if (devwrite)
             retcode = devwrite(sobj, buf, size);
 
         /* Need to decrease the reference to FCB */
-        Mutex_Lock(&kernel_mutex);
         FCB_decref(fcb);
     }
-    Mutex_Unlock(&kernel_mutex);
     return retcode;
 }
 int Close(int fd) {
     int retcode = (fd >= 0 && fd < MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     FCB *fcb = get_fcb(fd);
-    if (fcb) {
-        CURPROC->FIDT[fd] = NULL;
-        retcode = FCB_decref(fcb);
-    }
-    Mutex_Unlock(&kernel_mutex);
+    if (fcb) { CURPROC->FIDT[fd] = NULL; }
+    Mutex_Unlock(&CURPROC->lock);
+    if (fcb) { retcode = FCB_decref(fcb); }
     return retcode;
 }
 /*
@@ -164,18 +171,20 @@ int Dup2(int oldfd, int newfd) {
     int retcode = 0;
     if (oldfd < 0 || newfd < 0 || oldfd >= MAX_FILEID || newfd >= MAX_FILEID)
         return -1;
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     FCB *old = get_fcb(oldfd);
     FCB *new = get_fcb(newfd);
-    if (old == NULL) {
-        retcode = -1;
-    } else if (old != new) {
-        if (new)
-            FCB_decref(new);
+    if (old == NULL || old == new) {
+        retcode = (old == NULL) ? -1 : 0;
+        new = NULL;
+    } else {
         FCB_incref(old);
         CURPROC->FIDT[newfd] = old;
     }
-    Mutex_Unlock(&kernel_mutex);
+    Mutex_Unlock(&CURPROC->lock);
+    /* The stream replaced is closed without the lock */
+    if (new)
+        FCB_decref(new);
     return retcode;
 }
 unsigned int GetTerminalDevices() {
@@ -187,18 +196,17 @@ unsigned int GetTerminalDevices() {
 Fid_t open_stream(Device_type major, unsigned int minor) {
     Fid_t fid;
     FCB *fcb;
-    Mutex_Lock(&kernel_mutex);
     if (!FCB_reserve(1, &fid, &fcb))
         goto finerr;
     if (device_open(major, minor, &fcb->streamobj, &fcb->streamfunc)) {
         FCB_unreserve(1, &fid, &fcb);
         goto finerr;
     }
+    FCB_publish(1, &fid, &fcb);
     goto finok;
     finerr:
     fid = NOFILE;
     finok:
-    Mutex_Unlock(&kernel_mutex);
     return fid;
 }
 int OpenNull() {
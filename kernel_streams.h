@@ -58,6 +58,9 @@ void FCB_incref(FCB *fcb);
 	Close method and returning its return value.
 	If the reference count is still >0, return 0. 
 
+	Since the stream may be closed, this must not be called with a PCB
+	lock or the FCB lock held.
+
 	@param fcb  the fcb whose reference count is decreased
 	@returns if the reference count is still >0, return 0, else return the value returned by the
 	     `Close()` operation
@@ -72,8 +75,17 @@ int FCB_decref(FCB *fcb);
    If not, the state is unchanged (but the array contents
    may have been overwritten).
 
-   If these resources are not needed, the operation can be
-   reversed by calling @ref FCB_unreserve.
+   The fids are not yet visible to the other threads of the
+   process. On success, this function returns with the lock of
+   the current process held, so that the caller can fill in
+   the stream of each FCB and then install them with
+   @ref FCB_publish. If these resources are not needed, the
+   operation can be reversed by calling @ref FCB_unreserve.
+   Both release the lock. In between, the caller must not
+   take a lock that comes before the PCB lock or call into
+   a stream.
+
+   The caller must not hold the lock of the current process.
 
    @param num the number of resources to reserve.
    @param fid array of size at least `num` of `Fid_t`.
@@ -81,11 +93,25 @@ int FCB_decref(FCB *fcb);
    @returns 1 for success and 0 for failure.
 */
 int FCB_reserve(size_t num, Fid_t *fid, FCB **fcb);
+/** @brief Install a number of reserved FCBs in the FIDT.
+
+   Given the arrays filled by a call to @ref FCB_reserve, this
+   function makes each fid refer to its FCB and releases the lock
+   of the current process. The @c streamobj and @c streamfunc of
+   the FCBs must be set before, since the fids can be used as soon
+   as the lock is released.
+
+   @param num the number of resources to publish.
+   @param fid array of size at least `num` of `Fid_t`.
+   @param fcb array of size at least `num` of `FCB*`.
+*/
+void FCB_publish(size_t num, Fid_t *fid, FCB **fcb);
 /** @brief Release a number of FCBs and corresponding fids.
 
    Given an array of fids of size @ num, this function will 
-   return the fids to the free pool of the current process and
-   release the corresponding FCBs.
+   return the fids to the free pool of the current process,
+   release the corresponding FCBs and the lock of the current
+   process.
 
    This is the opposite of operation @ref FCB_reserve. 
    Note that this is very different from closing open fids.
@@ -102,6 +128,7 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB **fcb);
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	It must be called with the lock of the current process held.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -4,7 +4,9 @@
 #include "kernel_cc.h"
 /*Start the current thread created by the spawn function*/
 void start_thread() {
-    PTCB *ptcb = (PTCB *) ThreadSelf_withMutex();
+    Mutex_Lock(&CURPROC->lock);
+    PTCB *ptcb = FindPTCB(ThreadSelf());
+    Mutex_Unlock(&CURPROC->lock);
     int argl = ptcb->argl;
     void *args = ptcb->args;
     Task call = ptcb->task;
@@ -16,13 +18,21 @@ void start_thread() {
   @brief Create a new thread in the current process.
   */
 Tid_t CreateThread(Task task, int argl, void *args) {
-    Mutex_Lock(&kernel_mutex);
+    return CreateThreadEx(task, argl, args, 0);
+}
+/**
+  @brief Create a new thread in the current process, with the given stack size.
+  */
+Tid_t CreateThreadEx(Task task, int argl, void *args, size_t stack_size) {
+    if (stack_size > MAX_STACK_SIZE) { return NOTHREAD; }
+    Mutex_Lock(&CURPROC->lock);
     CURPROC->threads_counter++;
     assert(CURPROC == CURTHREAD->owner_pcb);
     PTCB *ptcb = (PTCB *) malloc(sizeof(PTCB));
     ptcb->refcount = 0;
     ptcb->isExited = 0;
     ptcb->isDetached = 0;
+    ptcb->thread = NULL;
     ptcb->task = task;
     /* Copy the arguments to new storage, owned by the new process */
     ptcb->argl = argl;
@@ -39,10 +49,11 @@ Tid_t CreateThread(Task task, int argl, void *args) {
     rlist_push_back(&CURPROC->PTCB_list, ptcb_node);
     assert(ptcb != NULL);
     if (task != NULL) {
-        ptcb->thread = spawn_thread(CURPROC, start_thread);
+        ptcb->thread = spawn_thread(CURPROC, start_thread, stack_size);
+        if (CURTHREAD->gang) { sched_set_gang(ptcb->thread, 1); }
         wakeup(ptcb->thread);
     }
-    Mutex_Unlock(&kernel_mutex);
+    Mutex_Unlock(&CURPROC->lock);
     return (Tid_t) ptcb->thread;
 }
 /**
@@ -64,33 +75,23 @@ PTCB *FindPTCB(Tid_t tid) {
     return ptcb;
 }
 /**
-  @brief Return the Tid of the current thread's PTCB.
+  @brief Return the Tid of the current thread.
  */
 Tid_t ThreadSelf() {
-    PTCB *ptcb = FindPTCB((Tid_t) CURTHREAD);
-    return (Tid_t) ptcb;
-}
-/**
- 	@brief Call the ThreadSelf using Mutexes.
- */
-Tid_t ThreadSelf_withMutex() {
-    Mutex_Lock(&kernel_mutex);
-    Tid_t tid = ThreadSelf();
-    Mutex_Unlock(&kernel_mutex);
-    return tid;
+    return (Tid_t) CURTHREAD;
 }
 /**
   @brief Join the given thread.
   */
 int ThreadJoin(Tid_t tid, int *exitval) {
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     PTCB *ptcb = FindPTCB(tid);
     int returnVal = 0;
     if (ptcb == NULL || tid == (Tid_t) CURTHREAD || ptcb->isDetached) { returnVal = -1; }
     else {
         ptcb->refcount++;
         while (!ptcb->isExited && !ptcb->isDetached) {
-            Cond_Wait(&kernel_mutex, &ptcb->condVar);
+            Cond_Wait(&CURPROC->lock, &ptcb->condVar);
         }
         if (ptcb->isDetached) {
             returnVal = -1;
@@ -104,14 +105,14 @@ int ThreadJoin(Tid_t tid, int *exitval) {
             }
         }
     }
-    Mutex_Unlock(&kernel_mutex);
+    Mutex_Unlock(&CURPROC->lock);
     return returnVal;
 }
 /**
   @brief Detach the given thread.
   */
 int ThreadDetach(Tid_t tid) {
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     PTCB *ptcb = FindPTCB(tid);
     int returnVal;
     if (ptcb == NULL || ptcb->isExited) {
@@ -121,22 +122,21 @@ int ThreadDetach(Tid_t tid) {
         Cond_Broadcast(&ptcb->condVar);
         returnVal = 0;
     }
-    Mutex_Unlock(&kernel_mutex);
+    Mutex_Unlock(&CURPROC->lock);
     return returnVal;
 }
 /**
   @brief Terminate the current thread.
   */
 void ThreadExit(int exitval) {
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     CURPROC->threads_counter--;
-    PTCB *ptcb = ((PTCB *) ThreadSelf());
+    PTCB *ptcb = FindPTCB(ThreadSelf());
     ptcb->isExited = 1;
     ptcb->exitval = exitval;
     Cond_Broadcast(&ptcb->condVar);
     Cond_Broadcast(&CURPROC->condVar);
-    sleep_releasing(EXITED, &kernel_mutex);
-    Mutex_Unlock(&kernel_mutex);
+    sleep_releasing(EXITED, &CURPROC->lock);
 }
 /**
   @brief Awaken the thread, if it is sleeping.
@@ -146,26 +146,20 @@ void ThreadExit(int exitval) {
 
   */
 int ThreadInterrupt(Tid_t tid) {
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     TCB *tcb = (TCB *) tid;
     tcb->interruptFlag = 1;
-    if (tcb->state == STOPPED) {
-        Mutex_Unlock(&kernel_mutex);
-        wakeup(tcb);
-        return 0;
-    } else {
-        Mutex_Unlock(&kernel_mutex);
-        return -1;
-    }
+    Mutex_Unlock(&CURPROC->lock);
+    return wakeup_if_stopped(tcb) ? 0 : -1;
 }
 /**
   @brief Return the interrupt flag of the
   current thread.
   */
 int ThreadIsInterrupted() {
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     int returnVal = CURTHREAD->interruptFlag;
-    Mutex_Unlock(&kernel_mutex);
+    Mutex_Unlock(&CURPROC->lock);
     return returnVal;
 }
 /**
@@ -173,7 +167,88 @@ int ThreadIsInterrupted() {
   current thread.
   */
 void ThreadClearInterrupt() {
-    Mutex_Lock(&kernel_mutex);
+    Mutex_Lock(&CURPROC->lock);
     CURTHREAD->interruptFlag = 0;
-    Mutex_Unlock(&kernel_mutex);
-}
\ No newline at end of file
+    Mutex_Unlock(&CURPROC->lock);
+}
+/*Our edits*/
+/*
+  Return the live thread tid of the current process, or NULL.
+  NOTHREAD stands for the current thread. Called with the lock of the
+  current process held.
+ */
+static TCB *find_live_thread(Tid_t tid) {
+    if (tid == NOTHREAD) { return CURTHREAD; }
+    PTCB *ptcb = FindPTCB(tid);
+    if (ptcb == NULL || ptcb->isExited) { return NULL; }
+    return ptcb->thread;
+}
+/**
+  @brief Set the cpu affinity of a thread.
+  */
+int SetThreadAffinity(Tid_t tid, cpu_mask_t mask) {
+    uint ncores = cpu_cores();
+    cpu_mask_t online = (ncores >= 8 * sizeof(cpu_mask_t)) ? CPU_MASK_ALL : ((cpu_mask_t) 1 << ncores) - 1;
+    mask &= online;
+    if (mask == 0) { return -1; }
+    Mutex_Lock(&CURPROC->lock);
+    TCB *tcb = find_live_thread(tid);
+    if (tcb != NULL) { tcb->affinity = mask; }
+    Mutex_Unlock(&CURPROC->lock);
+    if (tcb == NULL) { return -1; }
+    /* Migrate now, if the current core is no longer allowed */
+    if (tcb == CURTHREAD && !thread_can_run_on(tcb, cpu_core_id)) {
+        int preempt = preempt_off;
+        yield();
+        if (preempt) { preempt_on; }
+    }
+    return 0;
+}
+/**
+  @brief Set the scheduling class and priority of a thread.
+  */
+int SetThreadPriority(Tid_t tid, sched_class sclass, int prio) {
+    switch (sclass) {
+        case SCHED_CLASS_NORMAL:
+            if (prio != 0) { return -1; }
+            break;
+        case SCHED_CLASS_FIFO:
+        case SCHED_CLASS_RR:
+            if (prio < 0 || prio >= MAX_RT_PRIORITY) { return -1; }
+            break;
+        default:
+            return -1;
+    }
+    Mutex_Lock(&CURPROC->lock);
+    TCB *tcb = find_live_thread(tid);
+    if (tcb != NULL) { sched_set_priority(tcb, sclass, prio); }
+    Mutex_Unlock(&CURPROC->lock);
+    if (tcb == NULL) { return -1; }
+    /* Let a more urgent thread run now, if the current thread was demoted */
+    if (tcb == CURTHREAD) {
+        int preempt = preempt_off;
+        yield();
+        if (preempt) { preempt_on; }
+    }
+    return 0;
+}
+/**
+  @brief Make a thread a gang thread, or a normal one.
+  */
+int SetThreadGang(Tid_t tid, int gang) {
+    Mutex_Lock(&CURPROC->lock);
+    TCB *tcb = find_live_thread(tid);
+    if (tcb != NULL) { sched_set_gang(tcb, gang); }
+    Mutex_Unlock(&CURPROC->lock);
+    return (tcb == NULL) ? -1 : 0;
+}
+/**
+  @brief Return the cpu affinity of a thread.
+  */
+cpu_mask_t GetThreadAffinity(Tid_t tid) {
+    Mutex_Lock(&CURPROC->lock);
+    TCB *tcb = find_live_thread(tid);
+    cpu_mask_t mask = (tcb != NULL) ? tcb->affinity : 0;
+    Mutex_Unlock(&CURPROC->lock);
+    return mask;
+}
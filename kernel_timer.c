@@ -0,0 +1,206 @@
+#include <time.h>
+#include "bios.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+#include "kernel_timer.h"
+/*
+  The timing wheels of the cores.
+
+  Each wheel is touched by other cores only to cancel timers, so the wheel
+  lock is practically uncontended. Wheel locks are always taken with
+  preemption off, because the scheduler expires timers from inside yield().
+ */
+static TimerWheel wheels[MAX_CORES];
+/* The tick at boot, the origin of GetTime() */
+static uint64_t boot_tick;
+#define WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+uint64_t timer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK;
+}
+void timer_init(TimeoutCB *t, timer_callback callback, void *data) {
+    rlnode_init(&t->node, t);
+    t->expires = 0;
+    t->callback = callback;
+    t->data = data;
+    t->wheel = NULL;
+}
+/*
+  Put a timer into the slot which will be reached no later than its expiry.
+  Timers that are already due go to the slot of the next tick. Must be called
+  with w->lock held.
+ */
+static void wheel_insert(TimerWheel *w, TimeoutCB *t) {
+    uint64_t delta = (t->expires > w->base) ? t->expires - w->base : 0;
+    if (delta >= TIMER_WHEEL_SPAN) { delta = TIMER_WHEEL_SPAN - 1; }
+    uint64_t when = w->base + delta;
+    int level = 0;
+    while (delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1)))) { level++; }
+    uint idx = (when >> (TIMER_WHEEL_BITS * level)) & WHEEL_MASK;
+    rlist_push_back(&w->slot[level][idx], &t->node);
+}
+/*
+  Move the timers of the current slot of a level to the lower levels.
+  Return the index of the slot, so that the caller knows whether the next
+  level must also be cascaded.
+ */
+static uint wheel_cascade(TimerWheel *w, int level) {
+    uint idx = (w->base >> (TIMER_WHEEL_BITS * level)) & WHEEL_MASK;
+    rlnode *slot = &w->slot[level][idx];
+    rlnode list;
+    rlnode_new(&list);
+    if (!is_rlist_empty(slot)) {
+        rlist_push_back(&list, slot);
+        rlist_remove(slot);
+    }
+    while (!is_rlist_empty(&list)) { wheel_insert(w, rlist_pop_front(&list)->timeoutCB); }
+    return idx;
+}
+void timer_arm(TimeoutCB *t, uint64_t expires) {
+    int preempt = preempt_off;
+    TimerWheel *w = &wheels[cpu_core_id];
+    assert(t->wheel == NULL);
+    Spin_Lock(&w->lock);
+    t->expires = expires;
+    t->wheel = w;
+    wheel_insert(w, t);
+    w->count++;
+    Spin_Unlock(&w->lock);
+    if (preempt) { preempt_on; }
+}
+int timer_cancel(TimeoutCB *t) {
+    TimerWheel *w = __atomic_load_n(&t->wheel, __ATOMIC_ACQUIRE);
+    if (w == NULL) { return 0; }
+    int preempt = preempt_off;
+    int armed = 0;
+    Spin_Lock(&w->lock);
+    /* An expiring timer is unlinked from the wheel only after its callback returns */
+    if (t->wheel == w) {
+        rlist_remove(&t->node);
+        t->wheel = NULL;
+        w->count--;
+        armed = 1;
+    }
+    Spin_Unlock(&w->lock);
+    if (preempt) { preempt_on; }
+    return armed;
+}
+void timer_expire() {
+    TimerWheel *w = &wheels[cpu_core_id];
+    uint64_t now = timer_now();
+    /* Only the owner core advances the base */
+    if (w->base > now) { return; }
+    Spin_Lock(&w->lock);
+    while (w->base <= now) {
+        /* Nothing is armed, jump to the present */
+        if (w->count == 0) {
+            w->base = now + 1;
+            break;
+        }
+        uint idx = w->base & WHEEL_MASK;
+        if (idx == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS && wheel_cascade(w, level) == 0; level++);
+        }
+        w->base++;
+        /* Detach the slot, since timers that are not due yet are re-inserted */
+        rlnode expired;
+        rlnode_new(&expired);
+        rlnode *slot = &w->slot[0][idx];
+        if (!is_rlist_empty(slot)) {
+            rlist_push_back(&expired, slot);
+            rlist_remove(slot);
+        }
+        while (!is_rlist_empty(&expired)) {
+            TimeoutCB *t = rlist_pop_front(&expired)->timeoutCB;
+            if (t->expires >= w->base) {
+                /* A timer beyond the span of the wheel, which waited at the last level */
+                wheel_insert(w, t);
+                continue;
+            }
+            w->count--;
+            t->callback(t);
+            __atomic_store_n(&t->wheel, NULL, __ATOMIC_RELEASE);
+        }
+    }
+    Spin_Unlock(&w->lock);
+}
+/*
+  Timers due within a wheel turn are found in level 0, at their tick. Timers
+  further away wait at a higher level, and come no earlier than the cascade
+  of their slot, which is returned instead. So the core is not woken up
+  every turn of level 0 while a long timer is armed.
+ */
+uint64_t timer_next_expiry() {
+    TimerWheel *w = &wheels[cpu_core_id];
+    uint64_t next = 0;
+    Spin_Lock(&w->lock);
+    if (w->count > 0) {
+        next = UINT64_MAX;
+        for (uint64_t t = w->base; t < w->base + TIMER_WHEEL_SIZE; t++) {
+            if (!is_rlist_empty(&w->slot[0][t & WHEEL_MASK])) {
+                next = t;
+                break;
+            }
+        }
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            int shift = TIMER_WHEEL_BITS * level;
+            uint64_t pos = w->base >> shift;
+            for (uint64_t k = 1; k <= TIMER_WHEEL_SIZE && ((pos + k) << shift) < next; k++) {
+                if (!is_rlist_empty(&w->slot[level][(pos + k) & WHEEL_MASK])) {
+                    next = (pos + k) << shift;
+                    break;
+                }
+            }
+        }
+    }
+    Spin_Unlock(&w->lock);
+    return next;
+}
+void initialize_timers() {
+    uint64_t now = timer_now();
+    boot_tick = now;
+    for (int c = 0; c < MAX_CORES; c++) {
+        TimerWheel *w = &wheels[c];
+        w->lock = SPINLOCK_INIT;
+        w->base = now;
+        w->count = 0;
+        for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+            for (int i = 0; i < TIMER_WHEEL_SIZE; i++) { rlnode_new(&w->slot[l][i]); }
+        }
+    }
+}
+/*
+  System calls
+ */
+timeout_t GetTime() {
+    return (timeout_t) (timer_now() - boot_tick) * TIMER_TICK;
+}
+/* The sleeper may have been interrupted, and must not be woken up twice */
+static void sleep_timeout(TimeoutCB *t) {
+    wakeup_if_stopped(t->data);
+}
+/*
+  Park the current thread until tick 'expires'. The timer is armed on the
+  current core with preemption off, so it cannot expire before the thread
+  is stopped: only this core expires it, from inside yield().
+ */
+static int sleep_until_tick(uint64_t expires) {
+    TimeoutCB timer;
+    timer_init(&timer, sleep_timeout, CURTHREAD);
+    int preempt = preempt_off;
+    timer_arm(&timer, expires);
+    sleep_releasing(STOPPED, NULL);
+    if (preempt) { preempt_on; }
+    /* If the timer is still armed, we were interrupted */
+    return timer_cancel(&timer) ? -1 : 0;
+}
+int Sleep(timeout_t msec) {
+    if (msec <= 0) { return 0; }
+    return sleep_until_tick(timer_now() + (msec + TIMER_TICK - 1) / TIMER_TICK);
+}
+int SleepUntil(timeout_t abstime) {
+    uint64_t expires = boot_tick + (abstime + TIMER_TICK - 1) / TIMER_TICK;
+    if (abstime < 0 || expires <= timer_now()) { return 0; }
+    return sleep_until_tick(expires);
+}
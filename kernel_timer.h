@@ -0,0 +1,95 @@
+#ifndef __KERNEL_TIMER_H
+#define __KERNEL_TIMER_H
+#include "util.h"
+#include "tinyos.h"
+/**
+	@file kernel_timer.h
+	@brief Kernel timers.
+
+	@defgroup timers Timers.
+	@ingroup kernel
+	@brief Kernel timers.
+
+	Every core owns a hierarchical timing wheel, driven by the monotonic clock
+	of the host. A timer is armed on the wheel of the current core and its
+	callback is executed by that core, from inside the scheduler, once the
+	timer expires.
+
+	The wheel has @c TIMER_WHEEL_LEVELS levels of @c TIMER_WHEEL_SIZE slots.
+	A slot of level 0 holds the timers of a single tick, and a slot of level
+	@c l covers @c TIMER_WHEEL_SIZE slots of level @c l-1. Timers are moved one
+	level down when the wheel reaches their slot, so arming, cancelling and
+	expiring a timer all cost O(1) amortized. Timers further in the future
+	than the wheel spans wait in the last level.
+
+	@{
+*/
+/** @brief The log2 of the number of slots per level */
+#define TIMER_WHEEL_BITS (6)
+/** @brief The number of slots per level */
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+/** @brief The number of levels of a wheel */
+#define TIMER_WHEEL_LEVELS (4)
+/** @brief The number of ticks that a wheel spans */
+#define TIMER_WHEEL_SPAN (1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+/** @brief The granularity of the timers, in msec */
+#define TIMER_TICK (1)
+/** @brief The timer callback type */
+typedef void (*timer_callback)(TimeoutCB *);
+/** @brief A per-core timing wheel */
+typedef struct timer_wheel {
+	Spinlock lock;                                             /**< Spinlock protecting the wheel */
+	uint64_t base;                                             /**< The next tick to be processed */
+	uint count;                                                /**< Number of armed timers */
+	rlnode slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];         /**< The timer lists */
+} TimerWheel;
+/** @brief The timeout control block.
+
+	A timer, usually allocated by the caller on its stack. A timer must be
+	cancelled or have expired before its memory is reused.
+ */
+typedef struct timeout_control_block {
+	rlnode node;                     /**< Node in a wheel slot */
+	uint64_t expires;                /**< The tick at which the timer expires */
+	timer_callback callback;         /**< Called with the timer, when it expires */
+	void *data;                      /**< Data for the callback */
+	TimerWheel *wheel;               /**< The wheel of an armed timer, else NULL */
+} TimeoutCB;
+/** @brief Return the current tick of the monotonic clock. */
+uint64_t timer_now(void);
+/** @brief Initialize a timer with a callback and its data. */
+void timer_init(TimeoutCB *t, timer_callback callback, void *data);
+/**
+	@brief Arm a timer on the current core, to expire at tick @c expires.
+
+	The callback is executed in the non-preemptive domain, by the current core,
+	with the wheel locked. It must not block, or arm and cancel timers.
+ */
+void timer_arm(TimeoutCB *t, uint64_t expires);
+/**
+	@brief Cancel a timer.
+
+	When this call returns, the callback of the timer is not running and will
+	not run. It is safe to call on a timer that has already expired.
+	@returns 1 if the timer was armed, 0 if it had expired (or was never armed).
+ */
+int timer_cancel(TimeoutCB *t);
+/**
+	@brief Expire the timers of the current core.
+
+	Called by the scheduler with preemption off. Expired callbacks are
+	executed in order of expiry.
+ */
+void timer_expire(void);
+/**
+	@brief Return a tick no later than the next expiry on the current core.
+
+	Used by the scheduler to decide how far it may leave the core without
+	an alarm. The tick may be early, but never late.
+	@returns the tick, or 0 if no timer is armed on the current core.
+ */
+uint64_t timer_next_expiry(void);
+/** @brief Initialize the timing wheels of all cores. */
+void initialize_timers(void);
+/** @} */
+#endif
@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "tinyos.h"
+#include "kernel_sched.h"
+
+
+/*
+ 	A standalone program measuring the latency and throughput of the
+ 	tinyos scheduler, over a range of core counts.
+
+ 	For each number of cores, the kernel is booted once and the init task
+ 	runs four measurements:
+
+ 	- yield:      the round-trip time of yield(), between two threads on core 0
+ 	- signal:     the time from Cond_Signal until the waiter runs, on core 0
+ 	- crosscore:  the same, with the waiter on core 1 (2 cores or more)
+ 	- throughput: the work done by N CPU-bound and M I/O-bound threads in a
+ 	              fixed time, and the lateness of the I/O-bound threads
+
+ 	The latencies are printed as percentiles and log2 histograms, or, with
+ 	-j, as a JSON document.
+ */
+
+
+/* Return the current time from the host's monotonic clock, in seconds */
+static double wall_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+
+/****************************************************
+
+  Latency samples.
+
+ ****************************************************/
+
+typedef struct {
+  double* v;        /* The samples, in seconds */
+  int n;            /* Number of samples */
+  int cap;          /* Size of v */
+} series;
+
+static void series_init(series* s, int cap)
+{
+  s->v = malloc(cap * sizeof(double));
+  s->n = 0;
+  s->cap = cap;
+}
+
+static void series_free(series* s)
+{
+  free(s->v);
+  s->v = NULL;
+  s->n = s->cap = 0;
+}
+
+/* Samples beyond the capacity are dropped */
+static void series_add(series* s, double x)
+{
+  if(s->n < s->cap) s->v[s->n++] = x;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void series_sort(series* s)
+{
+  qsort(s->v, s->n, sizeof(double), cmp_double);
+}
+
+/* The p-th quantile of a sorted series, in usec */
+static double series_pct(series* s, double p)
+{
+  if(s->n == 0) return 0;
+  int i = (int)(p * s->n);
+  if(i >= s->n) i = s->n - 1;
+  return s->v[i] * 1E6;
+}
+
+static double series_mean(series* s)
+{
+  double sum = 0;
+  for(int i=0; i<s->n; i++) sum += s->v[i];
+  return s->n ? sum / s->n * 1E6 : 0;
+}
+
+
+/****************************************************
+
+  The measurements.
+
+ ****************************************************/
+
+typedef struct {
+  int rounds;       /* Samples of the yield and signal measurements */
+  int cpu_threads;  /* N */
+  int io_threads;   /* M */
+  int msec;         /* Duration of the throughput measurement */
+} bench_args;
+
+typedef struct {
+  int cores;
+  series yield;
+  series signal;
+  series crosscore;
+  series io_late;
+  double cpu_rate;  /* CPU-bound bursts per second */
+  double io_rate;   /* I/O-bound operations per second */
+} bench_result;
+
+static bench_result* result;
+
+
+/*
+  Yield round-trip. Two threads on core 0 yield to each other; the time
+  spent in yield() by one of them is a switch out and a switch back in.
+ */
+
+static volatile int yl_done;
+
+static int yield_thread(int argl, void* args)
+{
+  SetThreadAffinity(NOTHREAD, 1);
+  if(argl > 0) {
+    for(int i=0; i<argl; i++) {
+      double start = wall_time();
+      yield();
+      series_add(&result->yield, wall_time() - start);
+    }
+    yl_done = 1;
+  } else {
+    while(! yl_done)
+      yield();
+  }
+  return 0;
+}
+
+static void measure_yield(bench_args* a)
+{
+  yl_done = 0;
+  Tid_t t0 = CreateThread(yield_thread, a->rounds, NULL);
+  Tid_t t1 = CreateThread(yield_thread, 0, NULL);
+  ThreadJoin(t0, NULL);
+  ThreadJoin(t1, NULL);
+}
+
+
+/*
+  Signal-to-run latency. A signaller on core 0 and a waiter on a given core
+  play ping-pong on two condition variables. The waiter records the time
+  from the signal until it runs.
+ */
+
+static Mutex wake_mx = MUTEX_INIT;
+static CondVar wake_cv = COND_INIT;
+static CondVar wake_ack_cv = COND_INIT;
+static volatile double wake_stamp;
+static volatile int wake_round;
+static volatile int wake_ack;
+
+typedef struct {
+  int rounds;
+  series* s;
+} wake_args;
+
+static int wake_waiter(int argl, void* args)
+{
+  wake_args* w = args;
+  SetThreadAffinity(NOTHREAD, 1u << argl);
+  Mutex_Lock(&wake_mx);
+  for(int r=0; r<w->rounds; r++) {
+    while(wake_round == r)
+      Cond_Wait(&wake_mx, &wake_cv);
+    series_add(w->s, wall_time() - wake_stamp);
+    wake_ack = r+1;
+    Cond_Signal(&wake_ack_cv);
+  }
+  Mutex_Unlock(&wake_mx);
+  return 0;
+}
+
+static void measure_wakeup(bench_args* a, uint core, series* s)
+{
+  wake_args w = { a->rounds, s };
+  wake_round = wake_ack = 0;
+  SetThreadAffinity(NOTHREAD, 1);
+  Tid_t t = CreateThread(wake_waiter, core, &w);
+
+  for(int r=0; r<a->rounds; r++) {
+    Mutex_Lock(&wake_mx);
+    wake_stamp = wall_time();
+    wake_round = r+1;
+    Cond_Signal(&wake_cv);
+    while(wake_ack == r)
+      Cond_Wait(&wake_mx, &wake_ack_cv);
+    Mutex_Unlock(&wake_mx);
+  }
+  ThreadJoin(t, NULL);
+  SetThreadAffinity(NOTHREAD, CPU_MASK_ALL);
+}
+
+
+/*
+  Mixed throughput. CPU-bound threads count fixed bursts of work, I/O-bound
+  threads do a short burst and sleep for 1 msec, recording how late they
+  wake up.
+ */
+
+#define CPU_BURST 10000
+#define IO_BURST_USEC 20
+
+static volatile double tp_end;
+static unsigned long tp_cpu_bursts;
+static unsigned long tp_io_ops;
+
+static int cpu_thread(int argl, void* args)
+{
+  unsigned long bursts = 0;
+  while(wall_time() < tp_end) {
+    for(volatile int i=0; i<CPU_BURST; i++);
+    bursts++;
+  }
+  __atomic_add_fetch(&tp_cpu_bursts, bursts, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static int io_thread(int argl, void* args)
+{
+  unsigned long ops = 0;
+  while(wall_time() < tp_end) {
+    double until = wall_time() + IO_BURST_USEC * 1E-6;
+    while(wall_time() < until);
+    double start = wall_time();
+    Sleep(1);
+    double late = wall_time() - start - 1E-3;
+    Mutex_Lock(&wake_mx);
+    series_add(&result->io_late, late > 0 ? late : 0);
+    Mutex_Unlock(&wake_mx);
+    ops++;
+  }
+  __atomic_add_fetch(&tp_io_ops, ops, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void measure_throughput(bench_args* a)
+{
+  int n = a->cpu_threads + a->io_threads;
+  Tid_t* tids = malloc(n * sizeof(Tid_t));
+  tp_cpu_bursts = tp_io_ops = 0;
+
+  double start = wall_time();
+  tp_end = start + a->msec * 1E-3;
+  for(int i=0; i<n; i++)
+    tids[i] = CreateThread(i < a->cpu_threads ? cpu_thread : io_thread, 0, NULL);
+  for(int i=0; i<n; i++)
+    ThreadJoin(tids[i], NULL);
+  double elapsed = wall_time() - start;
+
+  result->cpu_rate = tp_cpu_bursts / elapsed;
+  result->io_rate = tp_io_ops / elapsed;
+  free(tids);
+}
+
+
+static int bench_task(int argl, void* args)
+{
+  bench_args* a = args;
+  measure_yield(a);
+  measure_wakeup(a, 0, &result->signal);
+  if(cpu_cores() > 1)
+    measure_wakeup(a, 1, &result->crosscore);
+  measure_throughput(a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Reports.
+
+ ****************************************************/
+
+static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char* pct_names[] = { "p50", "p90", "p99", "p99.9" };
+#define NPCTS (sizeof(pcts)/sizeof(pcts[0]))
+
+static void print_series(const char* title, series* s)
+{
+  printf("  %s: n=%d", title, s->n);
+  if(s->n == 0) { printf("\n"); return; }
+  printf(" mean=%.1f", series_mean(s));
+  for(uint i=0; i<NPCTS; i++)
+    printf(" %s=%.1f", pct_names[i], series_pct(s, pcts[i]));
+  printf(" max=%.1f usec\n", series_pct(s, 1.0));
+
+  /* A log2 histogram, in usec */
+  int cum = 0;
+  for(double limit = 1; cum < s->n; limit *= 2) {
+    int count = 0;
+    while(cum + count < s->n && s->v[cum + count] * 1E6 < limit) count++;
+    cum += count;
+    if(count == 0) continue;
+    char bar[41];
+    int len = (int)(40.0 * count / s->n + 0.5);
+    memset(bar, '#', len);
+    bar[len] = '\0';
+    printf("    < %8.0f usec |%-40s| %6.2f%%  cum %6.2f%%\n",
+	   limit, bar, 100.0 * count / s->n, 100.0 * cum / s->n);
+  }
+}
+
+static void print_text(bench_args* a, bench_result* r)
+{
+  printf("cores=%d\n", r->cores);
+  print_series("yield round-trip", &r->yield);
+  print_series("signal-to-run", &r->signal);
+  if(r->cores > 1)
+    print_series("cross-core wakeup", &r->crosscore);
+  printf("  throughput: cpu threads=%d io threads=%d cpu bursts/sec=%.0f io ops/sec=%.0f\n",
+	 a->cpu_threads, a->io_threads, r->cpu_rate, r->io_rate);
+  print_series("io lateness", &r->io_late);
+  printf("\n");
+}
+
+static void json_series(const char* name, series* s)
+{
+  printf("\"%s\": ", name);
+  if(s->n == 0) { printf("null"); return; }
+  printf("{\"n\": %d, \"mean\": %.3f", s->n, series_mean(s));
+  for(uint i=0; i<NPCTS; i++)
+    printf(", \"%s\": %.3f", pct_names[i], series_pct(s, pcts[i]));
+  printf(", \"max\": %.3f}", series_pct(s, 1.0));
+}
+
+static void print_json(bench_args* a, bench_result* r, int first)
+{
+  printf("%s    {\"cores\": %d, ", first ? "" : ",\n", r->cores);
+  json_series("yield_usec", &r->yield);
+  printf(", ");
+  json_series("signal_usec", &r->signal);
+  printf(", ");
+  json_series("crosscore_usec", &r->crosscore);
+  printf(", \"throughput\": {\"cpu_threads\": %d, \"io_threads\": %d, \"msec\": %d, "
+	 "\"cpu_bursts_per_sec\": %.1f, \"io_ops_per_sec\": %.1f, ",
+	 a->cpu_threads, a->io_threads, a->msec, r->cpu_rate, r->io_rate);
+  json_series("io_late_usec", &r->io_late);
+  printf("}}");
+}
+
+
+/****************************************************/
+
+void usage(const char* pname)
+{
+  printf("usage:\n  %s [-j] [-c <maxcores>] [-r <rounds>] [-n <cpu threads>] [-m <io threads>] [-t <msec>]\n\n"
+	 "    Run the measurements on 1, 2, 4, ... cores, up to <maxcores> (default %d).\n"
+	 "    With -j, print the results as JSON.\n",
+	 pname, MAX_CORES);
+  exit(1);
+}
+
+
+int main(int argc, char* const* argv)
+{
+  bench_args a = { 1000, 4, 4, 500 };
+  int maxcores = MAX_CORES;
+  int json = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "jc:r:n:m:t:")) != -1) {
+    switch(opt) {
+    case 'j': json = 1; break;
+    case 'c': maxcores = atoi(optarg); break;
+    case 'r': a.rounds = atoi(optarg); break;
+    case 'n': a.cpu_threads = atoi(optarg); break;
+    case 'm': a.io_threads = atoi(optarg); break;
+    case 't': a.msec = atoi(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if(optind != argc || maxcores <= 0 || maxcores > MAX_CORES || a.rounds <= 0
+     || a.cpu_threads < 0 || a.io_threads < 0 || a.msec <= 0)
+    usage(argv[0]);
+
+  if(json)
+    printf("{\"benchmark\": \"latbench\", \"rounds\": %d, \"runs\": [\n", a.rounds);
+
+  for(int cores = 1; ; cores *= 2) {
+    if(cores > maxcores) cores = maxcores;
+
+    bench_result r;
+    r.cores = cores;
+    series_init(&r.yield, a.rounds);
+    series_init(&r.signal, a.rounds);
+    series_init(&r.crosscore, a.rounds);
+    /* Each I/O-bound thread does at most one operation per msec */
+    series_init(&r.io_late, a.io_threads * (a.msec + 1));
+    result = &r;
+
+    boot(cores, 0, bench_task, sizeof(a), &a);
+
+    series_sort(&r.yield);
+    series_sort(&r.signal);
+    series_sort(&r.crosscore);
+    series_sort(&r.io_late);
+    if(json)
+      print_json(&a, &r, cores == 1);
+    else
+      print_text(&a, &r);
+    fflush(stdout);
+
+    series_free(&r.yield);
+    series_free(&r.signal);
+    series_free(&r.crosscore);
+    series_free(&r.io_late);
+
+    if(cores == maxcores) break;
+  }
+
+  if(json)
+    printf("\n  ]\n}\n");
+  return 0;
+}
@@ -0,0 +1,1085 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "tinyos.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+#include "symposium.h"
+
+
+/*
+ 	A standalone program with micro-benchmarks for the tinyos scheduler.
+
+ 	Each benchmark boots the kernel, runs a workload in the init task
+ 	and prints its measurements to the standard output.
+ */
+
+
+/* Return the current time from the host's monotonic clock, in seconds */
+static double wall_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+
+/****************************************************
+
+  Yield cost.
+
+  A number of threads loop calling the scheduler's yield(). All of them are
+  always ready, so every yield selects the next thread out of a run queue
+  holding them all.
+
+ ****************************************************/
+
+typedef struct {
+  int threads;
+  int yields;
+} yield_args;
+
+static int yield_thread(int argl, void* args)
+{
+  for(int i=0; i<argl; i++)
+    yield();
+  return 0;
+}
+
+static int yield_bench(int argl, void* args)
+{
+  yield_args* a = args;
+  Tid_t* tids = malloc(a->threads * sizeof(Tid_t));
+
+  double start = wall_time();
+  for(int i=0; i<a->threads; i++)
+    tids[i] = CreateThread(yield_thread, a->yields, NULL);
+  for(int i=0; i<a->threads; i++)
+    ThreadJoin(tids[i], NULL);
+  double elapsed = wall_time() - start;
+
+  double total = (double) a->threads * a->yields;
+  printf("yield: threads=%d yields/thread=%d time=%.3f sec cost=%.1f nsec/yield\n",
+	 a->threads, a->yields, elapsed, elapsed * 1E9 / total);
+
+  free(tids);
+  return 0;
+}
+
+static int run_yield(int ncores, int argc, const char** argv)
+{
+  yield_args a = { 1000, 1000 };
+  if(argc > 0) a.threads = atoi(argv[0]);
+  if(argc > 1) a.yields = atoi(argv[1]);
+  if(a.threads <= 0 || a.yields <= 0) return -1;
+
+  boot(ncores, 0, yield_bench, sizeof(a), &a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Wakeup latency.
+
+  A signaller thread, pinned to core 0, and a waiter thread play ping-pong
+  on two condition variables. Each round, the signaller burns <busy> usec,
+  timestamps and signals; the waiter records the time from the signal until
+  it runs, and answers. Since the signaller's core is busy until it blocks
+  for the answer, the waiter is best run by some idle core.
+
+ ****************************************************/
+
+static Mutex wake_mx = MUTEX_INIT;
+static CondVar wake_cv = COND_INIT;
+static CondVar wake_ack_cv = COND_INIT;
+static volatile double wake_stamp;
+static volatile int wake_round;
+static volatile int wake_ack;
+static double* wake_lat;
+
+typedef struct {
+  int rounds;
+  int busy;
+} wakeup_args;
+
+static int wake_waiter(int argl, void* args)
+{
+  Mutex_Lock(&wake_mx);
+  for(int r=0; r<argl; r++) {
+    while(wake_round == r)
+      Cond_Wait(&wake_mx, &wake_cv);
+    wake_lat[r] = wall_time() - wake_stamp;
+    wake_ack = r+1;
+    Cond_Signal(&wake_ack_cv);
+  }
+  Mutex_Unlock(&wake_mx);
+  return 0;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static int wakeup_bench(int argl, void* args)
+{
+  wakeup_args* a = args;
+  int rounds = a->rounds;
+  wake_lat = malloc(rounds * sizeof(double));
+  wake_round = wake_ack = 0;
+  SetThreadAffinity(NOTHREAD, 1);
+  Tid_t t = CreateThread(wake_waiter, rounds, NULL);
+
+  for(int r=0; r<rounds; r++) {
+    /* Keep core 0 busy for a while */
+    double until = wall_time() + a->busy * 1E-6;
+    while(wall_time() < until);
+    Mutex_Lock(&wake_mx);
+    wake_stamp = wall_time();
+    wake_round = r+1;
+    Cond_Signal(&wake_cv);
+    while(wake_ack == r)
+      Cond_Wait(&wake_mx, &wake_ack_cv);
+    Mutex_Unlock(&wake_mx);
+  }
+  ThreadJoin(t, NULL);
+
+  double sum = 0;
+  for(int r=0; r<rounds; r++) sum += wake_lat[r];
+  qsort(wake_lat, rounds, sizeof(double), cmp_double);
+  printf("wakeup: rounds=%d busy=%d usec mean=%.1f p50=%.1f p99=%.1f max=%.1f usec\n",
+	 rounds, a->busy, sum/rounds*1E6, wake_lat[rounds/2]*1E6,
+	 wake_lat[(rounds*99)/100]*1E6, wake_lat[rounds-1]*1E6);
+  free(wake_lat);
+  return 0;
+}
+
+static int run_wakeup(int ncores, int argc, const char** argv)
+{
+  wakeup_args a = { 1000, 0 };
+  if(argc > 0) a.rounds = atoi(argv[0]);
+  if(argc > 1) a.busy = atoi(argv[1]);
+  if(a.rounds <= 0 || a.busy < 0 || ncores < 2) return -1;
+
+  boot(ncores, 0, wakeup_bench, sizeof(a), &a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Context switch cost.
+
+  Two threads, both pinned to core 0, play ping-pong over a condition
+  variable, so that every hand-off is a switch between them on the same
+  core.
+
+ ****************************************************/
+
+static Mutex pp_mx = MUTEX_INIT;
+static CondVar pp_cv = COND_INIT;
+static volatile int pp_turn;
+
+static int pp_player(int argl, void* args)
+{
+  int me = (int)(intptr_t) args;
+  SetThreadAffinity(NOTHREAD, 1);
+  Mutex_Lock(&pp_mx);
+  for(int r=0; r<argl; r++) {
+    while(pp_turn != me)
+      Cond_Wait(&pp_mx, &pp_cv);
+    pp_turn = !me;
+    Cond_Signal(&pp_cv);
+  }
+  Mutex_Unlock(&pp_mx);
+  return 0;
+}
+
+static int pingpong_bench(int argl, void* args)
+{
+  pp_turn = 0;
+  double start = wall_time();
+  Tid_t t0 = CreateThread(pp_player, argl, (void*) 0);
+  Tid_t t1 = CreateThread(pp_player, argl, (void*) 1);
+  ThreadJoin(t0, NULL);
+  ThreadJoin(t1, NULL);
+  double elapsed = wall_time() - start;
+
+  printf("pingpong: rounds=%d time=%.3f sec cost=%.1f nsec/switch\n",
+	 argl, elapsed, elapsed * 1E9 / (2.0 * argl));
+  return 0;
+}
+
+static int run_pingpong(int ncores, int argc, const char** argv)
+{
+  int rounds = 100000;
+  if(argc > 0) rounds = atoi(argv[0]);
+  if(rounds <= 0) return -1;
+
+  boot(ncores, 0, pingpong_bench, rounds, NULL);
+  return 0;
+}
+
+
+/****************************************************
+
+  Pipe round-trip latency.
+
+  Two threads, both pinned to core 0, bounce a byte over a pair of pipes.
+  The pipes hand the core straight to the waiting peer, so every round
+  trip costs two directed yields.
+
+ ****************************************************/
+
+static pipe_t pipe_ping, pipe_pong;
+
+static int pipe_player(int argl, void* args)
+{
+  int me = (int)(intptr_t) args;
+  Fid_t in = me ? pipe_ping.read : pipe_pong.read;
+  Fid_t out = me ? pipe_pong.write : pipe_ping.write;
+  char c = 0;
+  SetThreadAffinity(NOTHREAD, 1);
+  for(int r=0; r<argl; r++) {
+    if(!me && Write(out, &c, 1) != 1) return -1;
+    if(Read(in, &c, 1) != 1) return -1;
+    if(me && Write(out, &c, 1) != 1) return -1;
+  }
+  return 0;
+}
+
+static int pipe_bench(int argl, void* args)
+{
+  if(Pipe(&pipe_ping) != 0 || Pipe(&pipe_pong) != 0) return 1;
+  double start = wall_time();
+  Tid_t t0 = CreateThread(pipe_player, argl, (void*) 0);
+  Tid_t t1 = CreateThread(pipe_player, argl, (void*) 1);
+  ThreadJoin(t0, NULL);
+  ThreadJoin(t1, NULL);
+  double elapsed = wall_time() - start;
+
+  unsigned long handoffs = 0;
+  for(uint c=0; c<cpu_cores(); c++)
+    handoffs += cctx[c].handoffs;
+  printf("pipe: rounds=%d time=%.3f sec latency=%.1f nsec/round-trip handoffs=%lu\n",
+	 argl, elapsed, elapsed * 1E9 / argl, handoffs);
+  return 0;
+}
+
+static int run_pipe(int ncores, int argc, const char** argv)
+{
+  int rounds = 100000;
+  if(argc > 0) rounds = atoi(argv[0]);
+  if(rounds <= 0) return -1;
+
+  boot(ncores, 0, pipe_bench, rounds, NULL);
+  return 0;
+}
+
+
+/****************************************************
+
+  Contended mutex.
+
+  A number of threads take turns at one mutex, holding it for a given
+  time. Besides the throughput, the host cpu time is printed, since the
+  threads that wait for the mutex should not burn the cpu.
+
+ ****************************************************/
+
+typedef struct {
+  int threads;
+  int rounds;
+  int hold;
+} mutex_args;
+
+static Mutex mb_mx = MUTEX_INIT;
+static volatile long mb_counter;
+
+static int mutex_thread(int argl, void* args)
+{
+  mutex_args* a = args;
+  for(int r=0; r<a->rounds; r++) {
+    Mutex_Lock(&mb_mx);
+    double until = wall_time() + a->hold * 1E-6;
+    while(wall_time() < until);
+    mb_counter++;
+    Mutex_Unlock(&mb_mx);
+  }
+  return 0;
+}
+
+static double cpu_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static int mutex_bench(int argl, void* args)
+{
+  mutex_args* a = args;
+  Tid_t* tids = malloc(a->threads * sizeof(Tid_t));
+  mb_counter = 0;
+
+  double start = wall_time();
+  double cpu_start = cpu_time();
+  for(int i=0; i<a->threads; i++)
+    tids[i] = CreateThread(mutex_thread, 0, a);
+  for(int i=0; i<a->threads; i++)
+    ThreadJoin(tids[i], NULL);
+  double elapsed = wall_time() - start;
+  double cpu = cpu_time() - cpu_start;
+  free(tids);
+
+  assert(mb_counter == (long) a->threads * a->rounds);
+  printf("mutex: threads=%d rounds=%d hold=%d usec time=%.3f sec cpu=%.3f sec rate=%.0f locks/sec\n",
+	 a->threads, a->rounds, a->hold, elapsed, cpu, mb_counter / elapsed);
+  return 0;
+}
+
+static int run_mutex(int ncores, int argc, const char** argv)
+{
+  mutex_args a = { 8, 10000, 5 };
+  if(argc > 0) a.threads = atoi(argv[0]);
+  if(argc > 1) a.rounds = atoi(argv[1]);
+  if(argc > 2) a.hold = atoi(argv[2]);
+  if(a.threads <= 0 || a.rounds <= 0 || a.hold < 0) return -1;
+
+  boot(ncores, 0, mutex_bench, sizeof(a), &a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Spinlock contention.
+
+  One thread per core, pinned to it, takes a kernel spinlock over and over
+  with preemption off, for a given time. This is repeated for 1, 2, 4, ...
+  cores, up to the given number. Besides the throughput, the fairness is
+  printed, as the fewest acquisitions of any core over the most.
+
+ ****************************************************/
+
+typedef struct {
+  int msec;
+  int hold;
+} spin_args;
+
+static Spinlock sb_lock = SPINLOCK_INIT;
+static volatile int sb_stop;
+static unsigned long sb_count[MAX_CORES];
+
+static int spinlock_thread(int argl, void* args)
+{
+  spin_args* a = args;
+  SetThreadAffinity(NOTHREAD, 1u << argl);
+  unsigned long n = 0;
+  while(!sb_stop) {
+    int preempt = preempt_off;
+    Spin_Lock(&sb_lock);
+    for(volatile int k=0; k<a->hold; k++);
+    Spin_Unlock(&sb_lock);
+    if(preempt) preempt_on;
+    n++;
+  }
+  sb_count[argl] = n;
+  return 0;
+}
+
+static int spin_bench(int argl, void* args)
+{
+  spin_args* a = args;
+  uint ncores = cpu_cores();
+  Tid_t tids[MAX_CORES];
+  sb_stop = 0;
+  for(uint c=0; c<ncores; c++)
+    tids[c] = CreateThread(spinlock_thread, c, a);
+  double start = wall_time();
+  Sleep(a->msec);
+  sb_stop = 1;
+  for(uint c=0; c<ncores; c++)
+    ThreadJoin(tids[c], NULL);
+  double elapsed = wall_time() - start;
+
+  unsigned long total = 0, min = sb_count[0], max = sb_count[0];
+  for(uint c=0; c<ncores; c++) {
+    total += sb_count[c];
+    if(sb_count[c] < min) min = sb_count[c];
+    if(sb_count[c] > max) max = sb_count[c];
+  }
+  printf("spinlock: cores=%2u rate=%.0f locks/sec fairness=%.3f\n",
+	 ncores, total / elapsed, max ? (double) min / max : 0.0);
+  return 0;
+}
+
+static int run_spinlock(int ncores, int argc, const char** argv)
+{
+  spin_args a = { 200, 100 };
+  if(argc > 0) a.msec = atoi(argv[0]);
+  if(argc > 1) a.hold = atoi(argv[1]);
+  if(a.msec <= 0 || a.hold < 0) return -1;
+
+#ifdef SPINLOCK_TAS
+  printf("spinlock: test-and-set locks\n");
+#else
+  printf("spinlock: ticket locks\n");
+#endif
+  for(int c=1; ; c *= 2) {
+    if(c > ncores) c = ncores;
+    boot(c, 0, spin_bench, sizeof(a), &a);
+    if(c == ncores) break;
+  }
+  return 0;
+}
+
+
+/****************************************************
+
+  Independent pipes.
+
+  Each core runs a writer and a reader, pinned to it, that stream data
+  over a pipe of their own for a given time. The pairs share nothing but
+  the process, so the total throughput should grow with the cores. This
+  is repeated for 1, 2, 4, ... cores, up to the given number.
+
+ ****************************************************/
+
+typedef struct {
+  int msec;
+  int chunk;
+} pipes_args;
+
+static pipe_t pb_pipe[MAX_CORES];
+static volatile int pb_stop;
+static unsigned long pb_bytes[MAX_CORES];
+
+static int pipes_writer(int argl, void* args)
+{
+  pipes_args* a = args;
+  char buf[a->chunk];
+  memset(buf, 0, a->chunk);
+  SetThreadAffinity(NOTHREAD, 1u << argl);
+  while(!pb_stop)
+    if(Write(pb_pipe[argl].write, buf, a->chunk) < 0) break;
+  Close(pb_pipe[argl].write);
+  return 0;
+}
+
+static int pipes_reader(int argl, void* args)
+{
+  pipes_args* a = args;
+  char buf[a->chunk];
+  SetThreadAffinity(NOTHREAD, 1u << argl);
+  unsigned long n = 0;
+  int r;
+  while((r = Read(pb_pipe[argl].read, buf, a->chunk)) > 0)
+    n += r;
+  Close(pb_pipe[argl].read);
+  pb_bytes[argl] = n;
+  return 0;
+}
+
+static int pipes_bench(int argl, void* args)
+{
+  pipes_args* a = args;
+  uint ncores = cpu_cores();
+  Tid_t tids[2*MAX_CORES];
+  pb_stop = 0;
+  for(uint c=0; c<ncores; c++)
+    if(Pipe(&pb_pipe[c]) != 0) return 1;
+  for(uint c=0; c<ncores; c++) {
+    tids[2*c] = CreateThread(pipes_writer, c, a);
+    tids[2*c+1] = CreateThread(pipes_reader, c, a);
+  }
+  double start = wall_time();
+  Sleep(a->msec);
+  pb_stop = 1;
+  for(uint i=0; i<2*ncores; i++)
+    ThreadJoin(tids[i], NULL);
+  double elapsed = wall_time() - start;
+
+  unsigned long total = 0;
+  for(uint c=0; c<ncores; c++)
+    total += pb_bytes[c];
+  printf("pipes: cores=%2u chunk=%d rate=%.1f MB/sec\n",
+	 ncores, a->chunk, total / elapsed / 1E6);
+  return 0;
+}
+
+static int run_pipes(int ncores, int argc, const char** argv)
+{
+  pipes_args a = { 200, 512 };
+  if(argc > 0) a.msec = atoi(argv[0]);
+  if(argc > 1) a.chunk = atoi(argv[1]);
+  if(a.msec <= 0 || a.chunk <= 0) return -1;
+
+  for(int c=1; ; c *= 2) {
+    if(c > ncores) c = ncores;
+    boot(c, 0, pipes_bench, sizeof(a), &a);
+    if(c == ncores) break;
+  }
+  return 0;
+}
+
+
+/****************************************************
+
+  Thread create/join throughput.
+
+  The init task creates short threads in batches, joining each batch
+  before creating the next one, and counts how many thread blocks had to
+  be allocated instead of being reused from the thread cache. With
+  <prefault> > 0, that many blocks are pre-faulted at boot.
+
+ ****************************************************/
+
+typedef struct {
+  int threads;
+  int batch;
+} spawn_args;
+
+static int spawn_thread_func(int argl, void* args)
+{
+  return argl;
+}
+
+static int spawn_bench(int argl, void* args)
+{
+  spawn_args* a = args;
+  Tid_t* tids = malloc(a->batch * sizeof(Tid_t));
+
+  double start = wall_time();
+  for(int done=0; done < a->threads; done += a->batch) {
+    int n = (a->threads - done < a->batch) ? a->threads - done : a->batch;
+    for(int i=0; i<n; i++)
+      tids[i] = CreateThread(spawn_thread_func, i, NULL);
+    for(int i=0; i<n; i++)
+      ThreadJoin(tids[i], NULL);
+  }
+  double elapsed = wall_time() - start;
+
+  unsigned long allocs = 0, reuses = 0;
+  for(uint c=0; c<cpu_cores(); c++) {
+    allocs += cctx[c].tcb_allocs;
+    reuses += cctx[c].tcb_reuses;
+  }
+  printf("spawn: threads=%d batch=%d prefault=%u time=%.3f sec rate=%.0f threads/sec allocs=%lu reuses=%lu\n",
+	 a->threads, a->batch, tcb_prefault, elapsed, a->threads / elapsed, allocs, reuses);
+
+  free(tids);
+  return 0;
+}
+
+static int run_spawn(int ncores, int argc, const char** argv)
+{
+  spawn_args a = { 100000, 100 };
+  if(argc > 0) a.threads = atoi(argv[0]);
+  if(argc > 1) a.batch = atoi(argv[1]);
+  if(argc > 2) tcb_prefault = atoi(argv[2]);
+  if(a.threads <= 0 || a.batch <= 0) return -1;
+
+  boot(ncores, 0, spawn_bench, sizeof(a), &a);
+  tcb_prefault = 0;
+  return 0;
+}
+
+
+/****************************************************
+
+  Broadcast cost.
+
+  A number of waiters block on a condition variable, and the init task
+  wakes them all with one Cond_Broadcast, then waits until every one of
+  them has run, each round.
+
+ ****************************************************/
+
+static Mutex bc_mx = MUTEX_INIT;
+static CondVar bc_cv = COND_INIT;
+static CondVar bc_done_cv = COND_INIT;
+static volatile int bc_round;
+static volatile int bc_waiting;
+static volatile int bc_ran;
+
+static int bc_waiter(int argl, void* args)
+{
+  Mutex_Lock(&bc_mx);
+  for(int r=0; r<argl; r++) {
+    bc_waiting++;
+    if(bc_waiting == (int)(intptr_t) args) Cond_Signal(&bc_done_cv);
+    while(bc_round == r)
+      Cond_Wait(&bc_mx, &bc_cv);
+    bc_ran++;
+    if(bc_ran == (int)(intptr_t) args) Cond_Signal(&bc_done_cv);
+  }
+  Mutex_Unlock(&bc_mx);
+  return 0;
+}
+
+typedef struct {
+  int waiters;
+  int rounds;
+} broadcast_args;
+
+static int broadcast_bench(int argl, void* args)
+{
+  broadcast_args* a = args;
+  int waiters = a->waiters;
+  int rounds = a->rounds;
+  Tid_t* tids = malloc(waiters * sizeof(Tid_t));
+  bc_round = 0;
+  for(int i=0; i<waiters; i++)
+    tids[i] = CreateThread(bc_waiter, rounds, (void*)(intptr_t) waiters);
+
+  double bcast = 0, total = 0;
+  Mutex_Lock(&bc_mx);
+  for(int r=0; r<rounds; r++) {
+    while(bc_waiting < waiters)
+      Cond_Wait(&bc_mx, &bc_done_cv);
+    bc_waiting = bc_ran = 0;
+    double start = wall_time();
+    bc_round = r+1;
+    Cond_Broadcast(&bc_cv);
+    bcast += wall_time() - start;
+    while(bc_ran < waiters)
+      Cond_Wait(&bc_mx, &bc_done_cv);
+    total += wall_time() - start;
+  }
+  Mutex_Unlock(&bc_mx);
+
+  for(int i=0; i<waiters; i++)
+    ThreadJoin(tids[i], NULL);
+  printf("broadcast: waiters=%d rounds=%d broadcast=%.1f usec all run=%.1f usec\n",
+	 waiters, rounds, bcast / rounds * 1E6, total / rounds * 1E6);
+  free(tids);
+  return 0;
+}
+
+static int run_broadcast(int ncores, int argc, const char** argv)
+{
+  broadcast_args a = { 100, 1000 };
+  if(argc > 0) a.waiters = atoi(argv[0]);
+  if(argc > 1) a.rounds = atoi(argv[1]);
+  if(a.waiters <= 0 || a.rounds <= 0) return -1;
+
+  boot(ncores, 0, broadcast_bench, sizeof(a), &a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Condition variable wait times.
+
+  A number of threads share a few tokens, guarded by a monitor. A thread
+  that finds no token waits on a single condition variable, and a thread
+  returning its token signals it and then thinks for a while. The time each thread waited for a token
+  is recorded, so that the tail shows how fairly the waiters are served.
+
+ ****************************************************/
+
+typedef struct {
+  int threads;
+  int tokens;
+  int rounds;
+  int hold;
+} condwait_args;
+
+static Mutex cw_mx = MUTEX_INIT;
+static CondVar cw_cv = COND_INIT;
+static int cw_tokens;
+static double* cw_wait;
+
+static int cw_thread(int argl, void* args)
+{
+  condwait_args* a = args;
+  for(int r=0; r<a->rounds; r++) {
+    Mutex_Lock(&cw_mx);
+    double start = wall_time();
+    while(cw_tokens == 0)
+      Cond_Wait(&cw_mx, &cw_cv);
+    cw_tokens--;
+    cw_wait[argl * a->rounds + r] = wall_time() - start;
+    Mutex_Unlock(&cw_mx);
+
+    Sleep(a->hold);
+
+    Mutex_Lock(&cw_mx);
+    cw_tokens++;
+    Cond_Signal(&cw_cv);
+    Mutex_Unlock(&cw_mx);
+
+    /* Think for as long, so that the token goes to a waiter */
+    Sleep(a->hold);
+  }
+  return 0;
+}
+
+static int condwait_bench(int argl, void* args)
+{
+  condwait_args* a = args;
+  int n = a->threads * a->rounds;
+  Tid_t* tids = malloc(a->threads * sizeof(Tid_t));
+  cw_wait = malloc(n * sizeof(double));
+  cw_tokens = a->tokens;
+
+  for(int i=0; i<a->threads; i++)
+    tids[i] = CreateThread(cw_thread, i, a);
+  for(int i=0; i<a->threads; i++)
+    ThreadJoin(tids[i], NULL);
+
+  double sum = 0;
+  for(int i=0; i<n; i++) sum += cw_wait[i];
+  qsort(cw_wait, n, sizeof(double), cmp_double);
+  printf("condwait: threads=%d tokens=%d rounds=%d hold=%d msec mean=%.1f p50=%.1f p99=%.1f max=%.1f usec\n",
+	 a->threads, a->tokens, a->rounds, a->hold, sum/n*1E6, cw_wait[n/2]*1E6,
+	 cw_wait[(n*99)/100]*1E6, cw_wait[n-1]*1E6);
+  free(cw_wait);
+  free(tids);
+  return 0;
+}
+
+static int run_condwait(int ncores, int argc, const char** argv)
+{
+  condwait_args a = { 16, 2, 50, 1 };
+  if(argc > 0) a.threads = atoi(argv[0]);
+  if(argc > 1) a.tokens = atoi(argv[1]);
+  if(argc > 2) a.rounds = atoi(argv[2]);
+  if(argc > 3) a.hold = atoi(argv[3]);
+  if(a.threads <= 0 || a.tokens <= 0 || a.rounds <= 0 || a.hold < 0) return -1;
+
+  boot(ncores, 0, condwait_bench, sizeof(a), &a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Semaphores and barriers.
+
+  Two threads play ping-pong over a pair of semaphores, and then a number
+  of threads meet at a barrier over and over. Each is run with the native
+  primitives and with their equivalents built from a Mutex and a CondVar.
+
+ ****************************************************/
+
+typedef struct {
+  int threads;
+  int rounds;
+  int native;
+} sync_args;
+
+/* A semaphore and a barrier as monitors */
+typedef struct {
+  Mutex mx;
+  CondVar cv;
+  int count;
+} mon_sem;
+
+static void mon_P(mon_sem* s)
+{
+  Mutex_Lock(&s->mx);
+  while(s->count == 0)
+    Cond_Wait(&s->mx, &s->cv);
+  s->count--;
+  Mutex_Unlock(&s->mx);
+}
+
+static void mon_V(mon_sem* s)
+{
+  Mutex_Lock(&s->mx);
+  s->count++;
+  Cond_Signal(&s->cv);
+  Mutex_Unlock(&s->mx);
+}
+
+typedef struct {
+  Mutex mx;
+  CondVar cv;
+  int parties, arrived;
+  unsigned long generation;
+} mon_barrier;
+
+static void mon_barrier_wait(mon_barrier* b)
+{
+  Mutex_Lock(&b->mx);
+  unsigned long gen = b->generation;
+  if(++b->arrived == b->parties) {
+    b->arrived = 0;
+    b->generation++;
+    Cond_Broadcast(&b->cv);
+  } else
+    while(gen == b->generation)
+      Cond_Wait(&b->mx, &b->cv);
+  Mutex_Unlock(&b->mx);
+}
+
+static Semaphore sy_sem[2];
+static mon_sem sy_mon_sem[2];
+static Barrier sy_barrier;
+static mon_barrier sy_mon_barrier;
+
+static int sem_player(int argl, void* args)
+{
+  sync_args* a = args;
+  for(int r=0; r<a->rounds; r++) {
+    if(a->native) {
+      if(argl) Sem_P(&sy_sem[0]); else Sem_V(&sy_sem[0]);
+      if(argl) Sem_V(&sy_sem[1]); else Sem_P(&sy_sem[1]);
+    } else {
+      if(argl) mon_P(&sy_mon_sem[0]); else mon_V(&sy_mon_sem[0]);
+      if(argl) mon_V(&sy_mon_sem[1]); else mon_P(&sy_mon_sem[1]);
+    }
+  }
+  return 0;
+}
+
+static int barrier_party(int argl, void* args)
+{
+  sync_args* a = args;
+  for(int r=0; r<a->rounds; r++)
+    if(a->native) Barrier_Wait(&sy_barrier); else mon_barrier_wait(&sy_mon_barrier);
+  return 0;
+}
+
+static int sync_bench(int argl, void* args)
+{
+  sync_args* a = args;
+  const char* kind = a->native ? "native" : "mutex+condvar";
+  Tid_t* tids = malloc(a->threads * sizeof(Tid_t));
+  for(int i=0; i<2; i++) {
+    sy_sem[i] = SEMAPHORE_INIT(0);
+    sy_mon_sem[i] = (mon_sem){ MUTEX_INIT, COND_INIT, 0 };
+  }
+  sy_barrier = BARRIER_INIT(a->threads);
+  sy_mon_barrier = (mon_barrier){ MUTEX_INIT, COND_INIT, a->threads, 0, 0 };
+
+  double start = wall_time();
+  Tid_t t0 = CreateThread(sem_player, 0, a);
+  Tid_t t1 = CreateThread(sem_player, 1, a);
+  ThreadJoin(t0, NULL);
+  ThreadJoin(t1, NULL);
+  double elapsed = wall_time() - start;
+  printf("semaphore: %-13s rounds=%d rate=%.0f round-trips/sec\n",
+	 kind, a->rounds, a->rounds / elapsed);
+
+  start = wall_time();
+  for(int i=0; i<a->threads; i++)
+    tids[i] = CreateThread(barrier_party, 0, a);
+  for(int i=0; i<a->threads; i++)
+    ThreadJoin(tids[i], NULL);
+  elapsed = wall_time() - start;
+  printf("barrier:   %-13s threads=%d rounds=%d rate=%.0f rounds/sec\n",
+	 kind, a->threads, a->rounds, a->rounds / elapsed);
+  free(tids);
+  return 0;
+}
+
+static int run_sync(int ncores, int argc, const char** argv)
+{
+  sync_args a = { 4, 20000, 1 };
+  if(argc > 0) a.threads = atoi(argv[0]);
+  if(argc > 1) a.rounds = atoi(argv[1]);
+  if(a.threads <= 0 || a.rounds <= 0) return -1;
+
+  boot(ncores, 0, sync_bench, sizeof(a), &a);
+  a.native = 0;
+  boot(ncores, 0, sync_bench, sizeof(a), &a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Gang scheduling.
+
+  A symposium of philosopher threads is run twice, with the philosophers
+  as normal threads and as gang threads. The philosophers' output is
+  discarded.
+
+ ****************************************************/
+
+typedef struct {
+  symposium_t symp;
+  int gang;
+} gang_args;
+
+static int gang_bench(int argl, void* args)
+{
+  gang_args* a = args;
+  if(a->gang) SetThreadGang(NOTHREAD, 1);
+  return SymposiumOfThreads(sizeof(a->symp), &a->symp);
+}
+
+static void gang_run(int ncores, gang_args* a)
+{
+  fflush(stdout);
+  int saved = dup(1);
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, 1);
+  close(null);
+
+  double start = wall_time();
+  boot(ncores, 0, gang_bench, sizeof(*a), a);
+  double elapsed = wall_time() - start;
+
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+
+  unsigned long pulls = 0;
+  for(int c=0; c<ncores; c++)
+    pulls += cctx[c].rq.gang_pulls;
+  printf("symposium: gang=%d philosophers=%d bites=%d time=%.3f sec gang pulls=%lu\n",
+	 a->gang, a->symp.N, a->symp.bites, elapsed, pulls);
+}
+
+static int run_symposium(int ncores, int argc, const char** argv)
+{
+  gang_args a = { .symp = { .N = 20, .bites = 10 } };
+  int dbase = -5;
+  if(argc > 0) a.symp.N = atoi(argv[0]);
+  if(argc > 1) a.symp.bites = atoi(argv[1]);
+  if(argc > 2) dbase = atoi(argv[2]);
+  if(a.symp.N <= 1 || a.symp.bites <= 0) return -1;
+  adjust_symposium(&a.symp, dbase, 0);
+
+  for(a.gang = 0; a.gang <= 1; a.gang++)
+    gang_run(ncores, &a);
+  return 0;
+}
+
+
+/****************************************************
+
+  Tickless cores.
+
+  Some threads spin for a while, each on a core of its own, while the
+  rest of the cores stay idle. The workload is run with and without
+  tickless mode, counting the ALARM interrupts raised to the cores.
+
+ ****************************************************/
+
+typedef struct {
+  int threads;
+  int msec;
+} tickless_args;
+
+static int spin_thread(int argl, void* args)
+{
+  double until = wall_time() + argl * 1E-3;
+  while(wall_time() < until);
+  return 0;
+}
+
+static int tickless_bench(int argl, void* args)
+{
+  tickless_args* a = args;
+  Tid_t* tids = malloc(a->threads * sizeof(Tid_t));
+  for(int i=0; i<a->threads; i++)
+    tids[i] = CreateThread(spin_thread, a->msec, NULL);
+  for(int i=0; i<a->threads; i++)
+    ThreadJoin(tids[i], NULL);
+  free(tids);
+  return 0;
+}
+
+static int tickless_run(int ncores, tickless_args* a, int tickless)
+{
+  sched_tickless = tickless;
+  boot(ncores, 0, tickless_bench, sizeof(*a), a);
+
+  int alarms = 0;
+  unsigned long slices = 0;
+  for(int c=0; c<ncores; c++) {
+    alarms += cpu_irq_stats(c, ALARM, NULL);
+    slices += cctx[c].tickless_slices;
+  }
+  printf("tickless=%d: threads=%d msec=%d ALARMs=%d tickless slices=%lu\n",
+	 tickless, a->threads, a->msec, alarms, slices);
+  return alarms;
+}
+
+static int run_tickless(int ncores, int argc, const char** argv)
+{
+  tickless_args a = { ncores-1, 1000 };
+  if(argc > 0) a.threads = atoi(argv[0]);
+  if(argc > 1) a.msec = atoi(argv[1]);
+  if(a.threads <= 0 || a.msec <= 0) return -1;
+
+  int before = tickless_run(ncores, &a, 0);
+  int after = tickless_run(ncores, &a, 1);
+  printf("tickless: ALARMs avoided=%d\n", before - after);
+  sched_tickless = 1;
+  return 0;
+}
+
+
+/****************************************************/
+
+typedef struct {
+  const char* name;
+  const char* args;
+  int (*run)(int ncores, int argc, const char** argv);
+} benchmark;
+
+static benchmark benchmarks[] = {
+  { "yield", "[<threads> [<yields>]]", run_yield },
+  { "wakeup", "[<rounds> [<busy usec>]]   (at least 2 cores)", run_wakeup },
+  { "tickless", "[<threads> [<msec>]]", run_tickless },
+  { "pingpong", "[<rounds>]", run_pingpong },
+  { "pipe", "[<rounds>]", run_pipe },
+  { "mutex", "[<threads> [<rounds> [<hold usec>]]]", run_mutex },
+  { "spinlock", "[<msec> [<hold loops>]]   (1, 2, 4, ... up to <ncores>)", run_spinlock },
+  { "pipes", "[<msec> [<chunk bytes>]]   (1, 2, 4, ... up to <ncores>)", run_pipes },
+  { "spawn", "[<threads> [<batch> [<prefault>]]]", run_spawn },
+  { "broadcast", "[<waiters> [<rounds>]]", run_broadcast },
+  { "condwait", "[<threads> [<tokens> [<rounds> [<hold msec>]]]]", run_condwait },
+  { "sync", "[<threads> [<rounds>]]", run_sync },
+  { "symposium", "[<philosophers> [<bites> [<dFBASE>]]]", run_symposium },
+  { NULL, NULL, NULL }
+};
+
+void usage(const char* pname)
+{
+  printf("usage:\n  %s [-s <policy>] <ncores> <benchmark> [<args>...]\n\n  \
+    where <policy> is the scheduling policy (mlfq or fair), <ncores> is the\n  \
+    number of cpu cores to use and <benchmark> is one of:\n",
+	 pname);
+  for(benchmark* b = benchmarks; b->name != NULL; b++)
+    printf("    %s %s\n", b->name, b->args);
+  exit(1);
+}
+
+
+int main(int argc, const char** argv)
+{
+  const char* pname = argv[0];
+  if(argc > 2 && strcmp(argv[1], "-s") == 0) {
+    if(sched_set_policy(argv[2]) != 0) usage(pname);
+    argc -= 2; argv += 2;
+  }
+  if(argc < 3) usage(pname);
+  int ncores = atoi(argv[1]);
+  if(ncores <= 0 || ncores > MAX_CORES) usage(pname);
+
+  for(benchmark* b = benchmarks; b->name != NULL; b++)
+    if(strcmp(b->name, argv[2]) == 0) {
+      if(b->run(ncores, argc-3, argv+3) != 0) usage(pname);
+      return 0;
+    }
+
+  usage(pname);
+  return 0;
+}
@@ -1,6 +1,7 @@
 #ifndef __TINYOS_H__
 #define __TINYOS_H__
 #include <stdint.h>
+#include <stddef.h>
 /**
   @file tinyos.h
   @brief Public kernel API
@@ -42,17 +43,41 @@ typedef uintptr_t Tid_t;
 /*******************************************
  *      Concurrency control
  *******************************************/
+/** @brief A spinlock, for the non-preemptive domain of the kernel.
+
+    Spinlocks protect the short critical sections of the scheduler and the
+    drivers, and they are only taken with preemption off. By default they
+    are fair ticket locks: waiters get the lock in the order they arrived.
+    They are embedded here, because condition variables contain one.
+
+    @see Spin_Lock
+    @see SPINLOCK_INIT
+*/
+typedef struct {
+    unsigned short next;      /**< The next ticket to hand out */
+    unsigned short serving;   /**< The ticket that holds the lock */
+} Spinlock;
+/** @brief This macro is used to initialize spinlocks. */
+#define SPINLOCK_INIT ((Spinlock){ 0, 0 })
 /** @brief A mutex is used to provide mutual exclusion.
 
     Mutexes are used extensively to surround critical sections. The TinyOS
     mutexes are suitable for use in user-space, as well as in the implementation
     of the kernel.
 
+    A mutex records the thread holding it, and the threads sleeping until
+    it is released. A thread that waits for a mutex lends its priority to
+    the holder, see @c Mutex_Lock.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef struct {
+    char locked;          /**< Set while the mutex is held */
+    void *owner;          /**< The thread holding the mutex, if known */
+    void *waiters;        /**< The threads sleeping on the mutex, in FIFO order */
+} Mutex;
 /**
   @brief This macro is used to initialize mutexes.
 
@@ -61,13 +86,20 @@ typedef char Mutex;
    Mutex my_mutex = MUTEX_INIT;
   @endcode
  */
-#define MUTEX_INIT 0
+#define MUTEX_INIT ((Mutex){ 0, NULL, NULL })
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the waiting thread spins for a while
+  only if the holder is running on another core, and then sleeps in the
+  mutex's wait queue, until an unlock wakes it up.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
+  Before it sleeps, the waiting thread passes its priority on to the holder,
+  if the holder is less urgent, and on along the chain of mutexes that the
+  holder itself waits for. The holder keeps the inherited priority until it
+  unlocks the mutex.
+
   @see Mutex
   @see Mutex_Unlock
   @see set_core_preemption
@@ -92,7 +124,7 @@ void Mutex_Unlock(Mutex *);
  */
 typedef struct {
     void *waitset;        /**< The set of waiting threads */
-    Mutex waitset_lock;   /**< A mutex to protect `waitset` */
+    Spinlock waitset_lock; /**< A spinlock to protect `waitset` */
 } CondVar;
 /** @brief  This macro is used to initialize condition variables.
 
@@ -101,7 +133,7 @@ typedef struct {
   CondVar my_cv = COND_INIT;
   @endcode
  */
-#define COND_INIT ((CondVar){ NULL, MUTEX_INIT })
+#define COND_INIT ((CondVar){ NULL, { 0, 0 } })
 /** @brief Wait on a condition variable.
 
   This must be called only while we have locked the mutex that is
@@ -140,6 +172,25 @@ int Cond_Wait_from_IO(Mutex *mx, CondVar *cv);
    @see Cond_Broadcast
    */
 void Cond_Signal(CondVar *);
+/** @brief Signal a condition variable and hand the core to the woken thread.
+
+   This is like @c Cond_Signal, but if the woken thread was queued on the
+   current core, the caller switches straight to it, and the woken thread
+   runs for the rest of the caller's quantum. This saves a trip through the
+   scheduler queue, when the caller is about to wait for the woken thread.
+   Callers with preemption off do not switch.
+   @see Cond_Signal
+   */
+void Cond_SignalHandoff(CondVar *);
+/** @brief Wake up all threads waiting at a condition variable, handing the
+   core to a sole waiter.
+
+   If exactly one thread waits, this is @c Cond_SignalHandoff; otherwise it
+   is @c Cond_Broadcast.
+   @see Cond_SignalHandoff
+   @see Cond_Broadcast
+   */
+void Cond_BroadcastHandoff(CondVar *);
 /** @brief Notify all threads waiting at a condition variable.
 
   Broadcast wakes up all threads sleeping on this condition variable.
@@ -149,6 +200,116 @@ void Cond_Signal(CondVar *);
   @see Cond_Signal
 */
 void Cond_Broadcast(CondVar *);
+/** @brief A reader-writer lock.
+
+  A reader-writer lock protects data that is read far more often than it
+  is changed. Any number of readers may hold it at the same time, but a
+  writer holds it alone. Waiting readers and writers sleep.
+
+  Writers are preferred: once a writer asks for the lock, new readers wait
+  until it is done, so that a stream of readers cannot starve writers.
+  A reader must not ask for the write lock while it holds the read lock.
+
+  @see RwLock_ReadLock
+  @see RwLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+    Mutex writer;          /**< Held by the writer; readers pass through it to get in */
+    int readers;           /**< The number of readers holding the lock */
+    Mutex drain_lock;      /**< Guards the writer's wait for the readers to leave */
+    CondVar drained;       /**< Signalled when the last reader leaves */
+} RwLock;
+/** @brief  This macro is used to initialize reader-writer locks.
+
+  @code
+  RwLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RwLock){ { 0, NULL, NULL }, 0, { 0, NULL, NULL }, { NULL, { 0, 0 } } })
+/** @brief Lock a reader-writer lock for reading.
+
+  The caller waits while a writer holds the lock, or waits for it.
+  @see RwLock_ReadUnlock
+ */
+void RwLock_ReadLock(RwLock *rw);
+/** @brief Unlock a reader-writer lock that you locked for reading.
+  @see RwLock_ReadLock
+ */
+void RwLock_ReadUnlock(RwLock *rw);
+/** @brief Lock a reader-writer lock for writing.
+
+  The caller first keeps new readers out, and then waits for the readers
+  holding the lock to leave.
+  @see RwLock_WriteUnlock
+ */
+void RwLock_WriteLock(RwLock *rw);
+/** @brief Unlock a reader-writer lock that you locked for writing.
+  @see RwLock_WriteLock
+ */
+void RwLock_WriteUnlock(RwLock *rw);
+/** @brief A counting semaphore.
+
+  A semaphore holds a number of units. @c Sem_P takes a unit, sleeping
+  until one is available, and @c Sem_V returns one. A unit returned while
+  threads sleep is handed to the one that has slept longest.
+
+  @see Sem_P
+  @see Sem_V
+  @see SEMAPHORE_INIT
+ */
+typedef struct {
+    int count;             /**< The units available */
+    Spinlock lock;         /**< A spinlock to protect the semaphore */
+    void *waiters;         /**< The threads sleeping in @c Sem_P, in FIFO order */
+} Semaphore;
+/** @brief  This macro is used to initialize a semaphore with @c n units.
+
+  @code
+  Semaphore my_sem = SEMAPHORE_INIT(1);
+  @endcode
+ */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), { 0, 0 }, NULL })
+/** @brief Take a unit from a semaphore, sleeping until one is available.
+  @see Sem_P_with_timeout
+  @see Sem_V
+ */
+void Sem_P(Semaphore *sem);
+/** @brief Return a unit to a semaphore.
+
+  This wakes up the first thread sleeping in @c Sem_P, if any.
+  This operation is non-blocking.
+  @see Sem_P
+ */
+void Sem_V(Semaphore *sem);
+/** @brief A reusable barrier for a number of threads.
+
+  Each thread that calls @c Barrier_Wait sleeps, until as many threads as
+  the parties of the barrier have called it. Then they all return, and
+  the barrier can be used again.
+
+  @see Barrier_Wait
+  @see BARRIER_INIT
+ */
+typedef struct {
+    unsigned int parties;  /**< The number of threads that meet at the barrier */
+    unsigned int arrived;  /**< The threads waiting at the barrier */
+    Spinlock lock;         /**< A spinlock to protect the barrier */
+    void *waiters;         /**< The threads sleeping in @c Barrier_Wait */
+} Barrier;
+/** @brief  This macro is used to initialize a barrier for @c n threads.
+
+  @code
+  Barrier my_barrier = BARRIER_INIT(4);
+  @endcode
+ */
+#define BARRIER_INIT(n) ((Barrier){ (n), 0, { 0, 0 }, NULL })
+/** @brief Wait at a barrier until all its parties have arrived.
+
+  @returns 1 to the last thread to arrive, and 0 to the others.
+  @see Barrier
+ */
+int Barrier_Wait(Barrier *barrier);
 /*******************************************
  *
  * Process creation
@@ -183,6 +344,32 @@ typedef int (*Task)(int, void *);
    -  The maximum number of processes has been reached.
   */
 Pid_t Exec(Task task, int argl, void *args);
+/** @brief The smallest thread stack, smaller stack sizes are rounded up to it. */
+#define MIN_STACK_SIZE (16*1024)
+/** @brief The largest thread stack that may be requested. */
+#define MAX_STACK_SIZE (64*1024*1024)
+/** @brief Create a new process, with a given stack size for its main thread.
+
+  This is like @c Exec, but the stack of the main thread of the new process
+  is @c stack_size bytes, rounded up to whole pages and to at least
+  @c MIN_STACK_SIZE. A @c stack_size of 0 selects the default size.
+
+  Stack memory is committed as the thread touches it, so a large stack costs
+  nothing until it is used. A thread that overflows its stack faults on a
+  guard page below it.
+
+  @param task the main function  of the new process
+  @param argl the length of byte array @c args
+  @param args the byte array copied as argument to `task`
+  @param stack_size the stack size of the main thread, or 0
+  @return On success, the pid of the new process is returned.
+    On error, NOPROC is returned.
+     Possible errors:
+   -  The maximum number of processes has been reached.
+   -  @c stack_size is larger than @c MAX_STACK_SIZE.
+  @see Exec
+  */
+Pid_t ExecEx(Task task, int argl, void *args, size_t stack_size);
 /** @brief Exit the current process.
 
   When this function is called by a process thread, the process terminates
@@ -254,14 +441,26 @@ Pid_t GetPPid(void);
 
   */
 Tid_t CreateThread(Task task, int argl, void *args);
+/**
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is like @c CreateThread, but the stack of the new thread is
+  @c stack_size bytes, rounded up as for @c ExecEx. A @c stack_size of 0
+  selects the default size.
+
+  @param task a function to execute
+  @param stack_size the stack size of the new thread, or 0
+  @returns the tid of the new thread, or @c NOTHREAD if @c stack_size is
+       larger than @c MAX_STACK_SIZE.
+  @see ExecEx
+  */
+Tid_t CreateThreadEx(Task task, int argl, void *args, size_t stack_size);
 /**
   @brief Return the Tid of the current thread.
+
+  This is the same tid that @c CreateThread returned for the thread.
  */
 Tid_t ThreadSelf();
-/**
- * @brief Used to call the ThreadSelf function using mutexes.
- * */
-Tid_t ThreadSelf_withMutex();
 /**
   @brief Join the given thread.
 
@@ -326,6 +525,145 @@ int ThreadIsInterrupted();
   current thread.
   */
 void ThreadClearInterrupt();
+/**
+  @brief A set of cpu cores.
+
+  Bit @c c of the mask stands for core @c c.
+  */
+typedef unsigned int cpu_mask_t;
+/** @brief The set of all cores. */
+#define CPU_MASK_ALL (~(cpu_mask_t)0)
+/**
+  @brief Set the cpu affinity of a thread.
+
+  The thread will only be executed by the cores in @c mask. Cores which
+  do not exist are ignored. If the calling thread excludes its current
+  core, it migrates before the call returns. Any other running thread
+  migrates at its next context switch.
+
+  New threads may run on all cores.
+
+  @param tid the thread, or @c NOTHREAD for the current thread. It must
+       belong to the current process.
+  @param mask the set of allowed cores.
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no live thread with the given tid in this process.
+    - the mask does not contain any existing core.
+  */
+int SetThreadAffinity(Tid_t tid, cpu_mask_t mask);
+/**
+  @brief Return the cpu affinity of a thread.
+
+  @param tid the thread, or @c NOTHREAD for the current thread. It must
+       belong to the current process.
+  @returns the set of cores that may execute the thread, or 0 if there
+       is no live thread with the given tid in this process.
+  */
+cpu_mask_t GetThreadAffinity(Tid_t tid);
+/**
+  @brief The scheduling classes of threads.
+
+  @see SetThreadPriority
+  */
+typedef enum {
+    SCHED_CLASS_NORMAL,  /**< Scheduled by the kernel's scheduling policy. */
+    SCHED_CLASS_FIFO,    /**< Real-time, runs until it blocks or a higher priority preempts it. */
+    SCHED_CLASS_RR       /**< Real-time, like FIFO but round-robin among equal priorities. */
+} sched_class;
+/** @brief The number of real-time priorities. */
+#define MAX_RT_PRIORITY 16
+/**
+  @brief Set the scheduling class and priority of a thread.
+
+  Real-time threads (@c SCHED_CLASS_FIFO and @c SCHED_CLASS_RR) have a fixed
+  priority, from 0 to <tt>MAX_RT_PRIORITY-1</tt>, higher is more urgent. A
+  ready real-time thread always runs before normal threads, and before
+  real-time threads of lower priority. When one wakes up, it preempts a
+  core that runs a less urgent thread, if its affinity allows. A FIFO thread
+  keeps its core until it blocks; a RR thread shares its core with the
+  threads of equal priority, one quantum at a time.
+
+  Normal threads are scheduled by the kernel's policy, which adjusts their
+  priority by itself.
+
+  New threads are normal. The change takes effect at once: a queued thread
+  is requeued in its new class, and preempts the thread running on its
+  core if it is now more urgent. A running or sleeping thread is scheduled
+  in its new class from its next scheduling decision. While a thread runs
+  with a priority inherited through a mutex, its new class applies when
+  the inheritance ends.
+
+  @param tid the thread, or @c NOTHREAD for the current thread. It must
+       belong to the current process.
+  @param sclass the scheduling class.
+  @param prio the real-time priority, or 0 for @c SCHED_CLASS_NORMAL.
+  @returns 0 on success and -1 on error. Possible errors are:
+    - there is no live thread with the given tid in this process.
+    - the class or the priority is not valid.
+  */
+int SetThreadPriority(Tid_t tid, sched_class sclass, int prio);
+/**
+  @brief Make a thread a gang thread, or a normal one.
+
+  The gang threads of a process are co-scheduled: when one of them is
+  dispatched on a core, its ready siblings are dispatched at the same time
+  on other cores, preempting normal threads of other processes if needed.
+  This helps threads that synchronize tightly, since a thread is less
+  often left spinning for a sibling that is not running.
+
+  Threads created by a gang thread are gang threads.
+
+  @param tid the thread, or @c NOTHREAD for the current thread. It must
+       belong to the current process.
+  @param gang non-zero to make the thread a gang thread, 0 to make it normal.
+  @returns 0 on success and -1 if there is no live thread with the given
+       tid in this process.
+  */
+int SetThreadGang(Tid_t tid, int gang);
+/*******************************************
+ *
+ * Time
+ *
+ *******************************************/
+/**
+  @brief An integer type for time intervals.
+
+  The unit is milliseconds.
+*/
+typedef long int timeout_t;
+/**
+  @brief Return the time since boot, in msec.
+
+  The time is taken from a monotonic clock, and it is the
+  time base of @c SleepUntil.
+ */
+timeout_t GetTime();
+/**
+  @brief Put the current thread to sleep for @c msec milliseconds.
+
+  The thread does not consume any CPU time while sleeping.
+  The resolution of the sleep depends on the scheduler, and the
+  thread may sleep for somewhat longer than requested.
+
+  @param msec the time to sleep. Non-positive values return immediately.
+  @returns 0 if the thread slept for the whole time, or -1 if it was
+     awakened earlier by @c ThreadInterrupt.
+  @see SleepUntil
+ */
+int Sleep(timeout_t msec);
+/**
+  @brief Put the current thread to sleep until time @c abstime.
+
+  This is like @c Sleep, but the wakeup time is given in the time base
+  of @c GetTime. It is meant for periodic tasks, whose period must not
+  drift.
+
+  @param abstime the time to wake up, as returned by @c GetTime.
+  @returns 0 if the thread slept until @c abstime, or -1 if it was
+     awakened earlier by @c ThreadInterrupt.
+  @see Sleep
+ */
+int SleepUntil(timeout_t abstime);
 /*******************************************
  *
  * Low-level I/O
@@ -450,6 +788,8 @@ typedef struct pipe_control_block {
     pipe_t *pipe;
     FCB *readerFCB, *writerFCB;
     int isReaderClosed, isWriterClosed;
+    int closed;                 /**< The number of ends closed, the last one frees the pipe */
+    Mutex lock;                 /**< Protects the buffer and the state of the pipe */
     CondVar cvRead;
     CondVar cvWrite;
     char buffer[BUFFER_SIZE];
@@ -569,12 +909,36 @@ int Listen(Fid_t sock);
  */
 Fid_t Accept(Fid_t lsock);
 /**
-  @brief An integer type for time intervals.
+  @brief Wait on a condition variable for at most @c timeout msec.
 
-  The unit is milliseconds.
-*/
-typedef long int timeout_t;
+  This is like @c Cond_Wait, but the call also returns when the timeout
+  expires. A negative timeout means "infinite timeout".
+
+  @returns 1 if the thread was signalled, 0 if the timeout expired.
+  @see Cond_Wait
+ */
 int Cond_Wait_with_timeout(Mutex *mutex, CondVar *cv, timeout_t timeout);
+/**
+  @brief Wait on a condition variable, releasing a reader-writer lock.
+
+  This is like @c Cond_Wait_with_timeout, for a thread that holds @c rw
+  for writing. Readers may take the lock while the thread waits, and
+  the thread holds it for writing again when the call returns.
+
+  @returns 1 if the thread was signalled, 0 if the timeout expired.
+  @see Cond_Wait_with_timeout
+ */
+int Cond_Wait_RwLock(RwLock *rw, CondVar *cv, timeout_t timeout);
+/**
+  @brief Take a unit from a semaphore, waiting for at most @c timeout msec.
+
+  This is like @c Sem_P, but the call also returns when the timeout
+  expires. A negative timeout means "infinite timeout".
+
+  @returns 1 if a unit was taken, 0 if the timeout expired.
+  @see Sem_P
+ */
+int Sem_P_with_timeout(Semaphore *sem, timeout_t timeout);
 /**
   @brief Create a connection to a listener at a specific port.
 
@@ -651,6 +1015,21 @@ int ShutDown(Fid_t sock, shutdown_mode how);
   @brief The max. size of args returned by a procinfo structure.
   */
 #define PROCINFO_MAX_ARGS_SIZE (128)
+/**
+  @brief The max. number of threads reported by a procinfo structure.
+  */
+#define PROCINFO_MAX_THREADS (16)
+/**
+  @brief Information on a thread, as returned in a procinfo structure.
+  */
+typedef struct thread_info {
+    Tid_t tid;               /**< @brief The tid of the thread. */
+    cpu_mask_t affinity;     /**< @brief The cores allowed to execute the thread. */
+    sched_class sclass;      /**< @brief The scheduling class of the thread. */
+    int priority;            /**< @brief The real-time priority, or the policy's priority for normal threads. */
+    size_t stack_size;       /**< @brief The size of the thread's stack. */
+    size_t stack_used;       /**< @brief The deepest the stack has been used, in whole pages. */
+} thread_info;
 /**
   @brief A struct containing process-related information for a non-free
   pid.
@@ -676,7 +1055,22 @@ typedef struct procinfo {
 
     If the task's argument is longer (as designated by the @c argl field), the
     bytes contained in this field are just the prefix.  */
+    unsigned int threads_listed; /**< @brief The number of entries in @c threads. */
+    thread_info threads[PROCINFO_MAX_THREADS]; /**< @brief The first
+    @c PROCINFO_MAX_THREADS live threads of the process. */
 } procinfo;
+/**
+  @brief Information on a core, as returned by core information streams.
+  @see OpenCoreInfo
+  */
+typedef struct coreinfo {
+    unsigned int core;            /**< @brief The core id. */
+    unsigned int load;            /**< @brief The average number of threads running or ready on the core,
+                                       in thousandths, decayed over recent time. */
+    unsigned int rq_length;       /**< @brief The number of threads in the core's run queue. */
+    unsigned long stolen_threads; /**< @brief The threads the core stole when it ran out of work. */
+    unsigned long migrations;     /**< @brief The threads the periodic balancer moved to the core. */
+} coreinfo;
 /**
   @brief Open a kernel information stream.
 
@@ -696,6 +1090,20 @@ typedef struct procinfo {
     - the available file ids for the process are exhausted.
  */
 Fid_t OpenInfo();
+/**
+  @brief Open a core information stream.
+
+  This is a read-only stream that returns one @c coreinfo structure
+  per core, each packed into a block of size @c sizeof(coreinfo),
+  in the order of the core ids.
+
+  As with @c OpenInfo, the information is a best-effort snapshot.
+
+  @returns a file id on success, or NOFILE on error. Possible reasons
+    for error are:
+    - the available file ids for the process are exhausted.
+ */
+Fid_t OpenCoreInfo();
 /*******************************************
  *
  * System boot
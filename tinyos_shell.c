@@ -13,6 +13,7 @@ int Shell(size_t, const char **);
 int RunTerm(size_t, const char **);
 int ListPrograms(size_t, const char **);
 int Fibonacci(size_t, const char **);
+int SleepCmd(size_t, const char **);
 int Repeat(size_t, const char **);
 int Hanoi(size_t, const char **);
 int HelpMessage(size_t, const char **);
@@ -41,6 +42,7 @@ struct {
                 {"sh",        Shell,          0, "Run a shell."},
                 {"repeat",    Repeat,         2, "repeat <n> <prog> <args...>: execute '<prog> <args...>' <n> times."},
                 {"fibo",      Fibonacci,      1, "Compute a fibonacci number."},
+                {"sleep",     SleepCmd,       1, "sleep <msec>: sleep for <msec> milliseconds, without using the CPU."},
                 {"cap",       Capitalize,     0, "Copy stdin to stdout, capitalizing all letters"},
                 {"lcase",     LowerCase,      0, "Copy stdin to stdout, lower-casing all letters"},
                 {"wc",        WordCount,      0, "Count and print lines, words and chars of stdin"},
@@ -160,7 +162,26 @@ int SystemInfo(size_t argc, const char **argv) {
                    info.thread_count,
                    pname
             );
+            for (uint t = 0; t < info.threads_listed; t++) {
+                static const char *class_name[] = {"normal", "fifo", "rr"};
+                printf("%11s thread %#lx  affinity %#x  %s %d  stack %zu/%zu KB\n", "",
+                       (unsigned long) info.threads[t].tid, info.threads[t].affinity,
+                       class_name[info.threads[t].sclass], info.threads[t].priority,
+                       info.threads[t].stack_used / 1024, info.threads[t].stack_size / 1024);
+            }
+        }
+        Close(finfo);
+    }
+    Fid_t fcore = OpenCoreInfo();
+    if (fcore != NOFILE) {
+        /* Print per-core info */
+        coreinfo info;
+        printf("\n%5s %8s %8s %8s %10s\n", "Core", "Load", "Queued", "Stolen", "Migrated");
+        while (Read(fcore, (char *) &info, sizeof(info)) == sizeof(info)) {
+            printf("%5u %4u.%03u %8u %8lu %10lu\n", info.core, info.load / 1000, info.load % 1000,
+                   info.rq_length, info.stolen_threads, info.migrations);
         }
+        Close(fcore);
     }
     printf("\n");
     return 0;
@@ -200,6 +221,10 @@ int Fibonacci(size_t argc, const char **argv) {
     printf("Fibonacci(%d)=%d\n", n, fibo(n));
     return 0;
 }
+int SleepCmd(size_t argc, const char **argv) {
+    checkargs(1);
+    return Sleep(getint(1));
+}
 int Capitalize(size_t argc, const char **argv) {
     char c;
     FILE *fin = fidopen(0, "r");
@@ -327,6 +352,8 @@ struct __rs_globals {
     /* used to log connection messages */
     rlnode log;
     size_t logcount;
+    /* the log is printed while clients keep appending to it */
+    RwLock log_lock;
     /* Synchronize with active threads */
     Mutex mx;
     CondVar conn_done;
@@ -370,6 +397,7 @@ int RemoteServer(size_t argc, const char **argv) {
     struct __rs_globals __global_obj;
     struct __rs_globals *__globals = &__global_obj;
     GS(mx) = MUTEX_INIT;
+    GS(log_lock) = RWLOCK_INIT;
     GS(conn_done) = COND_INIT;
     GS(quit) = 0;
     GS(port) = REMOTE_SERVER_DEFAULT_PORT;
@@ -451,10 +479,10 @@ static void log_message(void *__globals, const char *msg, ...) {
     fclose(output);
     /* Append the record */
     logrec *rec = (logrec *) buffer;
-    Mutex_Lock(&GS(mx));
+    RwLock_WriteLock(&GS(log_lock));
     rlnode_new(&rec->node)->num = ++GS(logcount);
     rlist_push_back(&GS(log), &rec->node);
-    Mutex_Unlock(&GS(mx));
+    RwLock_WriteUnlock(&GS(log_lock));
 }
 /* init the log */
 static void log_init(void *__globals) {
@@ -463,20 +491,20 @@ static void log_init(void *__globals) {
 }
 /* Print the log to the console */
 static void log_print(void *__globals) {
-    Mutex_Lock(&GS(mx));
+    RwLock_ReadLock(&GS(log_lock));
     for (rlnode *ptr = GS(log).next; ptr != &GS(log); ptr = ptr->next) {
         logrec *rec = (logrec *) ptr;
         printf("%6d: %s\n", rec->node.num, rec->message);
     }
-    Mutex_Unlock(&GS(mx));
+    RwLock_ReadUnlock(&GS(log_lock));
 }
 /* truncate the log */
 static void log_truncate(void *__globals) {
     rlnode list;
     rlnode_init(&list, NULL);
-    Mutex_Lock(&GS(mx));
+    RwLock_WriteLock(&GS(log_lock));
     rlist_append(&list, &GS(log));
-    Mutex_Unlock(&GS(mx));
+    RwLock_WriteUnlock(&GS(log_lock));
     /* Free the memory ! */
     while (list.next != &list) {
         rlnode *rec = rlist_pop_front(&list);
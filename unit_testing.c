@@ -20,6 +20,7 @@
 #include <unistd.h>
 #include "unit_testing.h"
 #include "util.h"
+#include "kernel_sched.h"
 /*
 	Global variables
 */
@@ -652,6 +653,7 @@ static struct argp_option options[] = {
 		{"list",    'l', 0,             0, "Show a list of available tests"},
 		{"verbose", 'v', 0,             0, "Be verbose: show test descriptions"},
 		{"nocolor", 'n', 0,             0, "Do not color the output"},
+		{"sched",   's', "<policy>",    0, "Scheduling policy of the kernel (mlfq or fair)"},
 		{NULL}
 };
 static const struct Test *find_test(const char *name, const struct Test *test) {
@@ -736,6 +738,10 @@ parse_options(int key, char *arg, struct argp_state *state) {
 			if (!parse_int_list(arg, &ARGS.nterm_list, ARGS.term_list, 0, MAX_TERMINALS))
 				argp_error(state, "Error in parsing list of terminals: %s\n", arg);
 			break;
+		case 's':
+			if (sched_set_policy(arg) != 0)
+				argp_error(state, "Unknown scheduling policy: %s\n", arg);
+			break;
 		case ARGP_KEY_ARG:
 			if (ARGS.ntests >= MAX_TESTS) {
 				argp_error(state, "Number of tests too large (maximum=%d)", MAX_TESTS);
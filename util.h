@@ -185,7 +185,7 @@ static inline void *xmalloc(size_t size) {
 	push_front(L, N)      ::  splice(L, N)
 	push_back(L, N)       ::  splice(L->prev, N)
 	pop_front(L)          ::  return splice(L, L->next)
-	pop_back(L)           ::  return splice(L, L->prev)
+	pop_back(L)           ::  return splice(L->prev->prev, L->prev)
 	remove(N)             ::  return splice(N->prev, N)
 	insert_after(P, N)    ::  splice(P, N)
 	insert_before(P, N)   ::  splice(P->prev, N)
@@ -433,7 +433,7 @@ static inline rlnode *rlist_pop_front(rlnode *list) { return rl_splice(list, lis
 	This function, applied on a non-empty list, will remove the tail of
 	the list and return in.
 */
-static inline rlnode *rlist_pop_back(rlnode *list) { return rl_splice(list, list->prev); }
+static inline rlnode *rlist_pop_back(rlnode *list) { return rl_splice(list->prev->prev, list->prev); }
 /**
 	@brief Return the length of a list.
 
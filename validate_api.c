@@ -1,10 +1,13 @@
 
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 #include <math.h>
 #include "util.h"
+#include "bios.h"
 #include "symposium.h"
 #include "tinyoslib.h"
+#include "kernel_sched.h"
 
 
 /*
@@ -646,12 +649,767 @@ BOOT_TEST(test_exit_many_threads, "Test that a process thread calling Exit will
     ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
     return 0;
 }
+/*
+  A CPU-bound thread competes with a pair of threads playing ping-pong on a
+  condition variable. The ping-pong pair never exhausts its quantum, so it
+  keeps a higher priority than the spinner. Aging must still let the spinner
+  run, again and again, while the pair is always ready.
+ */
+static volatile unsigned long fair_progress;
+static int prefault_child(int argl, void *args) {
+    return CURTHREAD->stack_size == THREAD_STACK_SIZE;
+}
+static int prefault_boot(int argl, void *args) {
+    ASSERT(CURTHREAD->stack_size == THREAD_STACK_SIZE);
+    ASSERT(thread_stack_usage(CURTHREAD) > 0);
+    for (int i = 0; i < 8; i++) {
+        int exitval;
+        Tid_t t = CreateThread(prefault_child, 0, NULL);
+        ASSERT(t != NOTHREAD);
+        ASSERT(ThreadJoin(t, &exitval) == 0);
+        ASSERT(exitval == 1);
+    }
+    return 0;
+}
+BARE_TEST(test_thread_prefault,
+          "Test that the thread blocks pre-faulted at boot keep their stack size."
+) {
+    uint prefault = tcb_prefault;
+    tcb_prefault = 4;
+    boot(1, 0, prefault_boot, 0, NULL);
+    tcb_prefault = prefault;
+}
+static volatile int fair_stop;
+static int fair_turn;
+static Mutex fair_mx = MUTEX_INIT;
+static CondVar fair_cv = COND_INIT;
+static int fair_spinner(int argl, void *args) {
+    while (!fair_stop) { fair_progress++; }
+    return 0;
+}
+static int fair_ponger(int argl, void *args) {
+    Mutex_Lock(&fair_mx);
+    while (!fair_stop) {
+        if (fair_turn == 1) {
+            fair_turn = 0;
+            Cond_Broadcast(&fair_cv);
+        }
+        Cond_Wait(&fair_mx, &fair_cv);
+    }
+    Mutex_Unlock(&fair_mx);
+    return 0;
+}
+BOOT_TEST(test_no_starvation_under_interactive_load,
+          "Test that a CPU-bound thread is not starved by higher-priority threads "
+                  "which are always ready."
+) {
+    fair_progress = 0;
+    fair_stop = 0;
+    fair_turn = 0;
+    Tid_t spinner = CreateThread(fair_spinner, 0, NULL);
+    Tid_t ponger = CreateThread(fair_ponger, 0, NULL);
+    ASSERT(spinner != NOTHREAD && ponger != NOTHREAD);
+    /* Count the times the spinner ran between two rounds */
+    unsigned long last = fair_progress;
+    int runs = 0;
+    for (int round = 0; round < 1000000 && runs < 5; round++) {
+        Mutex_Lock(&fair_mx);
+        fair_turn = 1;
+        Cond_Broadcast(&fair_cv);
+        while (fair_turn == 1) { Cond_Wait(&fair_mx, &fair_cv); }
+        Mutex_Unlock(&fair_mx);
+        if (fair_progress != last) {
+            last = fair_progress;
+            runs++;
+        }
+    }
+    Mutex_Lock(&fair_mx);
+    fair_stop = 1;
+    Cond_Broadcast(&fair_cv);
+    Mutex_Unlock(&fair_mx);
+    ThreadJoin(spinner, NULL);
+    ThreadJoin(ponger, NULL);
+    ASSERT(runs == 5);
+    return 0;
+}
+static Mutex timeout_mx = MUTEX_INIT;
+static CondVar timeout_cv = COND_INIT;
+static int timeout_signaller(int argl, void *args) {
+    Mutex_Lock(&timeout_mx);
+    Cond_Broadcast(&timeout_cv);
+    Mutex_Unlock(&timeout_mx);
+    return 0;
+}
+static double wall_msec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1E6;
+}
+BOOT_TEST(test_cond_wait_timeout,
+          "Test that Cond_Wait_with_timeout returns 0 about when the timeout expires, "
+                  "and 1 when it is signalled earlier."
+) {
+    Mutex_Lock(&timeout_mx);
+    double start = wall_msec();
+    ASSERT(Cond_Wait_with_timeout(&timeout_mx, &timeout_cv, 200) == 0);
+    double elapsed = wall_msec() - start;
+    ASSERT(elapsed >= 199 && elapsed < 250);
+    Tid_t t = CreateThread(timeout_signaller, 0, NULL);
+    ASSERT(Cond_Wait_with_timeout(&timeout_mx, &timeout_cv, 10000) == 1);
+    Mutex_Unlock(&timeout_mx);
+    ThreadJoin(t, NULL);
+    return 0;
+}
+static int long_sleeper(int argl, void *args) {
+    return Sleep(10000);
+}
+static volatile int sleep_spin_stop;
+static int sleep_spinner(int argl, void *args) {
+    while (!sleep_spin_stop);
+    return 0;
+}
+/* The shortest of a few sleeps, so that a late host wakeup does not count */
+static double short_sleep_msec(timeout_t msec) {
+    double least = 1E9;
+    for (int i = 0; i < 5; i++) {
+        double start = wall_msec();
+        ASSERT(Sleep(msec) == 0);
+        double elapsed = wall_msec() - start;
+        ASSERT(elapsed >= msec - 1);
+        if (elapsed < least) { least = elapsed; }
+    }
+    return least;
+}
+BOOT_TEST(test_sleep,
+          "Test that Sleep and SleepUntil block for the requested time, "
+                  "and that ThreadInterrupt cuts a sleep short."
+) {
+    double start = wall_msec();
+    ASSERT(Sleep(100) == 0);
+    double elapsed = wall_msec() - start;
+    ASSERT(elapsed >= 99 && elapsed < 150);
+    /* A sleep shorter than a quantum is not rounded up to the quantum */
+    ASSERT(short_sleep_msec(5) < 25);
+    Tid_t spin[MAX_CORES];
+    sleep_spin_stop = 0;
+    for (uint c = 0; c < cpu_cores(); c++) { spin[c] = CreateThread(sleep_spinner, 0, NULL); }
+    ASSERT(short_sleep_msec(5) < 25);
+    sleep_spin_stop = 1;
+    for (uint c = 0; c < cpu_cores(); c++) { ASSERT(ThreadJoin(spin[c], NULL) == 0); }
+    timeout_t wake = GetTime() + 100;
+    ASSERT(SleepUntil(wake) == 0);
+    ASSERT(GetTime() >= wake);
+    ASSERT(Sleep(0) == 0);
+    ASSERT(SleepUntil(0) == 0);
+    Tid_t t = CreateThread(long_sleeper, 0, NULL);
+    Sleep(100);
+    start = wall_msec();
+    ASSERT(ThreadInterrupt(t) == 0);
+    int exitval;
+    ASSERT(ThreadJoin(t, &exitval) == 0);
+    ASSERT(exitval == -1);
+    ASSERT(wall_msec() - start < 1000);
+    return 0;
+}
+static int affine_thread(int argl, void *args) {
+    int *misplaced = args;
+    ASSERT(SetThreadAffinity(NOTHREAD, 1u << argl) == 0);
+    ASSERT(GetThreadAffinity(NOTHREAD) == 1u << argl);
+    double end = wall_msec() + 300;
+    while (wall_msec() < end) {
+        if (cpu_core_id != argl) { (*misplaced)++; }
+        if (lrand48() % 1000 == 0) { Sleep(1); }
+    }
+    return 0;
+}
+BOOT_TEST(test_thread_affinity,
+          "Test that threads only run on the cores of their affinity mask, and "
+                  "that the mask is reported by OpenInfo.",
+          .minimum_cores = 2
+) {
+    ASSERT(GetThreadAffinity(NOTHREAD) == CPU_MASK_ALL);
+    ASSERT(SetThreadAffinity(NOTHREAD, 0) == -1);
+    ASSERT(SetThreadAffinity(NOTHREAD, 1u << cpu_cores()) == -1);
+    ASSERT(SetThreadAffinity((Tid_t) &test_thread_affinity, 1) == -1);
+    ASSERT(GetThreadAffinity((Tid_t) &test_thread_affinity) == 0);
+    int misplaced[4] = {0, 0, 0, 0};
+    Tid_t t[4];
+    for (int i = 0; i < 4; i++) {
+        t[i] = CreateThread(affine_thread, i % 2, &misplaced[i]);
+    }
+    /* The threads are still alive, look for them in the info stream */
+    Sleep(100);
+    Fid_t finfo = OpenInfo();
+    ASSERT(finfo != NOFILE);
+    procinfo info;
+    int found = 0;
+    while (Read(finfo, (char *) &info, sizeof(info)) == sizeof(info)) {
+        if (info.pid != GetPid()) { continue; }
+        for (uint j = 0; j < info.threads_listed; j++) {
+            for (int i = 0; i < 4; i++) {
+                if (info.threads[j].tid == t[i]) {
+                    ASSERT(info.threads[j].affinity == 1u << (i % 2));
+                    found++;
+                }
+            }
+        }
+    }
+    Close(finfo);
+    ASSERT(found == 4);
+    for (int i = 0; i < 4; i++) {
+        ASSERT(ThreadJoin(t[i], NULL) == 0);
+        ASSERT(misplaced[i] == 0);
+    }
+    return 0;
+}
+static int tickless_ran;
+static int tickless_thread(int argl, void *args) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    tickless_ran = 1;
+    return 0;
+}
+BOOT_TEST(test_tickless_core,
+          "Test that a thread running alone on a core takes no quantum alarms, "
+                  "and that it is preempted once another thread is queued on its core."
+) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    int alarms = cpu_irq_stats(0, ALARM, NULL);
+    double end = wall_msec() + 200;
+    while (wall_msec() < end);
+    ASSERT(cpu_irq_stats(0, ALARM, NULL) - alarms <= 1);
+    tickless_ran = 0;
+    Tid_t t = CreateThread(tickless_thread, 0, NULL);
+    end = wall_msec() + 2000;
+    while (!__atomic_load_n(&tickless_ran, __ATOMIC_ACQUIRE) && wall_msec() < end);
+    ASSERT(tickless_ran);
+    ASSERT(ThreadJoin(t, NULL) == 0);
+    return 0;
+}
+static volatile int prio_spins, prio_stop, prio_waiting, prio_go, prio_woken;
+static Mutex prio_mx = MUTEX_INIT;
+static CondVar prio_cv = COND_INIT;
+static int prio_spinner(int argl, void *args) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    while (!prio_stop) { prio_spins++; }
+    return 0;
+}
+static int prio_waiter(int argl, void *args) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_FIFO, 3) == 0);
+    Mutex_Lock(&prio_mx);
+    prio_waiting = 1;
+    while (!prio_go) { Cond_Wait(&prio_mx, &prio_cv); }
+    prio_woken = 1;
+    Mutex_Unlock(&prio_mx);
+    return 0;
+}
+static int prio_signaller(int argl, void *args) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 2) == 0);
+    Sleep(50);
+    Mutex_Lock(&prio_mx);
+    prio_go = 1;
+    Cond_Signal(&prio_cv);
+    Mutex_Unlock(&prio_mx);
+    return 0;
+}
+BOOT_TEST(test_thread_priority,
+          "Test that a FIFO thread is not preempted by a normal thread, and that a "
+                  "real-time thread woken from another core preempts a less urgent one."
+) {
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_NORMAL, 1) == -1);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_FIFO, MAX_RT_PRIORITY) == -1);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_RR, -1) == -1);
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    /* A normal thread queued on our core never runs while we are FIFO */
+    Tid_t t = CreateThread(prio_spinner, 0, NULL);
+    while (prio_spins == 0);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_FIFO, 1) == 0);
+    int spins = prio_spins;
+    double end = wall_msec() + 200;
+    while (wall_msec() < end);
+    ASSERT(prio_spins == spins);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_NORMAL, 0) == 0);
+    prio_stop = 1;
+    ASSERT(ThreadJoin(t, NULL) == 0);
+    if (cpu_cores() < 2) { return 0; }
+    /* A more urgent thread woken from core 1 takes core 0 from us */
+    Tid_t w = CreateThread(prio_waiter, 0, NULL);
+    while (!prio_waiting);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_FIFO, 1) == 0);
+    Tid_t s = CreateThread(prio_signaller, 0, NULL);
+    end = wall_msec() + 1000;
+    while (!prio_woken && wall_msec() < end);
+    ASSERT(prio_woken);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_NORMAL, 0) == 0);
+    ASSERT(ThreadJoin(w, NULL) == 0);
+    ASSERT(ThreadJoin(s, NULL) == 0);
+    return 0;
+}
+static Mutex pi_mx = MUTEX_INIT;
+static volatile int pi_locked, pi_hogging, pi_got, pi_timed_out;
+static int pi_low(int argl, void *args) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    Mutex_Lock(&pi_mx);
+    pi_locked = 1;
+    /* Hold the mutex for 20 msec of our own time, after the hog has started */
+    while (!pi_hogging);
+    double end = wall_msec() + 20;
+    while (wall_msec() < end);
+    Mutex_Unlock(&pi_mx);
+    return 0;
+}
+static int pi_medium(int argl, void *args) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_FIFO, 1) == 0);
+    /* Be woken up, so as to preempt the low thread */
+    Sleep(10);
+    pi_hogging = 1;
+    double end = wall_msec() + 2000;
+    while (!pi_got && wall_msec() < end);
+    pi_timed_out = !pi_got;
+    return 0;
+}
+static int pi_high(int argl, void *args) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    ASSERT(SetThreadPriority(NOTHREAD, SCHED_CLASS_FIFO, 5) == 0);
+    /* Once the hog has started, wake up and preempt it */
+    while (!pi_hogging) { Sleep(1); }
+    Mutex_Lock(&pi_mx);
+    pi_got = 1;
+    Mutex_Unlock(&pi_mx);
+    return 0;
+}
+BOOT_TEST(test_mutex_priority_inheritance,
+          "Test that a real-time thread waiting for a mutex held by a normal thread, "
+                  "while a less urgent real-time thread hogs the core, gets the mutex in time.",
+          .minimum_cores = 2
+) {
+    /* Stay off core 0, where the three threads run */
+    ASSERT(SetThreadAffinity(NOTHREAD, 2) == 0);
+    pi_locked = pi_hogging = pi_got = pi_timed_out = 0;
+    Tid_t low = CreateThread(pi_low, 0, NULL);
+    while (!pi_locked);
+    Tid_t high = CreateThread(pi_high, 0, NULL);
+    Tid_t medium = CreateThread(pi_medium, 0, NULL);
+    ASSERT(ThreadJoin(high, NULL) == 0);
+    ASSERT(ThreadJoin(medium, NULL) == 0);
+    ASSERT(ThreadJoin(low, NULL) == 0);
+    ASSERT(pi_got && !pi_timed_out);
+    return 0;
+}
+static volatile int stack_hold;
+static int stack_user(int argl, void *args) {
+    volatile char buf[argl];
+    for (int i = 0; i < argl; i += 512) { buf[i] = 1; }
+    buf[argl - 1] = 1;
+    while (stack_hold) { Sleep(1); }
+    return buf[0];
+}
+BOOT_TEST(test_thread_stack_size,
+          "Test that CreateThreadEx gives threads the requested stack size, and that "
+                  "the stack use is reported by OpenInfo."
+) {
+    ASSERT(CreateThreadEx(stack_user, 1, NULL, MAX_STACK_SIZE + 1) == NOTHREAD);
+    ASSERT(ExecEx(stack_user, 1, NULL, MAX_STACK_SIZE + 1) == NOPROC);
+    /* A thread using more than the default stack */
+    stack_hold = 0;
+    int exitval;
+    Tid_t t = CreateThreadEx(stack_user, 512 * 1024, NULL, 1024 * 1024);
+    ASSERT(t != NOTHREAD);
+    ASSERT(ThreadJoin(t, &exitval) == 0);
+    ASSERT(exitval == 1);
+    /* A shallow thread on a large stack */
+    stack_hold = 1;
+    t = CreateThreadEx(stack_user, 64 * 1024, NULL, 4 * 1024 * 1024);
+    Sleep(50);
+    Fid_t finfo = OpenInfo();
+    ASSERT(finfo != NOFILE);
+    procinfo info;
+    int found = 0;
+    while (Read(finfo, (char *) &info, sizeof(info)) == sizeof(info)) {
+        if (info.pid != GetPid()) { continue; }
+        for (uint j = 0; j < info.threads_listed; j++) {
+            if (info.threads[j].tid != t) { continue; }
+            ASSERT(info.threads[j].stack_size == 4 * 1024 * 1024);
+            ASSERT(info.threads[j].stack_used >= 64 * 1024);
+            ASSERT(info.threads[j].stack_used < 128 * 1024);
+            found++;
+        }
+    }
+    Close(finfo);
+    ASSERT(found == 1);
+    stack_hold = 0;
+    ASSERT(ThreadJoin(t, &exitval) == 0);
+    return 0;
+}
+static Mutex retire_mx = MUTEX_INIT;
+static int retire_locker(int argl, void *args) {
+    for (int i = 0; i < 50; i++) {
+        Mutex_Lock(&retire_mx);
+        for (volatile int k = 0; k < 1000; k++);
+        Mutex_Unlock(&retire_mx);
+    }
+    return 0;
+}
+static int count_mappings() {
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL) { return -1; }
+    int lines = 0;
+    for (int c; (c = fgetc(maps)) != EOF;) { lines += (c == '\n'); }
+    fclose(maps);
+    return lines;
+}
+BOOT_TEST(test_thread_retired_unmapped,
+          "Test that the blocks of threads with other stack sizes are unmapped beyond TCB_RETIRED_MAX, "
+                  "while their threads contend for a mutex."
+) {
+    int before = count_mappings();
+    ASSERT(before > 0);
+    /* A new stack size each round, so that no block is reused */
+    for (int r = 0; r < 40; r++) {
+        Tid_t t[8];
+        for (int i = 0; i < 8; i++) {
+            t[i] = CreateThreadEx(retire_locker, 0, NULL, 64 * 1024 + r * 4096);
+            ASSERT(t[i] != NOTHREAD);
+        }
+        for (int i = 0; i < 8; i++) { ASSERT(ThreadJoin(t[i], NULL) == 0); }
+    }
+    /* Two mappings per block, the guard page and the rest */
+    ASSERT(count_mappings() - before < 2 * (TCB_RETIRED_MAX + 8) + 100);
+    return 0;
+}
+static int gang_sum(int argl, void *args) {
+    int *sum = args;
+    for (int i = 0; i < 1000; i++) { __atomic_add_fetch(sum, 1, __ATOMIC_RELAXED); }
+    return argl;
+}
+static int gang_spin(int argl, void *args) {
+    double end = wall_msec() + argl;
+    while (wall_msec() < end);
+    return argl;
+}
+static unsigned long gang_pulls() {
+    unsigned long pulls = 0;
+    for (uint c = 0; c < cpu_cores(); c++) { pulls += __atomic_load_n(&cctx[c].rq.gang_pulls, __ATOMIC_RELAXED); }
+    return pulls;
+}
+BOOT_TEST(test_thread_gang,
+          "Test that gang threads of a process are created, scheduled and joined normally, "
+                  "and that on many cores their siblings are sent to run beside them."
+) {
+    ASSERT(SetThreadGang(NOTHREAD, 1) == 0);
+    ASSERT(SetThreadGang(12345, 1) == -1);
+    int sum = 0;
+    Tid_t t[8];
+    for (int i = 0; i < 8; i++) {
+        t[i] = CreateThread(gang_sum, i, &sum);
+        ASSERT(t[i] != NOTHREAD);
+    }
+    for (int i = 0; i < 8; i++) {
+        int exitval;
+        ASSERT(ThreadJoin(t[i], &exitval) == 0);
+        ASSERT(exitval == i);
+    }
+    ASSERT(sum == 8000);
+    if (cpu_cores() >= 2) {
+        /* The core of another process is preempted to co-schedule the gang */
+        unsigned long pulls = gang_pulls();
+        Pid_t cpid = Exec(gang_spin, 300, NULL);
+        ASSERT(cpid != NOPROC);
+        for (int i = 0; i < 8; i++) {
+            t[i] = CreateThread(gang_spin, 100, NULL);
+            ASSERT(t[i] != NOTHREAD);
+        }
+        for (int i = 0; i < 8; i++) { ASSERT(ThreadJoin(t[i], NULL) == 0); }
+        ASSERT(WaitChild(cpid, NULL) == cpid);
+        ASSERT(gang_pulls() > pulls);
+    }
+    ASSERT(SetThreadGang(NOTHREAD, 0) == 0);
+    return 0;
+}
+static Mutex sleeping_mx = MUTEX_INIT;
+static int sleeping_count;
+static int sleeping_locker(int argl, void *args) {
+    for (int i = 0; i < argl; i++) {
+        Mutex_Lock(&sleeping_mx);
+        int c = sleeping_count;
+        for (volatile int k = 0; k < 1000; k++);
+        sleeping_count = c + 1;
+        Mutex_Unlock(&sleeping_mx);
+    }
+    return 0;
+}
+BOOT_TEST(test_mutex_sleeping_waiters,
+          "Test that threads waiting for a held mutex sleep in its wait queue, and "
+                  "that they all get the mutex after it is released."
+) {
+    sleeping_count = 0;
+    Mutex_Lock(&sleeping_mx);
+    Tid_t t[4];
+    for (int i = 0; i < 4; i++) { t[i] = CreateThread(sleeping_locker, 100, NULL); }
+    Sleep(100);
+    ASSERT(sleeping_mx.waiters != NULL);
+    Mutex_Unlock(&sleeping_mx);
+    for (int i = 0; i < 4; i++) { ASSERT(ThreadJoin(t[i], NULL) == 0); }
+    ASSERT(sleeping_count == 400);
+    ASSERT(sleeping_mx.waiters == NULL);
+    return 0;
+}
+static Mutex handoff_mx = MUTEX_INIT;
+static CondVar handoff_cv = COND_INIT;
+static int handoff_waiting, handoff_go, handoff_ran;
+static int handoff_waiter(int argl, void *args) {
+    SetThreadAffinity(NOTHREAD, 1);
+    Mutex_Lock(&handoff_mx);
+    handoff_waiting = 1;
+    while (!handoff_go) { Cond_Wait(&handoff_mx, &handoff_cv); }
+    handoff_ran = 1;
+    Mutex_Unlock(&handoff_mx);
+    return 0;
+}
+BOOT_TEST(test_cond_signal_handoff,
+          "Test that Cond_SignalHandoff switches straight to a waiter queued on the same core."
+) {
+    ASSERT(SetThreadAffinity(NOTHREAD, 1) == 0);
+    handoff_waiting = handoff_go = handoff_ran = 0;
+    Tid_t t = CreateThread(handoff_waiter, 0, NULL);
+    for (;;) {
+        Mutex_Lock(&handoff_mx);
+        int waiting = handoff_waiting;
+        handoff_go = waiting;
+        Mutex_Unlock(&handoff_mx);
+        if (waiting) { break; }
+        Sleep(1);
+    }
+    Cond_SignalHandoff(&handoff_cv);
+    ASSERT(handoff_ran == 1);
+    ASSERT(ThreadJoin(t, NULL) == 0);
+    /* Without waiters, it does nothing */
+    Cond_SignalHandoff(&handoff_cv);
+    return 0;
+}
+static Mutex fifo_mx = MUTEX_INIT;
+static CondVar fifo_cv = COND_INIT;
+static CondVar fifo_done_cv = COND_INIT;
+static int fifo_waiting, fifo_signals, fifo_woken;
+static int fifo_order[4];
+static int fifo_waiter(int argl, void *args) {
+    Mutex_Lock(&fifo_mx);
+    int ticket = fifo_waiting++;
+    while (fifo_signals == fifo_woken) { Cond_Wait(&fifo_mx, &fifo_cv); }
+    fifo_order[fifo_woken++] = ticket;
+    Cond_Signal(&fifo_done_cv);
+    Mutex_Unlock(&fifo_mx);
+    return 0;
+}
+BOOT_TEST(test_cond_signal_fifo,
+          "Test that Cond_Signal wakes up the waiters of a condition variable in the "
+                  "order they started waiting."
+) {
+    Tid_t t[4];
+    fifo_waiting = fifo_signals = fifo_woken = 0;
+    Mutex_Lock(&fifo_mx);
+    for (int i = 0; i < 4; i++) {
+        t[i] = CreateThread(fifo_waiter, 0, NULL);
+        /* The waiter is in the waitset once it lets go of the mutex */
+        while (fifo_waiting == i) {
+            Mutex_Unlock(&fifo_mx);
+            Sleep(1);
+            Mutex_Lock(&fifo_mx);
+        }
+    }
+    for (int i = 0; i < 4; i++) {
+        fifo_signals++;
+        Cond_Signal(&fifo_cv);
+        while (fifo_woken == i) { Cond_Wait(&fifo_mx, &fifo_done_cv); }
+        ASSERT(fifo_order[i] == i);
+    }
+    Mutex_Unlock(&fifo_mx);
+    for (int i = 0; i < 4; i++) { ASSERT(ThreadJoin(t[i], NULL) == 0); }
+    return 0;
+}
+static RwLock rw_lock = RWLOCK_INIT;
+static int rw_seq, rw_writer_at, rw_reader_at;
+static int rw_writer(int argl, void *args) {
+    RwLock_WriteLock(&rw_lock);
+    rw_writer_at = ++rw_seq;
+    RwLock_WriteUnlock(&rw_lock);
+    return 0;
+}
+static int rw_reader(int argl, void *args) {
+    RwLock_ReadLock(&rw_lock);
+    rw_reader_at = __atomic_add_fetch(&rw_seq, 1, __ATOMIC_SEQ_CST);
+    RwLock_ReadUnlock(&rw_lock);
+    return 0;
+}
+BOOT_TEST(test_rwlock_writer_preference,
+          "Test that readers share a RwLock, that a writer waits for the readers, "
+                  "and that new readers wait behind a waiting writer."
+) {
+    rw_seq = rw_writer_at = rw_reader_at = 0;
+    RwLock_ReadLock(&rw_lock);
+    /* Readers share the lock */
+    Tid_t t = CreateThread(rw_reader, 0, NULL);
+    ASSERT(ThreadJoin(t, NULL) == 0);
+    ASSERT(rw_reader_at == 1);
+    /* A writer waits for us, and a new reader waits for the writer */
+    Tid_t w = CreateThread(rw_writer, 0, NULL);
+    Sleep(50);
+    Tid_t r = CreateThread(rw_reader, 0, NULL);
+    Sleep(50);
+    ASSERT(rw_seq == 1);
+    RwLock_ReadUnlock(&rw_lock);
+    ASSERT(ThreadJoin(w, NULL) == 0);
+    ASSERT(ThreadJoin(r, NULL) == 0);
+    ASSERT(rw_writer_at == 2);
+    ASSERT(rw_reader_at == 3);
+    return 0;
+}
+static Semaphore sem_items = SEMAPHORE_INIT(0);
+static int sem_consumer(int argl, void *args) {
+    for (int i = 0; i < argl; i++) { Sem_P(&sem_items); }
+    return 0;
+}
+BOOT_TEST(test_semaphore,
+          "Test that Sem_P takes the units returned by Sem_V, sleeping when there are "
+                  "none, and that Sem_P_with_timeout times out."
+) {
+    Semaphore sem = SEMAPHORE_INIT(2);
+    Sem_P(&sem);
+    ASSERT(Sem_P_with_timeout(&sem, 10) == 1);
+    ASSERT(Sem_P_with_timeout(&sem, 10) == 0);
+    Sem_V(&sem);
+    ASSERT(Sem_P_with_timeout(&sem, 0) == 1);
+    /* A sleeping consumer gets the units as they come */
+    Tid_t t = CreateThread(sem_consumer, 100, NULL);
+    Sleep(20);
+    ASSERT(sem_items.waiters != NULL);
+    for (int i = 0; i < 100; i++) { Sem_V(&sem_items); }
+    ASSERT(ThreadJoin(t, NULL) == 0);
+    ASSERT(sem_items.count == 0 && sem_items.waiters == NULL);
+    return 0;
+}
+static Barrier barrier_test = BARRIER_INIT(4);
+static int barrier_round[4];
+static int barrier_last;
+static int barrier_party(int argl, void *args) {
+    for (int r = 1; r <= 50; r++) {
+        barrier_round[argl] = r;
+        if (Barrier_Wait(&barrier_test)) { __atomic_add_fetch(&barrier_last, 1, __ATOMIC_SEQ_CST); }
+        /* Nobody is a round behind, after the barrier */
+        for (int i = 0; i < 4; i++) {
+            if (barrier_round[i] < r) { return -1; }
+        }
+        Barrier_Wait(&barrier_test);
+    }
+    return 0;
+}
+BOOT_TEST(test_barrier_reusable,
+          "Test that a barrier holds its parties until all have arrived, round after "
+                  "round, and that one of them returns as the last."
+) {
+    Tid_t t[4];
+    barrier_last = 0;
+    for (int i = 0; i < 4; i++) { t[i] = CreateThread(barrier_party, i, NULL); }
+    for (int i = 0; i < 4; i++) {
+        int exitval;
+        ASSERT(ThreadJoin(t[i], &exitval) == 0);
+        ASSERT(exitval == 0);
+    }
+    ASSERT(barrier_last == 50);
+    ASSERT(barrier_test.arrived == 0 && barrier_test.waiters == NULL);
+    return 0;
+}
+static int load_spin(int argl, void *args) {
+    double end = wall_msec() + argl;
+    while (wall_msec() < end);
+    return 0;
+}
+BOOT_TEST(test_open_core_info,
+          "Test that OpenCoreInfo returns one entry per core, and that the load of "
+                  "busy cores is reported."
+) {
+    Tid_t t[4];
+    for (int i = 0; i < 4; i++) { t[i] = CreateThread(load_spin, 300, NULL); }
+    Sleep(200);
+    Fid_t finfo = OpenCoreInfo();
+    ASSERT(finfo != NOFILE);
+    coreinfo info;
+    uint cores = 0;
+    uint load = 0;
+    while (Read(finfo, (char *) &info, sizeof(info)) == sizeof(info)) {
+        ASSERT(info.core == cores);
+        load += info.load;
+        cores++;
+    }
+    Close(finfo);
+    ASSERT(cores == cpu_cores());
+    ASSERT(load >= 1000);
+    for (int i = 0; i < 4; i++) { ASSERT(ThreadJoin(t[i], NULL) == 0); }
+    return 0;
+}
+static volatile int fair_stop;
+static int fair_count(int argl, void *args) {
+    volatile unsigned long *count = args;
+    while (!fair_stop) { (*count)++; }
+    return 0;
+}
+static int fair_boot(int argl, void *args) {
+    /* The arguments are copied, so they hold a pointer to the counts */
+    unsigned long *count = *(unsigned long **) args;
+    ASSERT(sched_active_policy == &fair_policy);
+    Tid_t t[3];
+    fair_stop = 0;
+    for (int i = 0; i < 3; i++) { t[i] = CreateThread(fair_count, 0, &count[i]); }
+    Sleep(1000);
+    fair_stop = 1;
+    for (int i = 0; i < 3; i++) { ASSERT(ThreadJoin(t[i], NULL) == 0); }
+    return 0;
+}
+BARE_TEST(test_fair_policy,
+          "Test that the fair policy, selected before boot, gives CPU-bound threads "
+                  "proportional shares of a core."
+) {
+    const sched_policy *policy = sched_active_policy;
+    ASSERT(sched_set_policy("nosuch") == -1);
+    ASSERT(sched_set_policy("fair") == 0);
+    unsigned long count[3] = {0, 0, 0};
+    unsigned long *count_ptr = count;
+    boot(1, 0, fair_boot, sizeof(count_ptr), &count_ptr);
+    sched_active_policy = policy;
+    unsigned long least = count[0], most = count[0];
+    for (int i = 1; i < 3; i++) {
+        if (count[i] < least) { least = count[i]; }
+        if (count[i] > most) { most = count[i]; }
+    }
+    ASSERT(least > 0);
+    ASSERT(2 * least >= most);
+}
 TEST_SUITE(thread_tests,
            "A suite of tests for threads."
 )
         {
                 &test_create_join_thread,
                 &test_exit_many_threads,
+                &test_no_starvation_under_interactive_load,
+                &test_cond_wait_timeout,
+                &test_sleep,
+                &test_thread_affinity,
+                &test_tickless_core,
+                &test_thread_priority,
+                &test_mutex_priority_inheritance,
+                &test_thread_stack_size,
+                &test_thread_retired_unmapped,
+                &test_thread_gang,
+                &test_mutex_sleeping_waiters,
+                &test_cond_signal_handoff,
+                &test_cond_signal_fifo,
+                &test_rwlock_writer_preference,
+                &test_semaphore,
+                &test_barrier_reusable,
+                &test_open_core_info,
+                &test_fair_policy,
+                &test_thread_prefault,
                 NULL
         };
 /*********************************************